@@ -0,0 +1,259 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file   po-packbench.c
+ * @brief  Compare the size and lookup cost of packed map encodings.
+ *
+ * Builds a synthetic multi-tenant map (`/srv/tenants/<id>/{data,cache,logs}`)
+ * and packs it both plainly and front-coded (see `PO_PACK_FRONT_CODED`).
+ * For each encoding it reports the segment size per entry, the latency of
+ * lookups in a map attached to the segment (which scan every entry) and the
+ * cost of iterating over every entry's full name.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+/** Subdirectories pre-opened for each tenant. */
+static const char *subdirs[] = { "cache", "data", "logs" };
+
+#define	NSUBDIRS	(sizeof(subdirs) / sizeof(subdirs[0]))
+
+static void	usage(const char *argv0);
+static bool	measure(struct po_map *, unsigned int flags, const char *label,
+	unsigned int tenants, unsigned int lookups);
+static bool	count_entry(const char *, int, cap_rights_t);
+static uint64_t	now(void);
+
+/** Number of entries seen by count_entry. */
+static size_t counted;
+
+
+int
+main(int argc, char *argv[])
+{
+	struct po_map *map;
+	const char **names;
+	char name[64];
+	unsigned long tenants = 100000, lookups = 200;
+	size_t i, n;
+	bool shuffled = false;
+	int ch, dirfd, *fds, status = 0;
+
+	while ((ch = getopt(argc, argv, "l:n:s")) != -1) {
+		switch (ch) {
+		case 'l':
+			lookups = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			tenants = strtoul(optarg, NULL, 10);
+			break;
+
+		case 's':
+			shuffled = true;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc || tenants == 0 || tenants > 1000000
+	    || lookups == 0) {
+		usage(argv[0]);
+	}
+
+	// Every entry refers to the same directory: we only measure lookups.
+	dirfd = openat(AT_FDCWD, "/", O_RDONLY | O_DIRECTORY);
+	n = tenants * NSUBDIRS;
+	names = calloc(n, sizeof(*names));
+	fds = calloc(n, sizeof(*fds));
+	if (dirfd < 0 || names == NULL || fds == NULL) {
+		perror("setup");
+		return (1);
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "/srv/tenants/%06zu/%s",
+			i / NSUBDIRS, subdirs[i % NSUBDIRS]);
+		names[i] = strdup(name);
+		fds[i] = dirfd;
+		if (names[i] == NULL) {
+			perror("strdup");
+			return (1);
+		}
+	}
+
+	// Tenants added in no particular order share shorter prefixes.
+	if (shuffled) {
+		srandom(42);
+		for (i = n - 1; i > 0; i--) {
+			size_t j = random() % (i + 1);
+			const char *tmp = names[i];
+
+			names[i] = names[j];
+			names[j] = tmp;
+		}
+	}
+
+	map = po_map_create(n);
+	if (map == NULL || po_add_many(map, names, fds, n) == NULL) {
+		fprintf(stderr, "failed to build map: %s\n", po_last_error());
+		return (1);
+	}
+
+	printf("%zu entries (%lu tenants, %s order), %lu lookups\n", n,
+		tenants, shuffled ? "random" : "sorted", lookups);
+	printf("  %-12s %10s %8s %12s %12s %12s\n", "encoding", "bytes",
+		"B/entry", "hit (us)", "miss (us)", "foreach (us)");
+
+	if (!measure(map, 0, "plain", tenants, lookups)
+	    || !measure(map, PO_PACK_FRONT_CODED, "front-coded", tenants,
+	    lookups)) {
+		status = 1;
+	}
+
+	po_map_release(map);
+	for (i = 0; i < n; i++) {
+		free((char*) names[i]);
+	}
+	free(names);
+	free(fds);
+
+	return (status);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage:  %s [-n tenants] [-l lookups] [-s]\n", argv0);
+	exit(1);
+}
+
+static bool
+measure(struct po_map *map, unsigned int flags, const char *label,
+	unsigned int tenants, unsigned int lookups)
+{
+	struct po_map *attached;
+	struct po_relpath rel;
+	struct stat sb;
+	char path[96];
+	uint64_t hit, miss, start, walk;
+	size_t n;
+	int fd;
+
+	fd = po_pack_flags(map, flags);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		fprintf(stderr, "failed to pack map: %s\n", po_last_error());
+		return (false);
+	}
+
+	attached = po_attach(fd, -1, SIZE_MAX);
+	if (attached == NULL) {
+		fprintf(stderr, "failed to attach: %s\n", po_last_error());
+		close(fd);
+		return (false);
+	}
+
+	n = (size_t) tenants * NSUBDIRS;
+	srandom(1);
+
+	start = now();
+	for (unsigned int i = 0; i < lookups; i++) {
+		snprintf(path, sizeof(path), "/srv/tenants/%06lu/data/file",
+			random() % tenants);
+		rel = po_find_access(attached, path, PO_ACCESS_READ);
+		if (rel.dirfd == -1) {
+			fprintf(stderr, "%s: lookup of %s missed\n", label,
+				path);
+			return (false);
+		}
+	}
+	hit = now() - start;
+
+	start = now();
+	for (unsigned int i = 0; i < lookups; i++) {
+		snprintf(path, sizeof(path), "/srv/tenants/%06lu/tmp/file",
+			random() % tenants);
+		(void) po_find_access(attached, path, PO_ACCESS_READ);
+	}
+	miss = now() - start;
+
+	counted = 0;
+	start = now();
+	po_map_foreach(attached, count_entry);
+	walk = now() - start;
+
+	printf("  %-12s %10jd %8.1f %12.1f %12.1f %12.1f\n", label,
+		(intmax_t) sb.st_size, (double) sb.st_size / n,
+		hit / 1e3 / lookups, miss / 1e3 / lookups, walk / 1e3);
+
+	if (counted != n) {
+		fprintf(stderr, "%s: iterated over %zu of %zu entries\n",
+			label, counted, n);
+	}
+
+	po_map_release(attached);
+	close(fd);
+
+	return (counted == n);
+}
+
+static bool
+count_entry(const char *name, int fd, cap_rights_t rights)
+{
+	counted++;
+
+	return (true);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
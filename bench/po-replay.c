@@ -0,0 +1,643 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file   po-replay.c
+ * @brief  Replay a trace of path-based system calls through the libc
+ *         wrappers and report their latency and po_map hit rate.
+ *
+ * A trace is a text file with one directive or call per line:
+ *
+ *     # comment
+ *     preopen /usr/include          pre-open a directory into the po_map
+ *     dir     /usr/include/sys      create a directory in the synthetic tree
+ *     file    /usr/include/stdio.h  create an empty file in the synthetic tree
+ *     open    r|w|rw[c][t][d] PATH  open(2) (c: O_CREAT, t: O_TRUNC,
+ *                                   d: O_DIRECTORY) and close the result
+ *     stat    PATH
+ *     lstat   PATH
+ *     access  f|[r][w][x] PATH
+ *     unlink  PATH
+ *     rename  FROM TO
+ *
+ * Paths are absolute paths in the traced program's namespace: `preopen`,
+ * `dir` and `file` create them beneath a scratch root directory, and the
+ * calls pass them unmodified to the wrappers, which resolve them through the
+ * po_map. A call whose path isn't beneath any pre-opened directory misses,
+ * so the wrapper falls back to the host filesystem; to keep that harmless,
+ * calls that can modify the filesystem must hit the map.
+ *
+ * Traces should leave the tree as they found it (e.g., by unlinking any file
+ * that they create), since each one is replayed many times.
+ */
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+/** The longest path that a trace may contain (to match the sscanf format). */
+#define	MAXTOKEN	4096
+
+/* Exported by libpreopen for tests and tools, but not part of its API. */
+void po_set_libc_map(struct po_map *);
+
+enum call {
+	CALL_OPEN,
+	CALL_STAT,
+	CALL_LSTAT,
+	CALL_ACCESS,
+	CALL_UNLINK,
+	CALL_RENAME,
+	CALL_MAX,
+};
+
+static const char *call_names[CALL_MAX] = {
+	[CALL_OPEN] = "open",
+	[CALL_STAT] = "stat",
+	[CALL_LSTAT] = "lstat",
+	[CALL_ACCESS] = "access",
+	[CALL_UNLINK] = "unlink",
+	[CALL_RENAME] = "rename",
+};
+
+/** A single call from a trace. */
+struct op {
+	enum call	 call;
+	int		 arg;		/**< open(2) flags or access(2) mode */
+	char		*path;
+	char		*to;		/**< rename(2) target */
+	bool		 hit;		/**< resolved through the po_map */
+};
+
+/** A trace, loaded into memory, with its synthetic tree and po_map. */
+struct trace {
+	const char	*filename;
+	struct po_map	*map;
+	struct op	*ops;
+	size_t		 len;
+	size_t		 capacity;
+};
+
+/** Latency samples for one kind of call. */
+struct samples {
+	uint64_t	*ns;
+	size_t		 len;
+	size_t		 hits;
+	size_t		 ok;
+	uint64_t	 total;
+};
+
+static void	usage(const char *argv0);
+static bool	load(struct trace *, const char *root, FILE *);
+static bool	parse_access(const char *mode, int *amode, unsigned int *access);
+static bool	parse_open(const char *mode, int *flags, unsigned int *access);
+static bool	makepath(const char *root, const char *path, bool dir);
+static bool	replay(struct trace *, unsigned int iterations,
+	struct samples[CALL_MAX]);
+static void	report(const struct trace *, unsigned int iterations,
+	struct samples[CALL_MAX]);
+static int	remove_entry(const char *, const struct stat *, int,
+	struct FTW *);
+static int	compare_ns(const void *, const void *);
+static uint64_t	now(void);
+
+
+int
+main(int argc, char *argv[])
+{
+	struct samples samples[CALL_MAX];
+	struct trace trace;
+	struct po_map *empty;
+	char scratch[] = "/tmp/po-replay.XXXXXX";
+	const char *root = NULL;
+	unsigned int iterations = 100;
+	FILE *f;
+	int ch, status = 0;
+
+	while ((ch = getopt(argc, argv, "n:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'r':
+			root = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || iterations == 0) {
+		usage(argv[0]);
+	}
+
+	for (int i = optind; i < argc; i++) {
+		memset(&trace, 0, sizeof(trace));
+		memset(samples, 0, sizeof(samples));
+		trace.filename = argv[i];
+
+		f = fopen(argv[i], "r");
+		if (f == NULL) {
+			perror(argv[i]);
+			status = 1;
+			continue;
+		}
+
+		// Unless told otherwise, give each trace a fresh tree.
+		if (root == NULL || root == scratch) {
+			strcpy(scratch, "/tmp/po-replay.XXXXXX");
+			if (mkdtemp(scratch) == NULL) {
+				perror("mkdtemp");
+				return (1);
+			}
+			root = scratch;
+		}
+
+		trace.map = po_map_create(4);
+		if (trace.map == NULL || !load(&trace, root, f)) {
+			status = 1;
+		} else {
+			po_set_libc_map(trace.map);
+
+			// One untimed pass to warm up caches.
+			if (replay(&trace, 1, samples)
+			    && replay(&trace, iterations, samples)) {
+				report(&trace, iterations, samples);
+			} else {
+				status = 1;
+			}
+		}
+		fclose(f);
+
+		// Stop resolving paths against the trace's map, so that the
+		// scratch tree is removed using the paths we created it with.
+		if ((empty = po_map_create(1)) != NULL) {
+			po_set_libc_map(empty);
+			po_map_release(empty);
+		}
+
+		if (trace.map != NULL) {
+			po_map_release(trace.map);
+		}
+
+		if (root == scratch) {
+			nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+		}
+
+		for (size_t j = 0; j < CALL_MAX; j++) {
+			free(samples[j].ns);
+		}
+		for (size_t j = 0; j < trace.len; j++) {
+			free(trace.ops[j].path);
+			free(trace.ops[j].to);
+		}
+		free(trace.ops);
+	}
+
+	return (status);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage:  %s [-n iterations] [-r root] trace...\n",
+		argv0);
+	exit(1);
+}
+
+static bool
+load(struct trace *trace, const char *root, FILE *f)
+{
+	char line[3 * MAXTOKEN];
+	char dirname[PATH_MAX];
+	char verb[16], a[MAXTOKEN], b[MAXTOKEN], c[MAXTOKEN];
+	unsigned int access;
+	struct op *op;
+	size_t lineno = 0;
+	int fd, n;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		n = sscanf(line, "%15s %4095s %4095s %4095s", verb, a, b, c);
+		if (n <= 0 || verb[0] == '#') {
+			continue;
+		}
+
+		if (strcmp(verb, "preopen") == 0 && n == 2) {
+			snprintf(dirname, sizeof(dirname), "%s%s", root, a);
+			if (!makepath(root, a, true)) {
+				goto err;
+			}
+
+			fd = openat(AT_FDCWD, dirname, O_RDONLY | O_DIRECTORY);
+			if (fd < 0 || po_add(trace->map, a, fd) == NULL) {
+				goto err;
+			}
+			continue;
+		}
+
+		if ((strcmp(verb, "dir") == 0 || strcmp(verb, "file") == 0)
+		    && n == 2) {
+			if (!makepath(root, a, verb[0] == 'd')) {
+				goto err;
+			}
+			continue;
+		}
+
+		if (trace->len == trace->capacity) {
+			trace->capacity = trace->capacity ? 2 * trace->capacity
+				: 64;
+			op = realloc(trace->ops,
+				trace->capacity * sizeof(*trace->ops));
+			if (op == NULL) {
+				goto err;
+			}
+			trace->ops = op;
+		}
+
+		op = trace->ops + trace->len;
+		memset(op, 0, sizeof(*op));
+		access = 0;
+
+		if (strcmp(verb, "open") == 0 && n == 3
+		    && parse_open(a, &op->arg, &access)) {
+			op->call = CALL_OPEN;
+			op->path = strdup(b);
+		} else if (strcmp(verb, "stat") == 0 && n == 2) {
+			op->call = CALL_STAT;
+			op->path = strdup(a);
+		} else if (strcmp(verb, "lstat") == 0 && n == 2) {
+			op->call = CALL_LSTAT;
+			op->path = strdup(a);
+		} else if (strcmp(verb, "access") == 0 && n == 3
+		    && parse_access(a, &op->arg, &access)) {
+			op->call = CALL_ACCESS;
+			op->path = strdup(b);
+		} else if (strcmp(verb, "unlink") == 0 && n == 2) {
+			op->call = CALL_UNLINK;
+			op->path = strdup(a);
+			access = PO_ACCESS_WRITE;
+		} else if (strcmp(verb, "rename") == 0 && n == 3) {
+			op->call = CALL_RENAME;
+			op->path = strdup(a);
+			op->to = strdup(b);
+			access = PO_ACCESS_WRITE;
+		} else {
+			fprintf(stderr, "%s:%zu: malformed line\n",
+				trace->filename, lineno);
+			return (false);
+		}
+
+		if (op->path == NULL || (op->call == CALL_RENAME
+		    && op->to == NULL)) {
+			goto err;
+		}
+
+		if (op->path[0] != '/' || (op->to && op->to[0] != '/')) {
+			fprintf(stderr, "%s:%zu: relative path\n",
+				trace->filename, lineno);
+			return (false);
+		}
+
+		op->hit = po_find_access(trace->map, op->path, access).dirfd
+			!= -1;
+		if (op->to != NULL) {
+			op->hit = op->hit && po_find_access(trace->map, op->to,
+				access).dirfd != -1;
+		}
+
+		if (access & PO_ACCESS_WRITE && !op->hit) {
+			fprintf(stderr, "%s:%zu: %s outside of pre-opened"
+				" directories\n", trace->filename, lineno,
+				call_names[op->call]);
+			return (false);
+		}
+
+		trace->len++;
+	}
+
+	return (true);
+
+err:
+	fprintf(stderr, "%s:%zu: %s\n", trace->filename, lineno,
+		strerror(errno));
+	return (false);
+}
+
+static bool
+parse_access(const char *mode, int *amode, unsigned int *access)
+{
+	*amode = 0;
+
+	if (strcmp(mode, "f") == 0) {
+		*amode = F_OK;
+		return (true);
+	}
+
+	for (; *mode != '\0'; mode++) {
+		switch (*mode) {
+		case 'r':
+			*amode |= R_OK;
+			*access |= PO_ACCESS_READ;
+			break;
+
+		case 'w':
+			*amode |= W_OK;
+			*access |= PO_ACCESS_WRITE;
+			break;
+
+		case 'x':
+			*amode |= X_OK;
+			*access |= PO_ACCESS_EXEC;
+			break;
+
+		default:
+			return (false);
+		}
+	}
+
+	return (*amode != 0);
+}
+
+static bool
+parse_open(const char *mode, int *flags, unsigned int *access)
+{
+	bool rd = false, wr = false;
+
+	*flags = 0;
+
+	for (; *mode != '\0'; mode++) {
+		switch (*mode) {
+		case 'r':
+			rd = true;
+			break;
+
+		case 'w':
+			wr = true;
+			break;
+
+		case 'c':
+			*flags |= O_CREAT;
+			break;
+
+		case 't':
+			*flags |= O_TRUNC;
+			break;
+
+		case 'd':
+			*flags |= O_DIRECTORY;
+			break;
+
+		default:
+			return (false);
+		}
+	}
+
+	if (rd && wr) {
+		*flags |= O_RDWR;
+	} else if (wr) {
+		*flags |= O_WRONLY;
+	} else if (rd) {
+		*flags |= O_RDONLY;
+	} else {
+		return (false);
+	}
+
+	if (rd) {
+		*access |= PO_ACCESS_READ;
+	}
+
+	if (wr || (*flags & (O_CREAT | O_TRUNC))) {
+		*access |= PO_ACCESS_WRITE;
+	}
+
+	return (true);
+}
+
+static bool
+makepath(const char *root, const char *path, bool dir)
+{
+	char full[PATH_MAX];
+	char *slash;
+	size_t rootlen;
+	int fd;
+
+	if (path[0] != '/' || snprintf(full, sizeof(full), "%s%s", root, path)
+	    >= (int) sizeof(full)) {
+		errno = EINVAL;
+		return (false);
+	}
+
+	rootlen = strlen(root);
+	for (slash = full + rootlen + 1; (slash = strchr(slash, '/')) != NULL;
+	    slash++) {
+		*slash = '\0';
+		if (mkdir(full, 0755) != 0 && errno != EEXIST) {
+			return (false);
+		}
+		*slash = '/';
+	}
+
+	if (dir) {
+		return (mkdir(full, 0755) == 0 || errno == EEXIST);
+	}
+
+	fd = openat(AT_FDCWD, full, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		return (false);
+	}
+	close(fd);
+
+	return (true);
+}
+
+static bool
+replay(struct trace *trace, unsigned int iterations,
+	struct samples samples[CALL_MAX])
+{
+	struct stat sb;
+	struct samples *s;
+	struct op *op;
+	uint64_t start, ns;
+	int result;
+
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		free(samples[i].ns);
+		memset(samples + i, 0, sizeof(samples[i]));
+	}
+
+	for (size_t i = 0; i < trace->len; i++) {
+		s = samples + trace->ops[i].call;
+		s->len += iterations;
+	}
+
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		if (samples[i].len == 0) {
+			continue;
+		}
+
+		samples[i].ns = calloc(samples[i].len, sizeof(uint64_t));
+		if (samples[i].ns == NULL) {
+			perror("calloc");
+			return (false);
+		}
+		samples[i].len = 0;
+	}
+
+	for (unsigned int n = 0; n < iterations; n++) {
+		for (size_t i = 0; i < trace->len; i++) {
+			op = trace->ops + i;
+			start = now();
+
+			switch (op->call) {
+			case CALL_OPEN:
+				result = open(op->path, op->arg, 0644);
+				break;
+
+			case CALL_STAT:
+				result = stat(op->path, &sb);
+				break;
+
+			case CALL_LSTAT:
+				result = lstat(op->path, &sb);
+				break;
+
+			case CALL_ACCESS:
+				result = access(op->path, op->arg);
+				break;
+
+			case CALL_UNLINK:
+				result = unlink(op->path);
+				break;
+
+			case CALL_RENAME:
+				result = rename(op->path, op->to);
+				break;
+
+			default:
+				result = -1;
+			}
+
+			ns = now() - start;
+
+			if (op->call == CALL_OPEN && result >= 0) {
+				close(result);
+			}
+
+			s = samples + op->call;
+			s->ns[s->len++] = ns;
+			s->total += ns;
+			s->hits += op->hit;
+			s->ok += (result >= 0);
+		}
+	}
+
+	return (true);
+}
+
+static void
+report(const struct trace *trace, unsigned int iterations,
+	struct samples samples[CALL_MAX])
+{
+	struct samples *s;
+	uint64_t total = 0;
+	size_t calls = 0, hits = 0;
+
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		total += samples[i].total;
+		calls += samples[i].len;
+		hits += samples[i].hits;
+	}
+
+	printf("%s: %zu calls x %u iterations, %.0f calls/s, %.1f%% hits\n",
+		trace->filename, trace->len, iterations,
+		total ? calls * 1e9 / total : 0.0,
+		calls ? 100.0 * hits / calls : 0.0);
+	printf("  %-8s %10s %12s %10s %10s %7s %7s\n", "call", "count",
+		"calls/s", "p50 (ns)", "p99 (ns)", "hit %", "ok %");
+
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		s = samples + i;
+		if (s->len == 0) {
+			continue;
+		}
+
+		qsort(s->ns, s->len, sizeof(*s->ns), compare_ns);
+
+		printf("  %-8s %10zu %12.0f %10ju %10ju %7.1f %7.1f\n",
+			call_names[i], s->len,
+			s->total ? s->len * 1e9 / s->total : 0.0,
+			(uintmax_t) s->ns[s->len / 2],
+			(uintmax_t) s->ns[(s->len * 99) / 100],
+			100.0 * s->hits / s->len, 100.0 * s->ok / s->len);
+	}
+}
+
+static int
+remove_entry(const char *path, const struct stat *sb, int type,
+	struct FTW *ftw)
+{
+	unlinkat(AT_FDCWD, path, type == FTW_DP ? AT_REMOVEDIR : 0);
+
+	return (0);
+}
+
+static int
+compare_ns(const void *x, const void *y)
+{
+	uint64_t a = *(const uint64_t *) x, b = *(const uint64_t *) y;
+
+	return ((a > b) - (a < b));
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
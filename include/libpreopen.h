@@ -35,8 +35,10 @@
 #define LIBPO_H
 
 #include <sys/cdefs.h>
+#include <sys/types.h>
 #include <sys/capsicum.h>
 
+#include <spawn.h>
 #include <stdbool.h>
 
 
@@ -68,6 +70,19 @@ typedef bool (po_map_iter_cb)(const char *dirname, int dirfd, cap_rights_t);
  */
 po_map_iter_cb	po_print_entry;
 
+/**
+ * @name Access modes
+ *
+ * Kinds of access to the files beneath a pre-opened directory, recorded for
+ * every entry in a @ref po_map (see `po_add_access` and `po_find_access`).
+ * @{
+ */
+#define	PO_ACCESS_READ		0x1	/**< files can be read */
+#define	PO_ACCESS_WRITE		0x2	/**< files can be created or written */
+#define	PO_ACCESS_EXEC		0x4	/**< files can be executed */
+#define	PO_ACCESS_ALL		0x7	/**< all of the above */
+/** @} */
+
 /**
  * A filesystem path, relative to a directory descriptor.
  */
@@ -86,6 +101,24 @@ struct po_relpath {
  */
 struct po_map* po_map_create(int capacity);
 
+/**
+ * Create a @ref po_map that overlays another map.
+ *
+ * Entries added to the overlay are private to it, but lookups with `po_find`
+ * search both the overlay and its base (which may itself be an overlay or a
+ * map returned by `po_attach` or `po_unpack`) and return the best match
+ * across all of them, preferring the overlay's entries in case of a tie.
+ * The base map's entries are not copied, so many overlays can share one large
+ * base map and each only pays for its own entries.
+ *
+ * The overlay holds a reference to @b base. Overlays cannot be packed,
+ * although `po_spawn_file_actions` packs a copy of all of their entries.
+ *
+ * @param   base      the map to overlay
+ * @param   capacity  the initial capacity of the overlay's private entries
+ */
+struct po_map* po_map_overlay(struct po_map *base, int capacity);
+
 /**
  * Release a reference to a @ref po_map.
  *
@@ -100,10 +133,27 @@ void po_map_release(struct po_map *);
  * particular order, until the entire map has been iterated over or until the
  * callback returns `false`.
  *
+ * Lazy entries (see `po_preopen_lazy`) that are not currently open are
+ * reported with a descriptor of -1.
+ *
  * @return   number of elements iterated over
  */
 size_t po_map_foreach(const struct po_map*, po_map_iter_cb);
 
+/**
+ * Close lazy entries (see `po_preopen_lazy`) that haven't been looked up
+ * for at least @b seconds: they will be opened again if they are needed.
+ *
+ * Descriptors returned by earlier lookups of these entries become invalid
+ * and their numbers may be reused for unrelated files, so this must only be
+ * called while no other thread is looking up paths in @b map or using a
+ * descriptor that a lookup returned (e.g., between batches of work).
+ * Frozen maps are never closed.
+ *
+ * @returns the number of entries that were closed
+ */
+size_t po_map_close_idle(struct po_map *map, unsigned int seconds);
+
 /**
  * Add an already-opened directory to a @ref po_map.
  *
@@ -114,6 +164,126 @@ size_t po_map_foreach(const struct po_map*, po_map_iter_cb);
  */
 struct po_map* po_add(struct po_map *map, const char *path, int fd);
 
+/**
+ * Add an already-opened directory to a @ref po_map, restricting the kinds of
+ * access that it will be used for.
+ *
+ * Entries added with `po_add` record the access modes that their descriptors
+ * allow (derived from Capsicum rights where available, or from the file's
+ * status flags otherwise). This function overrides that, so that, e.g., a
+ * directory can be registered twice: once for reading and once for writing.
+ *
+ * @param   map     the map to add the path->fd mapping to
+ * @param   path    the path that will map to this directory
+ * @param   fd      the directory descriptor
+ * @param   access  the `PO_ACCESS_*` modes that this entry supports
+ */
+struct po_map* po_add_access(struct po_map *map, const char *path, int fd,
+	unsigned int access);
+
+/**
+ * Add several already-opened directories to a @ref po_map at once.
+ *
+ * This is equivalent to calling `po_add` for each path/descriptor pair, but
+ * the map grows (at most) once for the whole batch. Either all of the entries
+ * are added or, on error, none of them are.
+ *
+ * @param   map     the map to add the path->fd mappings to
+ * @param   paths   the paths that will map to the directories
+ * @param   fds     the directory descriptors, one per path
+ * @param   n       the number of entries in @b paths and @b fds
+ *
+ * @returns @b map, or NULL on error
+ */
+struct po_map* po_add_many(struct po_map *map, const char *const paths[],
+	const int fds[], size_t n);
+
+/**
+ * Add a union directory to a @ref po_map: several directories, in priority
+ * order, that are all mapped to the same name.
+ *
+ * `po_find` and `po_find_access` treat the union like its first directory,
+ * but `po_find_existing` (and hence the libc wrappers) fall through to the
+ * next directory when a path doesn't exist in the one before it. The
+ * directory that each path was found in is cached, so repeated lookups of
+ * the same path don't probe every directory again.
+ *
+ * Packed maps cannot represent unions, so `po_pack` (and everything built on
+ * it, such as `po_map_save` and `po_spawn_file_actions`) fails with `EINVAL`
+ * for maps that contain them.
+ *
+ * @param   map     the map to add the union to
+ * @param   name    the name that all of the directories will map to
+ * @param   fds     the directory descriptors, highest priority first
+ * @param   n       the number of descriptors in @b fds
+ *
+ * @returns @b map, or NULL on error
+ */
+struct po_map* po_add_union(struct po_map *map, const char *name,
+	const int fds[], size_t n);
+
+/**
+ * How the libc wrappers should open files beneath a @ref po_map entry.
+ */
+struct po_io_policy {
+	/**
+	 * Flags added to every `open(2)`: any of `O_NOATIME`, `O_CLOEXEC`,
+	 * `O_DIRECT`, `O_SYNC` and `O_DSYNC` (where they are defined)
+	 */
+	int flags;
+
+	/**
+	 * Advice passed to `posix_fadvise(2)` for every file opened for
+	 * reading (e.g., `POSIX_FADV_SEQUENTIAL`)
+	 */
+	int advice;
+
+	/**
+	 * Number of bytes at the start of every file opened for reading to
+	 * start reading in the background (0 for none)
+	 */
+	off_t readahead;
+};
+
+/**
+ * Set the I/O policy that the libc wrappers apply to files opened beneath
+ * every entry in @b map named @b name (including all of a union's
+ * directories).
+ *
+ * Advice and readahead are given after the file has been opened, without
+ * waiting for any I/O, and failures to apply them are ignored. If the
+ * policy adds `O_NOATIME` and the caller isn't permitted to use it, the
+ * file is opened without it.
+ *
+ * Policies are not preserved by `po_pack`.
+ *
+ * @param   map     the map containing the entries
+ * @param   name    the entries' name
+ * @param   policy  the policy to apply (copied), or NULL for none
+ *
+ * @returns 0 on success, or -1 if no entry has the given name, the policy
+ *          has other flags (`EINVAL`) or the map cannot be modified
+ */
+int po_set_io_policy(struct po_map *map, const char *name,
+	const struct po_io_policy *policy);
+
+/**
+ * Ensure that a @ref po_map can hold at least @b capacity entries without
+ * needing to grow.
+ *
+ * @returns @b map, or NULL if memory could not be allocated (in which case
+ *          the map is unchanged)
+ */
+struct po_map* po_map_reserve(struct po_map *map, size_t capacity);
+
+/**
+ * Release any memory that a @ref po_map has reserved but is not using.
+ *
+ * @returns @b map, or NULL if memory could not be reallocated (in which case
+ *          the map is unchanged)
+ */
+struct po_map* po_map_shrink_to_fit(struct po_map *map);
+
 /**
  * Pre-open a path and store it in a @ref po_map for later use.
  *
@@ -129,6 +299,65 @@ struct po_map* po_add(struct po_map *map, const char *path, int fd);
  */
 int po_preopen(struct po_map *map, const char *path, int flags, ...);
 
+/**
+ * Add a path to a @ref po_map without opening it until it is needed.
+ *
+ * The path is opened the first time that a lookup chooses it as the best
+ * match, so maps can list many directories that are rarely used without
+ * paying for opening them all up front. If several threads need the entry
+ * at once, only one descriptor is kept.
+ *
+ * Lazy entries are opened with `openat(AT_FDCWD, ...)`, which is not possible
+ * in capability mode: open them first (e.g., by looking them up) or use
+ * `po_preopen` for directories that will be needed in a sandbox.
+ *
+ * @param   map     the map to add the path to
+ * @param   path    the path to open when it is needed
+ * @param   flags   flags to pass to `openat(2)`
+ *
+ * @returns 0 on success, -1 if the @ref po_map cannot store the entry
+ */
+int po_preopen_lazy(struct po_map *map, const char *path, int flags);
+
+/**
+ * A path to be pre-opened by `po_preopen_manifest`, along with the result
+ * of trying to open it.
+ */
+struct po_manifest_entry {
+	/** The path to pre-open (which is also the name it will map to) */
+	const char *path;
+
+	/** Flags to pass to `openat(2)` (e.g., `O_DIRECTORY`) */
+	int flags;
+
+	/** Set to the opened descriptor, or -1 if @b path couldn't be opened */
+	int fd;
+
+	/** Set to the `errno` value from a failure to open @b path, or 0 */
+	int error;
+};
+
+/**
+ * Pre-open many paths concurrently and store them in a @ref po_map.
+ *
+ * The paths in @b manifest are opened by a pool of up to @b nthreads threads
+ * (including the calling thread), overlapping the latency of slow filesystem
+ * lookups, and the successfully-opened ones are added to @b map in a single
+ * batch. A path that cannot be opened does not prevent the others from being
+ * added: its entry's `fd` is set to -1 and its `error` to the reason.
+ *
+ * @param   map       the map to add the path->fd mappings to
+ * @param   manifest  the paths to pre-open (results are stored here too)
+ * @param   n         the number of entries in @b manifest
+ * @param   nthreads  the maximum number of threads to open paths with
+ *
+ * @returns the number of paths that could not be opened, or -1 if the opened
+ *          directories could not be added to the map (in which case they
+ *          are closed again)
+ */
+int po_preopen_manifest(struct po_map *map,
+	struct po_manifest_entry manifest[], size_t n, int nthreads);
+
 /**
  * Find a directory whose path is a prefix of @b path and (on platforms that
  * support Capsicum) that has the rights required by @b rights.
@@ -146,12 +375,244 @@ struct po_relpath po_find(struct po_map *map, const char *path,
 	cap_rights_t *rights);
 
 /**
- * Retrieve a message from with the last libpreopen error.
+ * Find a directory whose path is a prefix of @b path and that supports all of
+ * the access modes in @b access.
+ *
+ * This works on all platforms: entries that don't support the required modes
+ * are skipped with a single bitmask test.
+ *
+ * @param   map     the map to look for a directory in
+ * @param   path    the path we want to find a pre-opened prefix for
+ * @param   access  the `PO_ACCESS_*` modes that a match must support
+ *                  (0 to accept any entry)
+ * @returns a @ref po_relpath, as for `po_find`
+ */
+struct po_relpath po_find_access(struct po_map *map, const char *path,
+	unsigned int access);
+
+/**
+ * Like `po_find_access`, but when the best match is a union directory (see
+ * `po_add_union`), find the first of its directories that contains the rest
+ * of @b path.
+ *
+ * If no directory in the union contains it, the first directory is returned
+ * (so that, e.g., new files are created there).
+ *
+ * @returns a @ref po_relpath, as for `po_find`
+ */
+struct po_relpath po_find_existing(struct po_map *map, const char *path,
+	unsigned int access);
+
+/**
+ * Make a map (and any map that it overlays) immutable.
+ *
+ * A frozen map can no longer be modified (e.g., by `po_add`), and lookups
+ * in it never allocate memory or synchronize with a shared segment: a
+ * segment-backed map is synchronized one last time while it is frozen.
+ * This makes frozen maps safe to search with `po_find_r` from signal
+ * handlers and between `vfork(2)` and `exec(2)`.
+ *
+ * Lazy entries (see `po_preopen_lazy`) are opened first, so that lookups
+ * in the frozen map never need to open anything.
+ *
+ * @returns 0 on success, or -1 if a lazy entry could not be opened (in which
+ *          case the map is not frozen)
+ */
+int po_map_freeze(struct po_map *map);
+
+/**
+ * Async-signal-safe version of `po_find_access`.
+ *
+ * This only works on maps that have been frozen with `po_map_freeze`.
+ * It does not allocate memory, take locks, or modify `errno` or the
+ * calling thread's libpreopen error state.
+ *
+ * @param   rel     filled in with the best-match directory and the remaining
+ *                  path (which points into @b path or to a static string)
+ *
+ * @returns 0 on success, ENOENT if no entry matches @b path, or EINVAL if
+ *          @b map is not frozen
+ */
+int po_find_r(struct po_map *map, const char *path, unsigned int access,
+	struct po_relpath *rel);
+
+/**
+ * Make @b map the po_map that the libc wrappers use in the calling thread.
+ *
+ * Each thread has a small stack of maps: while it is non-empty, the wrappers
+ * resolve paths against the map on top of the stack instead of the
+ * process-wide map, so that threads in a pool can each serve a different
+ * sandbox without locking or swapping global state. To fall back to the
+ * process-wide map's entries, push a `po_map_overlay` of it.
+ *
+ * Paths that are not in the thread's map are not sent to the descriptor
+ * broker (see `po_set_broker`), and relative paths are not resolved against
+ * the working directory set by `chdir` (which is shared by every thread):
+ * they are passed to libc unchanged, as misses.
+ *
+ * The stack holds a reference to @b map until it is popped. A thread should
+ * pop every map that it pushes before it exits.
+ *
+ * @returns 0 on success, -1 if the calling thread's stack is full
+ */
+int po_push_thread_map(struct po_map *map);
+
+/**
+ * Stop using the map most recently pushed by the calling thread.
+ *
+ * @returns 0 on success, -1 if the calling thread's stack is empty
+ */
+int po_pop_thread_map(void);
+
+/**
+ * Set the directories that the `dlopen` wrapper searches for libraries named
+ * without a '/' (after those in `LD_LIBRARY_PATH`).
+ *
+ * Each directory is resolved against the wrappers' po_map, so they should
+ * normally be pre-opened. This should be called before the wrappers are used
+ * by more than one thread.
+ *
+ * @param   path    directories separated by ':', or NULL to use the default
+ *                  (`PO_LIBRARY_PATH` if it is set, otherwise
+ *                  `/lib:/usr/lib:/usr/local/lib`)
+ *
+ * @returns 0 on success, -1 on error
+ */
+int po_set_library_path(const char *path);
+
+/**
+ * Ask a descriptor broker about paths that the libc wrappers cannot find.
+ *
+ * When a path is not in any map, the wrappers send it to the broker, which
+ * may reply with a descriptor for the path's parent directory. Granted
+ * directories are kept by libpreopen, so later lookups beneath them don't
+ * contact the broker again, and misses from concurrent threads are sent to
+ * the broker in batches. Only absolute paths are sent.
+ *
+ * A broker can also be given to a process in the `PO_BROKER_FD` environment
+ * variable. This should be called before the wrappers are used by more than
+ * one thread.
+ *
+ * @param   sock    a connected `AF_UNIX` socket of type `SOCK_SEQPACKET`,
+ *                  or -1 to stop using the broker
+ *
+ * @returns 0 on success, -1 on error
+ */
+int po_set_broker(int sock);
+
+/**
+ * Answer broker requests on @b sock until the client disconnects.
+ *
+ * This is a simple broker whose policy is a map of the directories that
+ * clients may use: a request is granted if the requested path's parent
+ * directory can be found in @b policy with the access that the client needs.
+ * Granted directories are limited to that access (with Capsicum, by limiting
+ * the descriptor's rights). Directories are opened one component at a time
+ * without following symbolic links, so neither links nor `..` can lead out
+ * of the directories in the policy. It is mostly useful for testing, or as
+ * a starting point for brokers with more interesting policies.
+ *
+ * @returns 0 when the client disconnects, -1 on error
+ */
+int po_broker_serve(int sock, struct po_map *policy);
+
+/**
+ * Cache the results of the `stat`, `lstat`, `access` and `eaccess` wrappers.
+ *
+ * Results (including failures such as `ENOENT`) are reused for up to
+ * @b ttl_ms milliseconds. Wrappers that change the filesystem, such as
+ * `unlink` and `rename`, discard them immediately. They are also discarded
+ * when a watched directory changes: on Linux, inotify watches the directory
+ * containing each cached path, and on FreeBSD, a kqueue watches the
+ * directory descriptors that paths are looked up in (noticing only entries
+ * being added, removed or renamed directly within them). Other changes,
+ * such as those made by other processes or by calls that aren't wrapped
+ * (e.g., `mkdir`), may go unnoticed for up to @b ttl_ms: for example,
+ * changes further up the tree, changes to files' metadata on FreeBSD, and
+ * any change on systems with neither inotify nor kqueue.
+ *
+ * Results are keyed by directory descriptor, so call this again (which
+ * discards all cached results) after closing descriptors that the wrappers
+ * may have used. The cache can also be enabled by setting `PO_STAT_CACHE` to
+ * a TTL in milliseconds.
+ *
+ * @param   ttl_ms  how long results may be used for, or 0 to stop caching
+ *
+ * @returns 0 on success, -1 if the cache could not be allocated
+ */
+int po_stat_cache(unsigned int ttl_ms);
+
+/**
+ * Make the libc wrappers resolve symbolic links beneath pre-opened
+ * directories themselves.
+ *
+ * Links are followed one path component at a time by rewriting the path
+ * that was looked up and searching the map again, so absolute link targets
+ * find the pre-opened directory that they point into (rather than failing
+ * because they escape the directory that the link is in) and relative
+ * targets may lead into other pre-opened directories. Combined with
+ * `po_stat_cache`, each link's target is only read once until the
+ * directory containing it changes.
+ *
+ * Resolution can also be enabled by setting `PO_RESOLVE_SYMLINKS` to 1.
+ */
+void po_resolve_symlinks(bool enable);
+
+/**
+ * Kinds of error that libpreopen functions can fail with.
+ */
+enum po_error {
+	/** No error has occurred (in the calling thread) */
+	PO_ERROR_NONE = 0,
+
+	/** A system call failed */
+	PO_ERROR_SYSTEM,
+
+	/** Memory allocation failed */
+	PO_ERROR_NOMEM,
+
+	/** An argument or po_map was not valid for the requested operation */
+	PO_ERROR_INVALID,
+
+	/** A packed po_map was malformed or of an unknown version */
+	PO_ERROR_FORMAT,
+
+	/** A po_map was too large to pack */
+	PO_ERROR_TOOBIG,
+};
+
+/**
+ * Retrieve a message describing the calling thread's last libpreopen error.
+ *
+ * Errors are recorded per thread, so failures in one thread do not overwrite
+ * another thread's diagnostics. The message is only formatted when this
+ * function is called, and remains valid until the thread's next call.
  *
  * @returns NULL if there are no errors, null-terminated string otherwise
  */
 const char* po_last_error(void);
 
+/**
+ * Retrieve the kind of the calling thread's last libpreopen error.
+ */
+enum po_error po_last_error_code(void);
+
+/**
+ * Create a shared segment that counts the lookups of many processes.
+ *
+ * Processes that find the segment's descriptor in their `PO_STATS_FD`
+ * environment variable count every lookup made by their libc wrappers in it
+ * (per wrapper and per pre-opened directory), as do their children.
+ * `po_spawn` passes the segment on to children along with their map.
+ * The `po-top` tool displays the counters while the processes run.
+ *
+ * @param   name    a `shm_open(2)` name that `po-top -a` can find the
+ *                  segment by, or NULL for an anonymous segment
+ *
+ * @returns the segment's descriptor, or -1 on error
+ */
+int po_stats_create(const char *name);
+
 /**
  * Pack a `struct po_map` into a shared memory segment.
  *
@@ -166,6 +627,142 @@ const char* po_last_error(void);
  */
 int po_pack(struct po_map *map);
 
+/**
+ * Store each name in a packed map as the length of the prefix that it
+ * shares with the previous entry's name plus the rest of the name.
+ *
+ * Maps whose names share long prefixes (e.g., `/srv/tenants/<id>/...`)
+ * pack into much smaller segments, especially if entries are added in
+ * sorted order. Lookups work directly on the compressed names and can skip
+ * comparing the shared prefixes, but reconstructing every name (e.g., for
+ * `po_map_foreach`) costs a copy per entry. Names must be shorter than
+ * `MAXPATHLEN`.
+ */
+#define	PO_PACK_FRONT_CODED	0x1
+
+/**
+ * Pack a `struct po_map` into a shared memory segment, like `po_pack`, with
+ * a choice of encoding.
+ *
+ * Later calls to `po_pack_update` and `po_pack_publish` keep using the
+ * segment's encoding.
+ *
+ * @param map     the map to pack into shared memory
+ * @param flags   `PO_PACK_*` flags (0 for the same encoding as `po_pack`)
+ *
+ * @returns       a file descriptor of a shared memory segment
+ *                (or -1 on error)
+ */
+int po_pack_flags(struct po_map *map, unsigned int flags);
+
+/**
+ * Append new entries from a `struct po_map` to an existing packed segment.
+ *
+ * Packed segments are append-only: if entries have been added to @b map since
+ * it was packed with `po_pack` (or since the last call to this function),
+ * they are written to the end of the segment and then published atomically.
+ * Existing entries are not copied again, and processes that have already
+ * mapped or unpacked the segment remain valid.
+ *
+ * @param map     the map that was previously packed into @b fd
+ * @param fd      a shared memory segment returned by `po_pack`
+ *
+ * @returns       0 on success, -1 on error
+ */
+int po_pack_update(struct po_map *map, int fd);
+
+/**
+ * Publish new entries from a `struct po_map` to processes attached to its
+ * shared segment.
+ *
+ * This works like `po_pack_update`, but first sends the directory descriptors
+ * of the new entries over each of the given sockets (which should be
+ * `AF_UNIX` sockets, one per child process that has inherited @b fd, whether
+ * or not it has called `po_attach` yet).
+ * Attached maps will pick up the new entries on their next lookup.
+ *
+ * @param map     the map that was previously packed into @b fd
+ * @param fd      a shared memory segment returned by `po_pack`
+ * @param socks   sockets connected to processes attached to @b fd
+ * @param nsocks  the number of sockets in @b socks
+ *
+ * @returns       0 on success, -1 if the segment could not be updated or if
+ *                descriptors could not be sent over one of the sockets
+ *                (in which case the other sockets and the segment are still
+ *                updated)
+ */
+int po_pack_publish(struct po_map *map, int fd, const int socks[],
+	size_t nsocks);
+
+/**
+ * Attach to a shared segment created by `po_pack`.
+ *
+ * Unlike `po_unpack`, this does not copy the segment's entries: lookups in the
+ * returned @ref po_map search the shared segment directly. When the segment's
+ * owner adds entries with `po_pack_publish`, the returned map will notice the
+ * change on its next lookup, receive the new directory descriptors from
+ * @b sock and start using the new entries. Lookups do not take locks.
+ *
+ * Entries cannot be added to the returned map with `po_add`. Descriptors
+ * received over @b sock belong to the returned map and are closed when it
+ * is released; inherited descriptors are left open.
+ *
+ * Only the first @b inherited entries use the descriptor numbers recorded in
+ * the segment, since only they were open when the caller inherited the
+ * segment. Later entries (even those published before the caller attached)
+ * can't be used until their descriptors arrive over @b sock.
+ *
+ * @param fd         a file containing a packed `po_map` representation
+ * @param sock       a socket that `po_pack_publish` sends descriptors to,
+ *                   or -1 if the map is never going to be updated
+ * @param inherited  the number of entries in the segment when the caller
+ *                   was forked (or `SIZE_MAX` if the caller owns the
+ *                   segment's descriptors itself)
+ */
+struct po_map* po_attach(int fd, int sock, size_t inherited);
+
+/**
+ * A callback that supplies the directory descriptor for a named entry when
+ * loading a saved @ref po_map.
+ *
+ * @returns   a directory descriptor, or -1 to leave the entry unused
+ */
+typedef int (po_map_resolver)(const char *name);
+
+/**
+ * Save a `struct po_map` to a file.
+ *
+ * The saved representation uses the same position-independent layout as
+ * `po_pack`, so it can be mapped and searched directly by `po_map_load`.
+ * Descriptors are not saved: they are meaningless outside of this process.
+ *
+ * @param map     the map to save
+ * @param fd      the file to write the map to (which is overwritten from
+ *                its start and truncated to the map's size; the file offset
+ *                is not used or changed)
+ *
+ * @returns       0 on success, -1 on error
+ */
+int po_map_save(struct po_map *map, int fd);
+
+/**
+ * Load a `struct po_map` saved by `po_map_save`.
+ *
+ * The file is mapped rather than read, and lookups search the mapping
+ * directly, so loading costs one pass over the entries to obtain their
+ * descriptors from @b resolver.
+ *
+ * Entries cannot be added to the returned map with `po_add`, but it can be
+ * used as the base of a `po_map_overlay`.
+ *
+ * @param fd        a file written by `po_map_save`
+ *                  (which may be closed once the map has been loaded)
+ * @param resolver  callback that supplies a directory descriptor for each
+ *                  entry name in the file (which the map takes ownership
+ *                  of: it is closed when the map is released)
+ */
+struct po_map* po_map_load(int fd, po_map_resolver resolver);
+
 /**
  * Unpack a `struct po_map` from a file.
  *
@@ -176,6 +773,46 @@ int po_pack(struct po_map *map);
  */
 struct po_map* po_unpack(int fd);
 
+/**
+ * Add actions to a set of `posix_spawn(3)` file actions that will let the
+ * spawned process inherit @b map.
+ *
+ * The map is packed with `po_pack` into a segment that the child can't
+ * modify. With Capsicum, the segment's descriptor is limited to reading and
+ * mapping it, and the map is only packed again after entries have been added
+ * to it (or its bases): as long as the map is unchanged, every spawn reuses
+ * the same segment. Without Capsicum, each call packs a new segment, so that
+ * a child can't change the map that its siblings inherit. An overlay (see
+ * `po_map_overlay`) is packed as a single map holding the entries of all of
+ * its layers, unless one of them is segment-backed (`EINVAL`). The segment
+ * and the map's directory descriptors (and no other descriptors, except for
+ * a statistics segment given by `PO_STATS_FD`) are made inheritable in the
+ * child by the file actions, even if they are close-on-exec in the parent.
+ *
+ * The cached segment belongs to @b map, so this must not be called
+ * concurrently with other modifications of the same map.
+ *
+ * @returns the segment's descriptor, which the child expects to find in
+ *          its `SHARED_MEMORYFD` environment variable (or -1 on error)
+ */
+int po_spawn_file_actions(struct po_map *map,
+	posix_spawn_file_actions_t *actions);
+
+/**
+ * Spawn a process that inherits @b map, like `posix_spawn(3)`.
+ *
+ * This uses `po_spawn_file_actions` to pass the map's cached segment and
+ * directory descriptors to the child, and sets `SHARED_MEMORYFD` in its
+ * environment (replacing any value in @b envp). Callers that need other file
+ * actions can call `po_spawn_file_actions` and `posix_spawn(3)` themselves.
+ *
+ * @param envp      the child's environment (or NULL to use `environ`)
+ *
+ * @returns 0 on success or an error number, as for `posix_spawn(3)`
+ */
+int po_spawn(pid_t *pid, const char *path, struct po_map *map,
+	const posix_spawnattr_t *attr, char *const argv[], char *const envp[]);
+
 __END_DECLS
 
 #endif /* !LIBPO_H */
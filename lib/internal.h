@@ -39,13 +39,20 @@
 #define LIBPO_INTERNAL_H
 
 #include <sys/cdefs.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 
 #ifdef WITH_CAPSICUM
 #include <sys/capsicum.h>
 #endif
 
 #include <assert.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "libpreopen.h"
 
@@ -63,24 +70,1102 @@ struct po_map_entry {
 	 */
 	const char *name;
 
-	/** File descriptor (which may be a directory) */
+	/**
+	 * File descriptor (which may be a directory), or -1 if this is a lazy
+	 * entry that is not currently open
+	 */
+	_Atomic(int) fd;
+
+	/** The PO_ACCESS_* modes that this entry can be used for */
+	unsigned int access;
+
+	/** How to open a lazy entry (NULL if the entry was added open) */
+	struct po_lazy_entry *lazy;
+
+	/**
+	 * Number of union directories starting with this entry (see
+	 * po_add_union), or 0 if this entry doesn't start a union
+	 */
+	unsigned int layers;
+
+	/** Identifies this entry's union in the union cache */
+	uint32_t union_id;
+
+	/** How to open files beneath this entry (or NULL for no policy) */
+	struct po_io_policy *policy;
+
+#ifdef WITH_CAPSICUM
+	/** Capability rights associated with the file descriptor */
+	cap_rights_t rights;
+#endif
+};
+
+/**
+ * How to open a po_map entry that was added with po_preopen_lazy.
+ *
+ * @internal
+ */
+struct po_lazy_entry {
+	/** The path to open */
+	char *path;
+
+	/** Flags to open the path with */
+	int flags;
+
+	/** When the entry was last looked up (CLOCK_MONOTONIC seconds) */
+	_Atomic(int64_t) last_used;
+};
+
+// Documented in external header file
+struct po_map {
+	//! @internal
+	_Atomic(int) refcount;
+	struct po_map_entry *entries;
+	size_t capacity;
+	size_t length;
+
+	/** Shared segment holding this map's entries (or NULL) */
+	struct po_map_segment *segment;
+
+	/** The map that this map overlays (or NULL) */
+	struct po_map *base;
+
+	/** Whether the map is immutable (see po_map_freeze) */
+	bool frozen;
+
+	/** Incremented whenever entries are added to the map */
+	uint32_t generation;
+
+	/** Segment cached by po_spawn_file_actions (or -1) */
+	int spawn_fd;
+
+	/** The map generation that @b spawn_fd was packed from */
+	uint32_t spawn_generation;
+
+	/** Identifies the map (unlike its address, never reused) */
+	uint64_t id;
+
+	/** Searches resolved against this map (see po_search), or NULL */
+	_Atomic(struct po_search_cache*) searches;
+};
+
+
+/**
+ * Magic number identifying a packed po_map ("popk").
+ *
+ * @internal
+ */
+#define	PO_PACKED_MAGIC		0x706f706b
+
+/**
+ * Version of the packed po_map representation.
+ *
+ * @internal
+ */
+#define	PO_PACKED_VERSION	2
+
+/**
+ * An entry in a po_packed_map.
+ *
+ * Entries are stored back-to-back after the po_packed_map header. Each one is
+ * immediately followed by its null-terminated name and enough padding to keep
+ * the next entry aligned (see po_packed_entrysize).
+ *
+ * @internal
+ */
+struct po_packed_entry {
+	/** Integer file descriptor */
+	int fd;
+
+	/** Length of the entry's name (not including the null terminator) */
+	int len;
+
+	/** The PO_ACCESS_* modes that this entry can be used for */
+	unsigned int access;
+
+	/** The entry's null-terminated name */
+	char name[];
+};
+
+/**
+ * Append-only, packed-in-a-buffer representation of a po_map.
+ *
+ * Entries are only ever appended to a packed map: new entries and their names
+ * are written after the currently-published ones and then made visible by
+ * updating @b length and @b count. Readers that load @b count with acquire
+ * semantics will see fully-written entries, and a reader that mapped the
+ * segment before it grew can keep using its (shorter) mapping.
+ *
+ * @internal
+ */
+struct po_packed_map {
+	/** Always PO_PACKED_MAGIC */
+	uint32_t magic;
+
+	/** Always PO_PACKED_VERSION */
+	uint32_t version;
+
+	/**
+	 * How entries are encoded: PO_PACK_FRONT_CODED if they are
+	 * po_packed_fcentry values, otherwise po_packed_entry values
+	 */
+	uint32_t flags;
+
+	/**
+	 * Generation counter, incremented to an odd value before entries are
+	 * appended and to the following even value once they are published.
+	 *
+	 * Since entries are only ever appended, readers never need to retry:
+	 * they use the generation to cheaply detect that there is something
+	 * new to synchronize with.
+	 */
+	_Atomic(uint32_t) generation;
+
+	/** The number of published po_packed_entry values */
+	_Atomic(uint32_t) count;
+
+	/** Number of bytes of published entries following this header */
+	_Atomic(uint32_t) length;
+
+	/** The actual packed entries */
+	char entries[];
+};
+
+/**
+ * The number of bytes occupied by a po_packed_entry with a name of length
+ * @b namelen, including the name's null terminator and alignment padding.
+ *
+ * @internal
+ */
+static inline size_t
+po_packed_entrysize(size_t namelen)
+{
+	size_t size = sizeof(struct po_packed_entry) + namelen + 1;
+	size_t align = _Alignof(struct po_packed_entry);
+
+	return ((size + align - 1) & ~(align - 1));
+}
+
+/**
+ * An entry in a front-coded po_packed_map (see PO_PACK_FRONT_CODED).
+ *
+ * Each entry's name is stored as the length of the prefix that it shares
+ * with the previous entry's name followed by the rest of the name, so maps
+ * whose names have long common prefixes take much less space. Entries are
+ * stored back-to-back like po_packed_entry values (see
+ * po_packed_fcentrysize).
+ *
+ * @internal
+ */
+struct po_packed_fcentry {
+	/** Integer file descriptor */
+	int fd;
+
+	/** Length of the prefix shared with the previous entry's name */
+	uint16_t shared;
+
+	/** Length of @b suffix */
+	uint16_t suffixlen;
+
+	/** The PO_ACCESS_* modes that this entry can be used for */
+	uint8_t access;
+
+	/** The rest of the entry's name (not null-terminated) */
+	char suffix[];
+};
+
+/**
+ * The number of bytes occupied by a po_packed_fcentry with a suffix of
+ * length @b suffixlen, including alignment padding.
+ *
+ * @internal
+ */
+static inline size_t
+po_packed_fcentrysize(size_t suffixlen)
+{
+	size_t size = offsetof(struct po_packed_fcentry, suffix) + suffixlen;
+	size_t align = _Alignof(struct po_packed_fcentry);
+
+	return ((size + align - 1) & ~(align - 1));
+}
+
+/**
+ * A position in a packed map's entries, for reading both plain and
+ * front-coded entries (see po_packed_next).
+ *
+ * @internal
+ */
+struct po_packed_cursor {
+	/** The packed map being read */
+	const struct po_packed_map *packed;
+
+	/** Offset of the next entry in the packed map's entry area */
+	size_t offset;
+
+	/** Number of bytes of entries that may be read */
+	size_t limit;
+
+	/** Whether the entries are po_packed_fcentry values */
+	bool front_coded;
+
+	/** Whether to reconstruct the full names of front-coded entries */
+	bool names;
+
+	/** The current entry's descriptor */
+	int fd;
+
+	/** The current entry's PO_ACCESS_* modes */
+	unsigned int access;
+
+	/** Length of the current entry's name */
+	size_t len;
+
+	/** Length of the prefix shared with the previous entry's name */
+	size_t shared;
+
+	/** The current entry's name, after the first @b shared bytes */
+	const char *suffix;
+
+	/**
+	 * The current entry's full, null-terminated name (NULL for front-coded
+	 * entries unless @b names is set)
+	 */
+	const char *name;
+
+	/** Where front-coded names are reconstructed */
+	char buffer[MAXPATHLEN];
+};
+
+/**
+ * Start reading a packed map's entries at byte @b offset of its entry area,
+ * reading no further than @b limit bytes.
+ *
+ * @param names     whether to reconstruct the names of front-coded entries,
+ *                  which is only possible when starting at offset 0
+ *
+ * @internal
+ */
+void	po_packed_cursor_init(struct po_packed_cursor *,
+	const struct po_packed_map *, size_t offset, size_t limit,
+	bool names);
+
+/**
+ * Move a cursor to the next entry.
+ *
+ * @returns false if there are no more entries or the next one is truncated
+ *          or malformed
+ *
+ * @internal
+ */
+bool	po_packed_next(struct po_packed_cursor *);
+
+/**
+ * Find the entry at byte @b offset of a packed map's entry area, checking
+ * that the entry (including its name) lies within the first @b limit bytes.
+ *
+ * @returns the entry, or NULL if it is truncated or malformed
+ *
+ * @internal
+ */
+const struct po_packed_entry*	po_packed_entry_at(
+	const struct po_packed_map *, size_t offset, size_t limit);
+
+/**
+ * Map a packed po_map from a file and check that it looks like something
+ * we know how to read.
+ *
+ * @param fd      the file containing the packed map
+ * @param prot    memory protection to map the file with
+ * @param sizep   filled in with the size of the mapping
+ *
+ * @internal
+ */
+struct po_packed_map*	po_packed_mmap(int fd, int prot, size_t *sizep);
+
+/**
+ * Header of a message carrying new directory descriptors for a shared
+ * segment from `po_pack_publish` to `po_attach`ed maps.
+ *
+ * The descriptors themselves are attached as `SCM_RIGHTS` control data.
+ *
+ * @internal
+ */
+struct po_fd_message {
+	/** Index of the packed entry that the first descriptor belongs to */
+	uint32_t first;
+
+	/** Number of descriptors in this message */
+	uint32_t count;
+};
+
+/**
+ * Maximum number of descriptors sent in a single po_fd_message.
+ *
+ * @internal
+ */
+#define	PO_FDS_PER_MESSAGE	32
+
+/**
+ * An immutable snapshot of a shared segment, as seen by one process.
+ *
+ * Lookups use the most recently published view without taking any locks;
+ * synchronizing with the segment creates a new view rather than modifying
+ * an existing one. Superseded views are freed by a later synchronization
+ * once no lookup can still be using them (see po_map_segment::readers), or
+ * else when the map is released.
+ *
+ * @internal
+ */
+struct po_segment_view {
+	/** The (read-only) mapping of the packed map */
+	const struct po_packed_map *packed;
+
+	/** Size of the mapping */
+	size_t size;
+
+	/** Whether this view is the first to use @b packed (and must unmap it) */
+	bool owns_mapping;
+
+	/** The segment generation that this view reflects */
+	uint32_t generation;
+
+	/** The number of packed entries visible in this view */
+	uint32_t count;
+
+	/** Number of bytes of packed entries visible in this view */
+	size_t limit;
+
+	/** The previous (superseded) view, if it hasn't been freed yet */
+	struct po_segment_view *prev;
+
+	/** Length of @b fds (which may exceed @b count) */
+	size_t nfds;
+
+	/** Local descriptors for packed entries (-1 if not yet received) */
+	int fds[];
+};
+
+/**
+ * State of a po_map whose entries live in a shared segment rather than in
+ * the po_map itself.
+ *
+ * @internal
+ */
+struct po_map_segment {
+	/** The current view of the segment */
+	_Atomic(struct po_segment_view*) view;
+
+	/** Descriptor of the segment (used to remap it as it grows) */
 	int fd;
 
-#ifdef WITH_CAPSICUM
-	/** Capability rights associated with the file descriptor */
-	cap_rights_t rights;
-#endif
+	/** Socket that new descriptors arrive on (or -1) */
+	int sock;
+
+	/**
+	 * Number of entries in the segment when this process inherited it
+	 * (see po_attach): their descriptors were inherited rather than sent
+	 * over @b sock.
+	 */
+	size_t inherited;
+
+	/** Held while synchronizing with the segment */
+	atomic_flag syncing;
+
+	/**
+	 * Number of lookups using a view of the segment: superseded views
+	 * can be freed when there are none besides the synchronizing thread.
+	 */
+	_Atomic(unsigned int) readers;
+
+	/** Set once the map is frozen: the current view is final */
+	_Atomic(bool) frozen;
+};
+
+/**
+ * Find the best match for @b path in a segment-backed po_map,
+ * synchronizing with the segment first if it has changed.
+ *
+ * @param   access    the PO_ACCESS_* modes that a match must support
+ * @param   bestlenp  the length of the best match found so far (which is
+ *                    updated if a better match is found)
+ *
+ * @returns the descriptor of the best match, or -1 if nothing better than
+ *          @b bestlenp was found
+ *
+ * @internal
+ */
+int	po_segment_find(struct po_map_segment *, const char *path,
+	unsigned int access, size_t *bestlenp);
+
+/**
+ * Iterate over the entries of a segment-backed po_map.
+ *
+ * @internal
+ */
+size_t	po_segment_foreach(struct po_map_segment *, po_map_iter_cb);
+
+/**
+ * Synchronize with a segment one last time and stop synchronizing with it:
+ * later lookups only use the resulting view.
+ *
+ * @internal
+ */
+void	po_segment_freeze(struct po_map_segment *);
+
+/**
+ * Release the resources held by a segment-backed po_map.
+ *
+ * @internal
+ */
+void	po_segment_release(struct po_map_segment *);
+
+/**
+ * Magic number identifying a trace segment ("potr").
+ *
+ * @internal
+ */
+#define	PO_TRACE_MAGIC		0x706f7472
+
+/**
+ * Version of the trace segment layout.
+ *
+ * @internal
+ */
+#define	PO_TRACE_VERSION	2
+
+/**
+ * The libc wrappers whose lookups can be traced.
+ *
+ * @internal
+ */
+enum po_trace_call {
+	PO_TRACE_OPEN,
+	PO_TRACE_ACCESS,
+	PO_TRACE_CHDIR,
+	PO_TRACE_CONNECT,
+	PO_TRACE_EACCESS,
+	PO_TRACE_LSTAT,
+	PO_TRACE_RENAME,
+	PO_TRACE_STAT,
+	PO_TRACE_UNLINK,
+	PO_TRACE_DLOPEN,
+	PO_TRACE_OPENDIR,
+	PO_TRACE_SCANDIR,
+	PO_TRACE_NFTW,
+	PO_TRACE_EXEC,
+	PO_TRACE_CALLS,
+};
+
+/**
+ * A sampled path lookup.
+ *
+ * @internal
+ */
+struct po_trace_record {
+	/** When the lookup happened (CLOCK_MONOTONIC, in nanoseconds) */
+	uint64_t timestamp;
+
+	/** 32-bit FNV-1a hash of the path that was looked up */
+	uint32_t hash;
+
+	/**
+	 * Descriptor of the directory the path was resolved against
+	 * (-1 if it was not found)
+	 */
+	int32_t entry;
+
+	/** Number of bytes of the path consumed by the match */
+	uint16_t matchlen;
+
+	/** The po_trace_call that did the lookup */
+	uint16_t call;
+};
+
+/**
+ * A single-producer, single-consumer ring of po_trace_record values.
+ *
+ * Each ring is owned by one thread, which appends records and then
+ * publishes them by advancing @b head; the draining process consumes them and
+ * advances @b tail. When the ring is full, new records are dropped rather than
+ * waiting for the drainer.
+ *
+ * @internal
+ */
+struct po_trace_ring {
+	/** Number of records ever written (only modified by the owner) */
+	_Alignas(64) _Atomic(uint64_t) head;
+
+	/** Number of records ever consumed (only modified by the drainer) */
+	_Alignas(64) _Atomic(uint64_t) tail;
+
+	/** Number of records dropped because the ring was full */
+	_Atomic(uint64_t) dropped;
+
+	/** The process that owns this ring (set before the first record) */
+	int32_t pid;
+
+	/**
+	 * Whether a thread owns this ring: rings are released when their
+	 * threads exit, so that later threads can claim them
+	 */
+	_Atomic(uint32_t) owned;
+
+	/** The records themselves (po_trace_segment::slots of them) */
+	struct po_trace_record records[];
+};
+
+/**
+ * A shared-memory segment that sampled lookups are recorded into.
+ *
+ * The segment is created by a tracing tool and handed to traced processes
+ * via the `PO_TRACE_FD` environment variable. Each thread that records a
+ * lookup claims one of the segment's rings for itself.
+ *
+ * @internal
+ */
+struct po_trace_segment {
+	/** Always PO_TRACE_MAGIC */
+	uint32_t magic;
+
+	/** Always PO_TRACE_VERSION */
+	uint32_t version;
+
+	/** Record one lookup out of every @b period (in each thread) */
+	uint32_t period;
+
+	/** Number of rings following this header */
+	uint32_t nrings;
+
+	/** Number of records in each ring (a power of two) */
+	uint32_t slots;
+
+	/** Number of rings claimed so far (may exceed @b nrings) */
+	_Atomic(uint32_t) claimed;
+
+	/** Samples that were not recorded because no ring was available */
+	_Atomic(uint64_t) unclaimed;
+};
+
+/**
+ * The size of one po_trace_ring with @b slots records, including padding to
+ * keep the next ring's header on its own cache line.
+ *
+ * @internal
+ */
+static inline size_t
+po_trace_ringsize(uint32_t slots)
+{
+	size_t size = sizeof(struct po_trace_ring)
+		+ slots * sizeof(struct po_trace_record);
+
+	return ((size + 63) & ~(size_t) 63);
+}
+
+/**
+ * The size of a trace segment with @b nrings rings of @b slots records.
+ *
+ * @internal
+ */
+static inline size_t
+po_trace_size(uint32_t nrings, uint32_t slots)
+{
+	size_t header = (sizeof(struct po_trace_segment) + 63) & ~(size_t) 63;
+
+	return (header + nrings * po_trace_ringsize(slots));
+}
+
+/**
+ * Find ring @b i of a trace segment.
+ *
+ * @internal
+ */
+static inline struct po_trace_ring*
+po_trace_ring_at(struct po_trace_segment *seg, uint32_t i)
+{
+	return ((struct po_trace_ring*) ((char*) seg + po_trace_size(i,
+		seg->slots)));
+}
+
+/**
+ * Record a sampled lookup in the trace segment given by `PO_TRACE_FD`
+ * (if there is one).
+ *
+ * The caller counts lookups itself and only calls this when its count runs
+ * out, so unsampled lookups cost nothing more than a decrement.
+ *
+ * @param   rel         the result of the lookup
+ * @param   matchlen    the length of the path prefix that the lookup matched
+ *                      (see po_match_length)
+ *
+ * @returns the number of lookups to skip before calling this again
+ *
+ * @internal
+ */
+uint32_t	po_trace_record(enum po_trace_call, const char *path,
+	struct po_relpath rel, size_t matchlen);
+
+/**
+ * Magic number identifying a statistics segment ("post").
+ *
+ * @internal
+ */
+#define	PO_STATS_MAGIC		0x706f7374
+
+/**
+ * Version of the statistics segment layout.
+ *
+ * @internal
+ */
+#define	PO_STATS_VERSION	1
+
+/**
+ * Number of copies of each counter in a statistics segment: each process
+ * only updates one copy, so that processes don't all contend for the same
+ * cache lines.
+ *
+ * @internal
+ */
+#define	PO_STATS_STRIPES	16
+
+/**
+ * Number of pre-opened directories that a statistics segment has counters
+ * for.
+ *
+ * @internal
+ */
+#define	PO_STATS_ENTRIES	128
+
+/**
+ * Longest directory name recorded in a statistics segment (including NUL).
+ *
+ * @internal
+ */
+#define	PO_STATS_NAMELEN	64
+
+/**
+ * Counters for one libc wrapper (in one stripe).
+ *
+ * @internal
+ */
+struct po_stats_call {
+	/** Number of lookups */
+	_Alignas(64) _Atomic(uint64_t) lookups;
+
+	/** Number of lookups that found a directory to use */
+	_Atomic(uint64_t) hits;
 };
 
-// Documented in external header file
-struct po_map {
-	//! @internal
-	int refcount;
-	struct po_map_entry *entries;
-	size_t capacity;
-	size_t length;
+/**
+ * A single counter on its own cache line.
+ *
+ * @internal
+ */
+struct po_stats_counter {
+	_Alignas(64) _Atomic(uint64_t) value;
+};
+
+/**
+ * Counters for one pre-opened directory.
+ *
+ * @internal
+ */
+struct po_stats_entry {
+	/** Hash of the directory's name (0 if this entry is unused) */
+	_Alignas(64) _Atomic(uint32_t) hash;
+
+	/** The directory's name (possibly truncated) */
+	char name[PO_STATS_NAMELEN];
+
+	/** Lookups that were resolved against the directory */
+	struct po_stats_counter hits[PO_STATS_STRIPES];
+};
+
+/**
+ * A shared-memory segment of lookup statistics, aggregated over every
+ * process that inherits it via the `PO_STATS_FD` environment variable.
+ *
+ * @internal
+ */
+struct po_stats_segment {
+	/** Always PO_STATS_MAGIC */
+	uint32_t magic;
+
+	/** Always PO_STATS_VERSION */
+	uint32_t version;
+
+	/** Number of processes that have used the segment */
+	_Atomic(uint32_t) processes;
+
+	/** Hits on directories that had no free entry */
+	_Atomic(uint64_t) unclaimed;
+
+	/** Per-wrapper counters */
+	struct po_stats_call calls[PO_STATS_STRIPES][PO_TRACE_CALLS];
+
+	/** Per-directory counters */
+	struct po_stats_entry entries[PO_STATS_ENTRIES];
+};
+
+/**
+ * Count a lookup in the statistics segment given by `PO_STATS_FD` (if there
+ * is one).
+ *
+ * @param   path    the path that was finally searched for (after following
+ *                  any symbolic links), which @b rel is relative to
+ * @param   rel     the result of the lookup
+ *
+ * @internal
+ */
+void	po_stats_record(enum po_trace_call, const char *path,
+	struct po_relpath rel);
+
+/**
+ * The length of the prefix of @b path that a lookup matched (0 for a miss
+ * or a lookup relative to the working directory).
+ *
+ * @internal
+ */
+size_t	po_match_length(const char *path, struct po_relpath rel);
+
+/**
+ * Longest path that can be sent to (or returned by) a descriptor broker,
+ * including its terminating NUL.
+ *
+ * @internal
+ */
+#define	PO_BROKER_PATHLEN	1024
+
+/**
+ * Maximum number of requests that a broker client sends before it waits for
+ * the broker's replies.
+ *
+ * @internal
+ */
+#define	PO_BROKER_BATCH		16
+
+/**
+ * A request for a directory that a path can be resolved against, sent to a
+ * descriptor broker (see po_broker_serve).
+ *
+ * @internal
+ */
+struct po_broker_request {
+	/** Identifies the request within a batch (echoed in the reply) */
+	uint32_t id;
+
+	/** The PO_ACCESS_* modes that the caller needs */
+	uint32_t access;
+
+	/** The absolute path that the caller wants to use */
+	char path[PO_BROKER_PATHLEN];
+};
+
+/**
+ * A broker's reply to a po_broker_request.
+ *
+ * If the request was granted, the directory descriptor is attached as
+ * `SCM_RIGHTS` control data.
+ *
+ * @internal
+ */
+struct po_broker_reply {
+	/** The id of the request that this replies to */
+	uint32_t id;
+
+	/** 0 if the request was granted, or an errno value otherwise */
+	int32_t error;
+
+	/** The PO_ACCESS_* modes that the granted directory is limited to */
+	uint32_t access;
+
+	/** The path of the granted directory (a prefix of the request's) */
+	char name[PO_BROKER_PATHLEN];
+};
+
+/**
+ * Ask the descriptor broker (if there is one) for a directory to resolve an
+ * absolute path against.
+ *
+ * Directories that the broker grants are kept in a map of their own, so
+ * later lookups beneath them are answered locally. Requests from concurrent
+ * threads are sent to the broker together.
+ *
+ * @returns the relative path, or a dirfd of -1 if there is no broker or it
+ *          refused the request
+ *
+ * @internal
+ */
+struct po_relpath	po_broker_find(const char *path, unsigned int access);
+
+/**
+ * Parse an integer file descriptor from an environment variable.
+ *
+ * @returns the descriptor, or -1 if the variable is unset or malformed
+ *
+ * @internal
+ */
+int	po_getenv_fd(const char *name);
+
+/**
+ * Like po_find_existing, but also find the I/O policy of the matching entry.
+ *
+ * @param policyp   filled in with the policy (or NULL if the entry has none)
+ *
+ * @internal
+ */
+struct po_relpath	po_find_io(struct po_map *map, const char *path,
+	unsigned int access, const struct po_io_policy **policyp);
+
+/**
+ * Like po_find_io, but resolve symbolic links beneath the matching entry
+ * first if symlink resolution is enabled (see po_resolve_symlinks).
+ *
+ * @param follow    whether to follow a link in the last component of @b path
+ * @param buf       a buffer to hold the path after following links, which the
+ *                  returned relative path may point into
+ * @param size      the size of @b buf
+ * @param searchedp set to the path that was finally searched (either @b path
+ *                  or @b buf), which the returned relative path is a suffix
+ *                  of unless the whole path matched
+ *
+ * @internal
+ */
+struct po_relpath	po_find_resolved(struct po_map *map, const char *path,
+	unsigned int access, bool follow, char *buf, size_t size,
+	const char **searchedp, const struct po_io_policy **policyp);
+
+/**
+ * Lexically resolve @b path (which may be relative to @b base) into an
+ * absolute path without `.` or `..` components.
+ *
+ * @returns false if the result doesn't fit in @b size bytes
+ *
+ * @internal
+ */
+bool	po_logical_path(char *dest, size_t size, const char *base,
+	const char *path);
+
+/**
+ * Find the first directory in a union (see po_add_union) that contains
+ * @b relpath and supports the PO_ACCESS_* modes in @b access.
+ *
+ * @param first     the union's first entry (followed by its other layers)
+ * @param relpath   the path relative to the union
+ *
+ * @returns the directory's descriptor, or that of @b first if no directory
+ *          contains @b relpath
+ *
+ * @internal
+ */
+int	po_union_find(struct po_map_entry *first, const char *relpath,
+	unsigned int access);
+
+/**
+ * Forget which union directories paths were found in, e.g., because files
+ * have been created or removed.
+ *
+ * @internal
+ */
+void	po_union_cache_invalidate(void);
+
+/**
+ * Like `fstatat(2)`, but using the metadata cache (see po_stat_cache) when
+ * it is enabled.
+ *
+ * @internal
+ */
+int	po_cached_fstatat(int dirfd, const char *path, struct stat *st,
+	int flags);
+
+/**
+ * Like `faccessat(2)` (with no flags), but using the metadata cache (see
+ * po_stat_cache) when it is enabled.
+ *
+ * @internal
+ */
+int	po_cached_faccessat(int dirfd, const char *path, int mode);
+
+/**
+ * Like `readlinkat(2)`, but using the metadata cache (see po_stat_cache) when
+ * it is enabled.
+ *
+ * @internal
+ */
+int	po_cached_readlinkat(int dirfd, const char *path, char *buf,
+	size_t size);
+
+/**
+ * Discard every result in the metadata cache, e.g., because a wrapper has
+ * changed the filesystem.
+ *
+ * @internal
+ */
+void	po_stat_cache_invalidate(void);
+
+/**
+ * Open a directory stream for a path relative to a directory descriptor.
+ *
+ * @internal
+ */
+DIR*	po_opendirat(int dirfd, const char *path);
+
+/**
+ * Like `scandir(3)`, but for a path relative to a directory descriptor.
+ *
+ * @internal
+ */
+int	po_scandirat(int dirfd, const char *path, struct dirent ***namelist,
+	int (*select)(const struct dirent *),
+	int (*compar)(const struct dirent **, const struct dirent **));
+
+/**
+ * A callback for `nftw(3)`.
+ *
+ * @internal
+ */
+typedef int (*po_nftw_fn)(const char *, const struct stat *, int,
+	struct FTW *);
+
+/**
+ * Like `nftw(3)` (without FTW_CHDIR), but starting from a path relative to a
+ * directory descriptor.
+ *
+ * Each directory in the tree is opened relative to its parent, so at most
+ * one descriptor is held open per level of the tree (whatever the caller's
+ * `nopenfd` might be).
+ *
+ * @param   relpath the path to start from, relative to @b dirfd
+ * @param   path    the same path, as the caller named it (which the
+ *                  callback is given paths beneath)
+ *
+ * @internal
+ */
+int	po_nftwat(int dirfd, const char *relpath, const char *path,
+	po_nftw_fn fn, int flags);
+
+/**
+ * A function that resolves a path for a libc wrapper, as `find_relative`
+ * does in po_libc_wrappers.c.
+ *
+ * @internal
+ */
+typedef struct po_relpath (*po_resolve_fn)(const char *path,
+	unsigned int access);
+
+/**
+ * Kinds of search done by po_search.
+ *
+ * @internal
+ */
+enum po_search_kind {
+	/** Executables (as `execvp(3)` searches `PATH`) */
+	PO_SEARCH_COMMAND,
+
+	/** Shared libraries (as `dlopen(3)` searches for sonames) */
+	PO_SEARCH_LIBRARY,
+
+	PO_SEARCH_KINDS,
 };
 
+/**
+ * Find a file in a `PATH`-style list of directories, using a cache of
+ * earlier searches of the same kind against the same map.
+ *
+ * Each map has caches of its own, which are only reused while it is
+ * unchanged (see po_map_generation). Results that depended on a relative
+ * directory (which changes with the working directory) are not cached.
+ *
+ * @param   file    the name to find (which does not contain a '/')
+ * @param   search  the directories to search, separated by ':'
+ * @param   map     the map that @b resolve resolves paths against (or NULL)
+ * @param   resolve how to resolve candidate paths
+ * @param   path    where to put the file's path
+ *
+ * @returns 0 on success or an errno value
+ *
+ * @internal
+ */
+int	po_search(enum po_search_kind, const char *file, const char *search,
+	struct po_map *map, po_resolve_fn resolve, char *path, size_t size);
+
+/**
+ * Forget where a file was found when searching against @b map (e.g.,
+ * because it has been removed).
+ *
+ * @internal
+ */
+void	po_search_forget(enum po_search_kind, const char *file,
+	struct po_map *map);
+
+/**
+ * Free the search caches of a map that is being released.
+ *
+ * @internal
+ */
+void	po_search_release(struct po_search_cache *);
+
+/**
+ * Allocate an identifier for a new po_map.
+ *
+ * @internal
+ */
+uint64_t	po_map_new_id(void);
+
+/**
+ * Does an open file start with "#!"?
+ *
+ * @internal
+ */
+bool	po_is_script(int fd);
+
+/**
+ * Get the descriptor of a po_map entry, opening it first if it is a lazy
+ * entry that isn't open.
+ *
+ * If several threads open the same entry at once, only one descriptor is
+ * published in the entry and the others are closed.
+ *
+ * @returns the descriptor, or -1 if a lazy entry could not be opened
+ *
+ * @internal
+ */
+int	po_entry_fd(struct po_map_entry *);
+
+/**
+ * A number that changes whenever entries are added to (or closed in) a
+ * po_map, the maps that it overlays or the segments that back them.
+ *
+ * @internal
+ */
+uint32_t	po_map_generation(const struct po_map *);
+
+/**
+ * The PO_ACCESS_* modes that a file descriptor can be used for.
+ *
+ * With Capsicum, this is derived from the descriptor's rights. Otherwise,
+ * directories support all modes (the kernel checks permissions when files
+ * beneath them are opened) and other files support the modes allowed by
+ * the access mode they were opened with.
+ *
+ * @internal
+ */
+unsigned int	po_fd_access(int fd);
+
+/**
+ * The PO_ACCESS_* modes required to `open(2)` a file with @b flags.
+ *
+ * @internal
+ */
+unsigned int	po_open_access(int flags);
+
+#ifdef WITH_CAPSICUM
+/**
+ * The PO_ACCESS_* modes implied by a set of Capsicum rights.
+ *
+ * @internal
+ */
+unsigned int	po_rights_access(const cap_rights_t *);
+#endif
 
 /**
  * Is a directory a prefix of a given path?
@@ -107,7 +1192,7 @@ void	po_map_assertvalid(const struct po_map *);
 #endif
 
 /**
- * Enlarge a @ref po_map's capacity.
+ * Enlarge a @ref po_map's capacity (by doubling it).
  *
  * This results in new memory being allocated and existing entries being copied.
  * If the allocation fails, the function will return NULL but the original
@@ -118,11 +1203,14 @@ void	po_map_assertvalid(const struct po_map *);
 struct po_map* po_map_enlarge(struct po_map *map);
 
 /**
- * Store an error message in the global "last error message" buffer.
+ * Record the calling thread's last error, along with the current `errno`.
+ *
+ * @param   context   a static string describing what failed (which is not
+ *                    copied or formatted until po_last_error is called)
  *
  * @internal
  */
-void po_errormessage(const char *msg);
+void po_seterror(enum po_error, const char *context);
 
 /**
  * Set the default map used by the libpreopen libc wrappers.
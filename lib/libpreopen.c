@@ -38,96 +38,305 @@
  * po_isprefix is also defined here because it doesn't fit anywhere else.
  */
 
+#include <sys/param.h>
+#include <sys/stat.h>
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "internal.h"
 
+/**
+ * Find the best match for a path among the entries that support the
+ * PO_ACCESS_* modes in @b access and (with Capsicum) have @b rights.
+ */
+static struct po_relpath	find(struct po_map *map, const char *path,
+	unsigned int access, cap_rights_t *rights,
+	struct po_map_entry **entryp);
+
+/**
+ * Source of po_map_entry::union_id values.
+ */
+static _Atomic(uint32_t) last_union_id;
+
+/**
+ * The `open(2)` flags that an I/O policy may add: anything else could change
+ * what is opened (e.g., `O_CREAT`) rather than how.
+ */
+static const int policy_flags = O_CLOEXEC | O_SYNC | O_DSYNC
+#ifdef O_NOATIME
+	| O_NOATIME
+#endif
+#ifdef O_DIRECT
+	| O_DIRECT
+#endif
+	;
+
 
 struct po_map*
 po_add(struct po_map *map, const char *path, int fd)
+{
+
+	return (po_add_many(map, &path, &fd, 1));
+}
+
+struct po_map*
+po_add_access(struct po_map *map, const char *path, int fd,
+	unsigned int access)
+{
+
+	map = po_add_many(map, &path, &fd, 1);
+	if (map == NULL) {
+		return (NULL);
+	}
+
+	map->entries[map->length - 1].access = access & PO_ACCESS_ALL;
+
+	return (map);
+}
+
+struct po_map*
+po_add_many(struct po_map *map, const char *const paths[], const int fds[],
+	size_t n)
 {
 	struct po_map_entry *entry;
+	size_t i;
 
 	po_map_assertvalid(map);
 
-	if (path == NULL || fd < 0) {
+	for (i = 0; i < n; i++) {
+		if (paths[i] == NULL || fds[i] < 0) {
+			errno = EINVAL;
+			return (NULL);
+		}
+	}
+
+	if (map->segment != NULL) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID,
+			"cannot add entries to a segment-backed po_map");
 		return (NULL);
 	}
 
-	if (map->length == map->capacity) {
-		map = po_map_enlarge(map);
+	if (map->frozen) {
+		errno = EPERM;
+		po_seterror(PO_ERROR_INVALID,
+			"cannot add entries to a frozen po_map");
+		return (NULL);
+	}
+
+	// Grow at most once per batch (and geometrically across batches).
+	if (map->length + n > map->capacity) {
+		map = po_map_reserve(map,
+			MAX(map->length + n, 2 * map->capacity));
 		if (map == NULL) {
 			return (NULL);
 		}
 	}
 
-	entry = map->entries + map->length;
-	map->length++;
+	for (i = 0; i < n; i++) {
+		entry = map->entries + map->length + i;
+
+		entry->name = strdup(paths[i]);
+		entry->fd = fds[i];
+		entry->access = po_fd_access(fds[i]);
+		entry->lazy = NULL;
+		entry->layers = 0;
+		entry->policy = NULL;
 
-	entry->name = strdup(path);
-	entry->fd = fd;
+		if (entry->name == NULL) {
+			po_seterror(PO_ERROR_NOMEM,
+				"failed to copy entry name");
+			break;
+		}
 
 #ifdef WITH_CAPSICUM
-	if (cap_rights_get(fd, &entry->rights) != 0) {
+		if (cap_rights_get(fds[i], &entry->rights) != 0) {
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to get capability rights");
+			free((char*) entry->name);
+			break;
+		}
+#endif
+	}
+
+	// Add all of the entries or none of them.
+	if (i < n) {
+		while (i-- > 0) {
+			free((char*) map->entries[map->length + i].name);
+		}
 		return (NULL);
 	}
-#endif
+
+	map->length += n;
+	map->generation++;
 
 	po_map_assertvalid(map);
 
 	return (map);
 }
 
+struct po_map*
+po_add_union(struct po_map *map, const char *name, const int fds[], size_t n)
+{
+	struct po_map_entry *first;
+	const char **names;
+
+	if (name == NULL || n == 0) {
+		return (NULL);
+	}
+
+	names = malloc(n * sizeof(*names));
+	if (names == NULL) {
+		po_seterror(PO_ERROR_NOMEM, "failed to allocate union names");
+		return (NULL);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		names[i] = name;
+	}
+
+	map = po_add_many(map, names, fds, n);
+	free(names);
+
+	if (map == NULL) {
+		return (NULL);
+	}
+
+	// Later layers have the same name, so lookups always match the first.
+	first = map->entries + map->length - n;
+	first->layers = n;
+	first->union_id = atomic_fetch_add_explicit(&last_union_id, 1,
+		memory_order_relaxed) + 1;
+
+	return (map);
+}
+
 struct po_relpath
 po_find(struct po_map* map, const char *path, cap_rights_t *rights)
 {
-	const char *relpath ;
-	struct po_relpath match = { .relative_path = NULL, .dirfd = -1 };
-	size_t bestlen = 0;
-	int best = -1;
+	unsigned int access = 0;
+
+#ifdef WITH_CAPSICUM
+	if (rights) {
+		access = po_rights_access(rights);
+	}
+#endif
+
+	return (find(map, path, access, rights, NULL));
+}
+
+struct po_relpath
+po_find_access(struct po_map* map, const char *path, unsigned int access)
+{
+
+	return (find(map, path, access, NULL, NULL));
+}
+
+struct po_relpath
+po_find_existing(struct po_map* map, const char *path, unsigned int access)
+{
+
+	return (po_find_io(map, path, access, NULL));
+}
+
+struct po_relpath
+po_find_io(struct po_map* map, const char *path, unsigned int access,
+	const struct po_io_policy **policyp)
+{
+	struct po_map_entry *entry;
+	struct po_relpath rel;
+
+	rel = find(map, path, access, NULL, &entry);
+	if (entry != NULL && entry->layers > 1 && rel.dirfd != -1) {
+		rel.dirfd = po_union_find(entry, rel.relative_path, access);
+	}
+
+	if (policyp != NULL) {
+		*policyp = (entry == NULL) ? NULL : entry->policy;
+	}
+
+	return (rel);
+}
+
+int
+po_set_io_policy(struct po_map *map, const char *name,
+	const struct po_io_policy *policy)
+{
+	struct po_io_policy *copy;
+	size_t found = 0;
 
 	po_map_assertvalid(map);
 
-	if (path == NULL) {
-		return (match);
+	if (name == NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (policy != NULL && (policy->flags & ~policy_flags) != 0) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID, "unsupported I/O policy flags");
+		return (-1);
 	}
 
-	for(size_t i = 0; i < map->length; i++) {
-		const struct po_map_entry *entry = map->entries + i;
-		const char *name = entry->name;
-		size_t len = strnlen(name, MAXPATHLEN);
+	if (map->frozen) {
+		errno = EPERM;
+		po_seterror(PO_ERROR_INVALID,
+			"cannot set I/O policy in a frozen po_map");
+		return (-1);
+	}
 
-		if ((len <= bestlen) || !po_isprefix(name, len, path)) {
+	for (size_t i = 0; i < map->length; i++) {
+		struct po_map_entry *entry = map->entries + i;
+
+		if (strcmp(entry->name, name) != 0) {
 			continue;
 		}
 
-#ifdef WITH_CAPSICUM
-		if (rights && !cap_rights_contains(&entry->rights, rights)) {
-			continue;
+		copy = NULL;
+		if (policy != NULL) {
+			copy = malloc(sizeof(*copy));
+			if (copy == NULL) {
+				po_seterror(PO_ERROR_NOMEM,
+					"failed to allocate I/O policy");
+				return (-1);
+			}
+			*copy = *policy;
 		}
-#endif
 
-		best = entry->fd;
-		bestlen = len;
+		free(entry->policy);
+		entry->policy = copy;
+		found++;
 	}
 
-	relpath = path + bestlen;
-
-	while (*relpath == '/') {
-		relpath++;
+	if (found == 0) {
+		errno = ENOENT;
+		po_seterror(PO_ERROR_INVALID, "no po_map entry with that name");
+		return (-1);
 	}
 
-	if (*relpath == '\0') {
-		relpath = ".";
+	return (0);
+}
+
+int
+po_find_r(struct po_map *map, const char *path, unsigned int access,
+	struct po_relpath *rel)
+{
+
+	if (!map->frozen) {
+		return (EINVAL);
 	}
 
-	match.relative_path = relpath;
-	match.dirfd = best;
+	*rel = find(map, path, access, NULL, NULL);
 
-	return match;
+	return (rel->dirfd == -1 ? ENOENT : 0);
 }
 
 bool
@@ -173,6 +382,106 @@ po_preopen(struct po_map *map, const char *path, int flags, ...)
 	return (fd);
 }
 
+int
+po_preopen_lazy(struct po_map *map, const char *path, int flags)
+{
+	struct po_map_entry *entry;
+	struct po_lazy_entry *lazy;
+	char *name;
+
+	po_map_assertvalid(map);
+
+	if (path == NULL) {
+		return (-1);
+	}
+
+	if (map->segment != NULL || map->frozen) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID,
+			"cannot add entries to a segment-backed or frozen po_map");
+		return (-1);
+	}
+
+	if (map->length == map->capacity && po_map_enlarge(map) == NULL) {
+		return (-1);
+	}
+
+	name = strdup(path);
+	lazy = malloc(sizeof(*lazy));
+	if (name == NULL || lazy == NULL || (lazy->path = strdup(path)) == NULL) {
+		po_seterror(PO_ERROR_NOMEM, "failed to allocate lazy entry");
+		free(name);
+		free(lazy);
+		return (-1);
+	}
+
+	lazy->flags = flags;
+	atomic_init(&lazy->last_used, 0);
+
+	entry = map->entries + map->length;
+	entry->name = name;
+	entry->fd = -1;
+	entry->lazy = lazy;
+	entry->layers = 0;
+	entry->policy = NULL;
+
+	// Predict what po_fd_access will say about the descriptor once it's
+	// opened: we don't want to open it just to find out.
+	if (flags & O_DIRECTORY) {
+		entry->access = PO_ACCESS_ALL;
+	} else {
+		entry->access = po_open_access(flags) & ~PO_ACCESS_EXEC;
+	}
+
+#ifdef WITH_CAPSICUM
+	// Rights aren't known until the entry is opened (see find).
+	memset(&entry->rights, 0, sizeof(entry->rights));
+#endif
+
+	map->length++;
+	map->generation++;
+
+	po_map_assertvalid(map);
+
+	return (0);
+}
+
+int
+po_entry_fd(struct po_map_entry *entry)
+{
+	struct po_lazy_entry *lazy = entry->lazy;
+	struct timespec ts;
+	int expected, fd;
+
+	fd = atomic_load_explicit(&entry->fd, memory_order_acquire);
+	if (lazy == NULL) {
+		return (fd);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	atomic_store_explicit(&lazy->last_used, ts.tv_sec,
+		memory_order_relaxed);
+
+	if (fd != -1) {
+		return (fd);
+	}
+
+	fd = openat(AT_FDCWD, lazy->path, lazy->flags);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	// Publish our descriptor unless another thread beat us to it.
+	expected = -1;
+	if (!atomic_compare_exchange_strong_explicit(&entry->fd, &expected, fd,
+	    memory_order_acq_rel, memory_order_acquire)) {
+		close(fd);
+		fd = expected;
+	}
+
+	return (fd);
+}
+
 bool
 po_print_entry(const char *name, int fd, cap_rights_t rights)
 {
@@ -180,3 +489,170 @@ po_print_entry(const char *name, int fd, cap_rights_t rights)
 	       name, fd);
 	return (true);
 }
+
+unsigned int
+po_fd_access(int fd)
+{
+#ifdef WITH_CAPSICUM
+	cap_rights_t rights;
+
+	if (cap_rights_get(fd, &rights) != 0) {
+		return (0);
+	}
+
+	return (po_rights_access(&rights));
+#else
+	struct stat sb;
+	int flags;
+
+	if (fstat(fd, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		return (PO_ACCESS_ALL);
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		return (0);
+	}
+
+	return (po_open_access(flags) & ~PO_ACCESS_EXEC);
+#endif
+}
+
+unsigned int
+po_open_access(int flags)
+{
+	unsigned int access;
+
+	switch (flags & O_ACCMODE) {
+	case O_RDONLY:
+		access = PO_ACCESS_READ;
+		break;
+
+	case O_WRONLY:
+		access = PO_ACCESS_WRITE;
+		break;
+
+	default:
+		access = PO_ACCESS_READ | PO_ACCESS_WRITE;
+		break;
+	}
+
+	if (flags & (O_CREAT | O_TRUNC | O_APPEND)) {
+		access |= PO_ACCESS_WRITE;
+	}
+
+	return (access);
+}
+
+#ifdef WITH_CAPSICUM
+unsigned int
+po_rights_access(const cap_rights_t *rights)
+{
+	unsigned int access = 0;
+
+	if (cap_rights_is_set(rights, CAP_READ)) {
+		access |= PO_ACCESS_READ;
+	}
+
+	if (cap_rights_is_set(rights, CAP_WRITE)) {
+		access |= PO_ACCESS_WRITE;
+	}
+
+	if (cap_rights_is_set(rights, CAP_FEXECVE)) {
+		access |= PO_ACCESS_EXEC;
+	}
+
+	return (access);
+}
+#endif
+
+static struct po_relpath
+find(struct po_map *map, const char *path, unsigned int access,
+	cap_rights_t *rights, struct po_map_entry **entryp)
+{
+	const char *relpath ;
+	struct po_relpath match = { .relative_path = NULL, .dirfd = -1 };
+	struct po_map_entry *bestentry = NULL;
+	struct po_map *layer;
+	size_t bestlen = 0;
+	int best = -1;
+	int fd;
+
+	po_map_assertvalid(map);
+
+	if (entryp != NULL) {
+		*entryp = NULL;
+	}
+
+	if (path == NULL) {
+		return (match);
+	}
+
+	// Search overlays before their bases so that they win ties.
+	for (layer = map; layer != NULL; layer = layer->base) {
+		if (layer->segment != NULL) {
+			fd = po_segment_find(layer->segment, path, access,
+				&bestlen);
+			if (fd != -1) {
+				best = fd;
+				bestentry = NULL;
+			}
+		}
+
+		for(size_t i = 0; i < layer->length; i++) {
+			struct po_map_entry *entry = layer->entries + i;
+			const char *name = entry->name;
+			size_t len;
+
+			// Cheap pre-filter before looking at the name.
+			if ((entry->access & access) != access) {
+				continue;
+			}
+
+			len = strnlen(name, MAXPATHLEN);
+			if ((len <= bestlen) || !po_isprefix(name, len, path)) {
+				continue;
+			}
+
+#ifdef WITH_CAPSICUM
+			// Lazy entries will have all rights once opened.
+			if (rights && entry->lazy == NULL
+			    && !cap_rights_contains(&entry->rights, rights)) {
+				continue;
+			}
+#endif
+
+			bestentry = entry;
+			bestlen = len;
+		}
+	}
+
+	// Only open a lazy entry once we know that it's the best match.
+	// Frozen maps have no unopened entries (see po_map_freeze), and
+	// lookups in them mustn't write to the map (see po_find_r).
+	if (bestentry != NULL && map->frozen) {
+		best = atomic_load_explicit(&bestentry->fd,
+			memory_order_acquire);
+	} else if (bestentry != NULL) {
+		best = po_entry_fd(bestentry);
+	}
+
+	if (entryp != NULL) {
+		*entryp = bestentry;
+	}
+
+	relpath = path + bestlen;
+
+	while (*relpath == '/') {
+		relpath++;
+	}
+
+	if (*relpath == '\0') {
+		relpath = ".";
+	}
+
+	match.relative_path = relpath;
+	match.dirfd = best;
+
+	return match;
+}
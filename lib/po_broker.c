@@ -0,0 +1,616 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file  po_broker.c
+ * @brief Descriptor broker client (and a simple broker to test it with)
+ *
+ * When the libc wrappers can't find a path in any po_map, they can ask a
+ * more privileged broker process for a directory to resolve it against.
+ * The broker is reached over the socket given by `PO_BROKER_FD` (or
+ * `po_set_broker`) and replies with directory descriptors via `SCM_RIGHTS`.
+ *
+ * Granted directories are added to a map that belongs to the client, so
+ * each directory is only requested once. Threads that miss at the same time
+ * queue their requests: one of them sends the whole queue to the broker and
+ * then waits for all of the replies, so concurrent misses cost one round
+ * trip rather than one each.
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/**
+ * A request that is waiting to be sent to the broker.
+ */
+struct pending {
+	/** The path to request a directory for */
+	const char *path;
+
+	/** The PO_ACCESS_* modes required */
+	unsigned int access;
+
+	/** Whether the broker has replied (or the request has failed) */
+	bool done;
+
+	/** 0 if a directory was granted, or an errno value otherwise */
+	int error;
+
+	/** The next request in the queue */
+	struct pending *next;
+};
+
+/**
+ * Read the broker socket from `PO_BROKER_FD` (if it is set).
+ */
+static void	broker_init(void);
+
+/**
+ * Look up a path in the map of granted directories.
+ */
+static struct po_relpath	find_granted(const char *path,
+	unsigned int access);
+
+/**
+ * Send a batch of requests to the broker and collect its replies, adding the
+ * directories that it grants to @b granted.
+ */
+static void	exchange(struct pending *batch[], size_t count);
+
+/**
+ * Receive one reply from the broker (and its descriptor, if any).
+ *
+ * @returns 0 on success or an errno value
+ */
+static int	receive_reply(struct po_broker_reply *reply, int *fd);
+
+/**
+ * Answer one request on behalf of a policy map.
+ *
+ * @returns a directory descriptor (setting @b reply's name and access), or
+ *          -1 (setting @b reply's error)
+ */
+static int	grant(struct po_map *policy,
+	const struct po_broker_request *request,
+	struct po_broker_reply *reply);
+
+/**
+ * Open a directory beneath @b dirfd, one component at a time, without
+ * following symbolic links or letting `..` climb above @b dirfd.
+ *
+ * @returns a directory descriptor, or -1 (setting errno)
+ */
+static int	open_beneath(int dirfd, const char *path);
+
+/**
+ * The socket that requests are sent to (or -1 if there is no broker).
+ */
+static int broker_sock = -1;
+
+/**
+ * Directories that the broker has granted.
+ */
+static struct po_map *granted;
+
+/**
+ * Protects @b granted: lookups take it for reading, so that they can run
+ * concurrently, and new grants are added with it held for writing.
+ */
+static pthread_rwlock_t granted_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Protects the queue of pending requests and @b sending.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Signalled when a batch of replies has been received.
+ */
+static pthread_cond_t replied = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Requests that have not yet been sent (oldest first).
+ */
+static struct pending *queue, **queue_tail = &queue;
+
+/**
+ * Whether a thread is currently exchanging a batch with the broker.
+ */
+static bool sending;
+
+/**
+ * Ensures that broker_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+int
+po_set_broker(int sock)
+{
+	struct po_map *map = NULL;
+
+	pthread_once(&init_once, broker_init);
+
+	if (sock != -1 && granted == NULL) {
+		map = po_map_create(4);
+		if (map == NULL) {
+			return (-1);
+		}
+	}
+
+	pthread_rwlock_wrlock(&granted_lock);
+	broker_sock = sock;
+	if (map != NULL) {
+		granted = map;
+	}
+	pthread_rwlock_unlock(&granted_lock);
+
+	return (0);
+}
+
+struct po_relpath
+po_broker_find(const char *path, unsigned int access)
+{
+	struct po_relpath rel = { .dirfd = -1, .relative_path = NULL };
+	struct pending request, *batch[PO_BROKER_BATCH];
+	size_t n;
+
+	pthread_once(&init_once, broker_init);
+
+	// Relative paths are relative to our working directory, not the
+	// broker's, so only absolute paths can be brokered.
+	if (broker_sock == -1 || path == NULL || path[0] != '/'
+	    || strlen(path) >= PO_BROKER_PATHLEN) {
+		return (rel);
+	}
+
+	rel = find_granted(path, access);
+	if (rel.dirfd != -1) {
+		return (rel);
+	}
+
+	request.path = path;
+	request.access = access;
+	request.done = false;
+	request.error = 0;
+	request.next = NULL;
+
+	pthread_mutex_lock(&queue_lock);
+	*queue_tail = &request;
+	queue_tail = &request.next;
+
+	while (!request.done) {
+		if (sending) {
+			pthread_cond_wait(&replied, &queue_lock);
+			continue;
+		}
+
+		// Nobody is talking to the broker: send everything that
+		// is queued (up to a batch), including our own request.
+		for (n = 0; n < PO_BROKER_BATCH && queue != NULL; n++) {
+			batch[n] = queue;
+			queue = queue->next;
+		}
+		if (queue == NULL) {
+			queue_tail = &queue;
+		}
+
+		sending = true;
+		pthread_mutex_unlock(&queue_lock);
+
+		exchange(batch, n);
+
+		pthread_mutex_lock(&queue_lock);
+		for (size_t i = 0; i < n; i++) {
+			batch[i]->done = true;
+		}
+		sending = false;
+		pthread_cond_broadcast(&replied);
+	}
+
+	pthread_mutex_unlock(&queue_lock);
+
+	if (request.error != 0) {
+		rel.dirfd = -1;
+		return (rel);
+	}
+
+	return (find_granted(path, access));
+}
+
+int
+po_broker_serve(int sock, struct po_map *policy)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct po_broker_request request;
+	struct po_broker_reply reply;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+	int fd;
+
+	po_map_assertvalid(policy);
+
+	while (true) {
+		len = recv(sock, &request, sizeof(request), 0);
+		if (len == 0) {
+			return (0);
+		}
+
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to receive broker request");
+			return (-1);
+		}
+
+		memset(&reply, 0, sizeof(reply));
+		reply.id = request.id;
+
+		if ((size_t) len != sizeof(request)) {
+			reply.error = EINVAL;
+			fd = -1;
+		} else {
+			request.path[sizeof(request.path) - 1] = '\0';
+			fd = grant(policy, &request, &reply);
+		}
+
+		iov.iov_base = &reply;
+		iov.iov_len = sizeof(reply);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		if (fd != -1) {
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+		}
+
+		len = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+		if (fd != -1) {
+			close(fd);
+		}
+
+		if (len < 0) {
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to send broker reply");
+			return (-1);
+		}
+	}
+}
+
+static void
+broker_init(void)
+{
+	int sock;
+
+	sock = po_getenv_fd("PO_BROKER_FD");
+	if (sock == -1) {
+		return;
+	}
+
+	granted = po_map_create(4);
+	if (granted != NULL) {
+		broker_sock = sock;
+	}
+}
+
+static struct po_relpath
+find_granted(const char *path, unsigned int access)
+{
+	struct po_relpath rel;
+
+	pthread_rwlock_rdlock(&granted_lock);
+	rel = po_find_access(granted, path, access);
+	pthread_rwlock_unlock(&granted_lock);
+
+	return (rel);
+}
+
+static void
+exchange(struct pending *batch[], size_t count)
+{
+	struct po_broker_request request;
+	struct po_broker_reply reply;
+	struct po_relpath rel;
+	size_t i, sent;
+	int error, fd;
+
+	// Send the whole batch before waiting for any replies.
+	for (sent = 0; sent < count; sent++) {
+		memset(&request, 0, sizeof(request));
+		request.id = sent;
+		request.access = batch[sent]->access;
+		strlcpy(request.path, batch[sent]->path, sizeof(request.path));
+
+		if (send(broker_sock, &request, sizeof(request), MSG_NOSIGNAL)
+		    != sizeof(request)) {
+			break;
+		}
+	}
+
+	for (i = sent; i < count; i++) {
+		batch[i]->error = ECONNRESET;
+	}
+
+	// The broker answers requests in order.
+	for (i = 0; i < sent; i++) {
+		error = receive_reply(&reply, &fd);
+		if (error == 0 && reply.id != i) {
+			error = EPROTO;
+		}
+
+		if (error != 0) {
+			if (fd != -1) {
+				close(fd);
+			}
+
+			for (; i < sent; i++) {
+				batch[i]->error = error;
+			}
+			break;
+		}
+
+		if (reply.error != 0 || fd == -1) {
+			batch[i]->error = reply.error ? reply.error : EPROTO;
+			continue;
+		}
+
+		reply.name[sizeof(reply.name) - 1] = '\0';
+
+		reply.access &= PO_ACCESS_ALL;
+
+		// Another request in this batch may have been granted the
+		// same directory: keep just one descriptor for it.
+		pthread_rwlock_wrlock(&granted_lock);
+		rel = po_find_access(granted, reply.name, reply.access);
+		if (rel.dirfd != -1 && strcmp(rel.relative_path, ".") == 0) {
+			close(fd);
+		} else if (po_add_access(granted, reply.name, fd,
+		    reply.access) == NULL) {
+			batch[i]->error = ENOMEM;
+			close(fd);
+		}
+		pthread_rwlock_unlock(&granted_lock);
+	}
+}
+
+static int
+receive_reply(struct po_broker_reply *reply, int *fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t len;
+
+	*fd = -1;
+
+	iov.iov_base = reply;
+	iov.iov_len = sizeof(*reply);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	do {
+		len = recvmsg(broker_sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0) {
+		return (errno);
+	}
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET
+	    && cmsg->cmsg_type == SCM_RIGHTS
+	    && cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(*fd));
+	}
+
+	if ((size_t) len != sizeof(*reply)) {
+		return (len == 0 ? ECONNRESET : EPROTO);
+	}
+
+	return (0);
+}
+
+static int
+grant(struct po_map *policy, const struct po_broker_request *request,
+	struct po_broker_reply *reply)
+{
+	struct po_relpath rel;
+	const char *slash;
+	size_t len;
+	int fd;
+#ifdef WITH_CAPSICUM
+	cap_rights_t rights;
+#endif
+
+	if (request->path[0] != '/') {
+		reply->error = EINVAL;
+		return (-1);
+	}
+
+	// Grant the parent directory, which the client can then use for the
+	// requested path and its siblings.
+	slash = strrchr(request->path, '/');
+	len = (slash == request->path) ? 1 : (size_t) (slash - request->path);
+	memcpy(reply->name, request->path, len);
+	reply->name[len] = '\0';
+
+	rel = po_find_access(policy, reply->name, request->access);
+	if (rel.dirfd == -1) {
+		reply->error = EACCES;
+		return (-1);
+	}
+
+	// The client may be able to create links in the directories that the
+	// policy allows, so don't let them (or "..") lead anywhere else.
+	fd = open_beneath(rel.dirfd, rel.relative_path);
+	if (fd == -1) {
+		reply->error = errno;
+		return (-1);
+	}
+
+	// Only grant the access that was asked for (and that the policy
+	// allows): the client can ask again if it needs more.
+	reply->access = request->access & PO_ACCESS_ALL;
+
+#ifdef WITH_CAPSICUM
+	cap_rights_init(&rights, CAP_LOOKUP, CAP_FSTAT, CAP_FSTATAT,
+		CAP_FCNTL, CAP_SEEK);
+
+	if (reply->access & PO_ACCESS_READ) {
+		cap_rights_set(&rights, CAP_READ, CAP_MMAP_R);
+	}
+
+	if (reply->access & PO_ACCESS_WRITE) {
+		cap_rights_set(&rights, CAP_WRITE, CAP_CREATE, CAP_FTRUNCATE,
+			CAP_FSYNC, CAP_MKDIRAT, CAP_UNLINKAT, CAP_SYMLINKAT,
+			CAP_RENAMEAT_SOURCE, CAP_RENAMEAT_TARGET);
+	}
+
+	if (reply->access & PO_ACCESS_EXEC) {
+		cap_rights_set(&rights, CAP_FEXECVE, CAP_MMAP_RX);
+	}
+
+	if (cap_rights_limit(fd, &rights) != 0) {
+		reply->error = errno;
+		close(fd);
+		return (-1);
+	}
+#endif
+
+	return (fd);
+}
+
+static int
+open_beneath(int dirfd, const char *path)
+{
+	// Each component takes at least two bytes of the path ("x/").
+	int fds[PO_BROKER_PATHLEN / 2 + 1];
+	char component[NAME_MAX + 1];
+	const char *name, *end;
+	size_t depth, len;
+	int error, fd;
+
+	depth = 0;
+	error = 0;
+	fds[0] = dirfd;
+
+	for (name = path; *name != '\0'; name = end) {
+		end = name + strcspn(name, "/");
+		len = (size_t) (end - name);
+		while (*end == '/') {
+			end++;
+		}
+
+		if (len == 0 || (len == 1 && name[0] == '.')) {
+			continue;
+		}
+
+		// Go back to the directory that we came from rather than
+		// asking for "..", which could be anywhere by now.
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			if (depth == 0) {
+				error = EACCES;
+				break;
+			}
+
+			close(fds[depth--]);
+			continue;
+		}
+
+		if (len > NAME_MAX
+		    || depth + 1 >= sizeof(fds) / sizeof(fds[0])) {
+			error = ENAMETOOLONG;
+			break;
+		}
+
+		memcpy(component, name, len);
+		component[len] = '\0';
+
+		fd = openat(fds[depth], component,
+			O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd == -1) {
+			error = errno;
+			break;
+		}
+
+		fds[++depth] = fd;
+	}
+
+	if (error == 0 && depth == 0) {
+		fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1) {
+			error = errno;
+		}
+	} else if (error == 0) {
+		fd = fds[depth--];
+	}
+
+	while (depth > 0) {
+		close(fds[depth--]);
+	}
+
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	return (fd);
+}
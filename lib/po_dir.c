@@ -0,0 +1,467 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_dir.c
+ * @brief Directory iteration for the opendir, scandir and nftw wrappers
+ *
+ * The wrappers resolve the directory that they are given against the po_map
+ * once; everything beneath it is then opened relative to its parent's
+ * descriptor, so walking a tree never looks up an absolute path again.
+ * Tree walks read each directory with large getdents batches rather than
+ * through a `DIR` stream.
+ */
+
+#ifdef __linux__
+#define	_GNU_SOURCE	/* for getdents64(2) */
+#endif
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/** Size of the buffer that directory entries are read into. */
+#define	BATCH_SIZE	(64 * 1024)
+
+#ifdef __linux__
+typedef struct dirent64	batch_dirent;
+#else
+typedef struct dirent	batch_dirent;
+#endif
+
+/**
+ * A directory that an nftw walk is inside of.
+ */
+struct ancestor {
+	/** The directory's device */
+	dev_t dev;
+
+	/** The directory's inode */
+	ino_t ino;
+
+	/** The directory containing this one (or NULL at the top) */
+	const struct ancestor *parent;
+};
+
+/**
+ * The state of an nftw walk.
+ */
+struct walk {
+	/** The caller's callback */
+	po_nftw_fn fn;
+
+	/** FTW_* flags */
+	int flags;
+
+	/** The device that the walk started on (for FTW_MOUNT) */
+	dev_t dev;
+
+	/** Buffer that directory entries are read into */
+	char *batch;
+
+	/** The directory being walked (or NULL before the first) */
+	const struct ancestor *ancestors;
+
+	/** The path of the file being visited, as the callback sees it */
+	char path[MAXPATHLEN];
+};
+
+/**
+ * Visit a file (and, if it is a directory, everything beneath it).
+ *
+ * @param   parent  the directory containing the file
+ * @param   name    the file's path relative to @b parent
+ * @param   len     the length of the file's path in @b walk->path
+ * @param   base    the offset of the file's name in @b walk->path
+ */
+static int	visit(struct walk *walk, int parent, const char *name,
+	size_t len, size_t base, int level);
+
+/**
+ * Visit the entries of a directory whose path is @b walk->path[0..len),
+ * given the @b count names that read_names found in it.
+ */
+static int	walk_dir(struct walk *walk, int fd, const char *names,
+	size_t count, size_t len, int level);
+
+/**
+ * Read all of a directory's entry names (except `.` and `..`) into a
+ * sequence of NUL-terminated strings.
+ *
+ * @returns the names (which the caller must free), or NULL on error
+ */
+static char*	read_names(int fd, char *batch, size_t *count);
+
+/**
+ * Read a batch of directory entries with `getdents64(2)` (or FreeBSD's
+ * `getdents(2)`).
+ */
+static ssize_t	read_batch(int fd, char *batch, size_t size);
+
+
+DIR*
+po_opendirat(int dirfd, const char *path)
+{
+	DIR *dir;
+	int fd, saved;
+
+	fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		return (NULL);
+	}
+
+	dir = fdopendir(fd);
+	if (dir == NULL) {
+		saved = errno;
+		close(fd);
+		errno = saved;
+	}
+
+	return (dir);
+}
+
+int
+po_scandirat(int dirfd, const char *path, struct dirent ***namelist,
+	int (*select)(const struct dirent *),
+	int (*compar)(const struct dirent **, const struct dirent **))
+{
+	struct dirent **list, **grown, *copy, *entry;
+	size_t capacity, count;
+	DIR *dir;
+	int saved;
+
+	dir = po_opendirat(dirfd, path);
+	if (dir == NULL) {
+		return (-1);
+	}
+
+	list = NULL;
+	capacity = count = 0;
+
+	while ((errno = 0, entry = readdir(dir)) != NULL) {
+		if (select != NULL && !select(entry)) {
+			continue;
+		}
+
+		if (count == capacity) {
+			capacity = capacity ? 2 * capacity : 32;
+			grown = realloc(list, capacity * sizeof(*list));
+			if (grown == NULL) {
+				goto fail;
+			}
+			list = grown;
+		}
+
+		copy = malloc(entry->d_reclen);
+		if (copy == NULL) {
+			goto fail;
+		}
+
+		memcpy(copy, entry, entry->d_reclen);
+		list[count++] = copy;
+	}
+
+	if (errno != 0) {
+		goto fail;
+	}
+
+	closedir(dir);
+
+	if (compar != NULL && count > 1) {
+		qsort(list, count, sizeof(*list),
+			(int (*)(const void *, const void *)) compar);
+	}
+
+	*namelist = list;
+
+	return (count);
+
+fail:
+	saved = errno;
+	while (count > 0) {
+		free(list[--count]);
+	}
+	free(list);
+	closedir(dir);
+	errno = saved;
+
+	return (-1);
+}
+
+int
+po_nftwat(int dirfd, const char *relpath, const char *path, po_nftw_fn fn,
+	int flags)
+{
+	struct walk walk;
+	struct stat sb;
+	size_t base, len;
+	int result;
+
+	len = strlcpy(walk.path, path, sizeof(walk.path));
+	if (len >= sizeof(walk.path)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	// The starting point must exist (unlike the files beneath it, which
+	// are reported with FTW_NS if they can't be stat'ed).
+	if (fstatat(dirfd, relpath, &sb,
+	    (flags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0) != 0) {
+		return (-1);
+	}
+
+	walk.fn = fn;
+	walk.flags = flags;
+	walk.dev = sb.st_dev;
+	walk.ancestors = NULL;
+	walk.batch = malloc(BATCH_SIZE);
+	if (walk.batch == NULL) {
+		return (-1);
+	}
+
+	// The base name starts after the last '/' (ignoring trailing ones).
+	base = len;
+	while (base > 1 && walk.path[base - 1] == '/') {
+		base--;
+	}
+	while (base > 0 && walk.path[base - 1] != '/') {
+		base--;
+	}
+
+	result = visit(&walk, dirfd, relpath, len, base, 0);
+	free(walk.batch);
+
+	return (result);
+}
+
+static int
+visit(struct walk *walk, int parent, const char *name, size_t len,
+	size_t base, int level)
+{
+	struct FTW ftw = { .base = base, .level = level };
+	const struct ancestor *a;
+	struct ancestor self;
+	struct stat sb;
+	char *names;
+	size_t count;
+	int fd, result, type;
+
+	if (fstatat(parent, name, &sb,
+	    (walk->flags & FTW_PHYS) ? AT_SYMLINK_NOFOLLOW : 0) != 0) {
+		// A symbolic link whose target doesn't exist?
+		if (!(walk->flags & FTW_PHYS) && errno == ENOENT
+		    && fstatat(parent, name, &sb, AT_SYMLINK_NOFOLLOW) == 0
+		    && S_ISLNK(sb.st_mode)) {
+			return (walk->fn(walk->path, &sb, FTW_SLN, &ftw));
+		}
+
+		// Don't show the callback whatever fstatat left behind.
+		memset(&sb, 0, sizeof(sb));
+		return (walk->fn(walk->path, &sb, FTW_NS, &ftw));
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		type = S_ISLNK(sb.st_mode) ? FTW_SL : FTW_F;
+		return (walk->fn(walk->path, &sb, type, &ftw));
+	}
+
+	// FTW_MOUNT keeps the walk from entering directories on other file
+	// systems (but files on them, e.g. devices, are still reported).
+	if ((walk->flags & FTW_MOUNT) && sb.st_dev != walk->dev) {
+		return (0);
+	}
+
+	// Following a link back to a directory that we're already inside of
+	// would never end: report it, but don't descend into it again.
+	type = (walk->flags & FTW_DEPTH) ? FTW_DP : FTW_D;
+	for (a = walk->ancestors; a != NULL; a = a->parent) {
+		if (a->dev == sb.st_dev && a->ino == sb.st_ino) {
+			return (walk->fn(walk->path, &sb, type, &ftw));
+		}
+	}
+
+	fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC
+		| ((walk->flags & FTW_PHYS) ? O_NOFOLLOW : 0));
+	if (fd == -1) {
+		return (walk->fn(walk->path, &sb, FTW_DNR, &ftw));
+	}
+
+	// Read the whole directory before descending into it, so that only
+	// one batch buffer is needed however deep the tree is. A directory
+	// that can't be read is reported as such (but running out of memory
+	// ends the walk).
+	names = read_names(fd, walk->batch, &count);
+	if (names == NULL) {
+		close(fd);
+		if (errno == ENOMEM) {
+			return (-1);
+		}
+		return (walk->fn(walk->path, &sb, FTW_DNR, &ftw));
+	}
+
+	if (!(walk->flags & FTW_DEPTH)) {
+		result = walk->fn(walk->path, &sb, FTW_D, &ftw);
+		if (result != 0) {
+			free(names);
+			close(fd);
+			return (result);
+		}
+	}
+
+	self.dev = sb.st_dev;
+	self.ino = sb.st_ino;
+	self.parent = walk->ancestors;
+	walk->ancestors = &self;
+
+	result = walk_dir(walk, fd, names, count, len, level);
+	walk->ancestors = self.parent;
+	free(names);
+	close(fd);
+
+	if (result != 0) {
+		return (result);
+	}
+
+	// The callback may have modified the path (it isn't const).
+	walk->path[len] = '\0';
+
+	if (walk->flags & FTW_DEPTH) {
+		result = walk->fn(walk->path, &sb, FTW_DP, &ftw);
+	}
+
+	return (result);
+}
+
+static int
+walk_dir(struct walk *walk, int fd, const char *names, size_t count,
+	size_t len, int level)
+{
+	const char *name;
+	size_t dirlen, namelen;
+	int result;
+
+	dirlen = len;
+	if (dirlen == 0 || walk->path[dirlen - 1] != '/') {
+		walk->path[dirlen++] = '/';
+	}
+
+	result = 0;
+	name = names;
+	for (size_t i = 0; i < count && result == 0; i++) {
+		namelen = strlen(name);
+		if (dirlen + namelen >= sizeof(walk->path)) {
+			errno = ENAMETOOLONG;
+			result = -1;
+			break;
+		}
+
+		memcpy(walk->path + dirlen, name, namelen + 1);
+		result = visit(walk, fd, name, dirlen + namelen, dirlen,
+			level + 1);
+
+		name += namelen + 1;
+	}
+
+	walk->path[len] = '\0';
+
+	return (result);
+}
+
+static char*
+read_names(int fd, char *batch, size_t *count)
+{
+	batch_dirent *entry;
+	char *names, *grown;
+	size_t capacity, used, namelen;
+	ssize_t len;
+	int saved;
+
+	capacity = 1024;
+	used = 0;
+	*count = 0;
+
+	names = malloc(capacity);
+	if (names == NULL) {
+		return (NULL);
+	}
+
+	while ((len = read_batch(fd, batch, BATCH_SIZE)) > 0) {
+		for (ssize_t off = 0; off < len; off += entry->d_reclen) {
+			entry = (batch_dirent*) (batch + off);
+
+			if (strcmp(entry->d_name, ".") == 0
+			    || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+
+			namelen = strlen(entry->d_name) + 1;
+			if (used + namelen > capacity) {
+				capacity = MAX(2 * capacity, used + namelen);
+				grown = realloc(names, capacity);
+				if (grown == NULL) {
+					free(names);
+					return (NULL);
+				}
+				names = grown;
+			}
+
+			memcpy(names + used, entry->d_name, namelen);
+			used += namelen;
+			(*count)++;
+		}
+	}
+
+	if (len < 0) {
+		saved = errno;
+		free(names);
+		errno = saved;
+		return (NULL);
+	}
+
+	return (names);
+}
+
+static ssize_t
+read_batch(int fd, char *batch, size_t size)
+{
+#ifdef __linux__
+	return (getdents64(fd, batch, size));
+#else
+	return (getdents(fd, batch, size));
+#endif
+}
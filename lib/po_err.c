@@ -54,7 +54,19 @@
 #include "internal.h"
 #include "libpreopen.h"
 
-static char error_buffer[1024];
+/**
+ * The calling thread's last error.
+ */
+static _Thread_local struct {
+	enum po_error	 code;
+	int		 error;
+	const char	*context;
+} last_error;
+
+/**
+ * Buffer that po_last_error formats the calling thread's last error into.
+ */
+static _Thread_local char error_buffer[1024];
 
 #if !defined(NDEBUG)
 void
@@ -66,27 +78,47 @@ po_map_assertvalid(const struct po_map *map)
 	assert(map->refcount > 0);
 	assert(map->length <= map->capacity);
 	assert(map->entries != NULL || map->capacity == 0);
+	assert(map->segment == NULL || map->length == 0);
 
 	for (i = 0; i < map->length; i++) {
 		entry = map->entries + i;
 
 		assert(entry->name != NULL);
-		assert(entry->fd >= 0);
+		assert(entry->fd >= 0 || entry->lazy != NULL);
+	}
+
+	if (map->base != NULL) {
+		po_map_assertvalid(map->base);
 	}
 }
 #endif /* !defined(NDEBUG) */
 
 void
-po_errormessage(const char *msg)
+po_seterror(enum po_error code, const char *context)
 {
 
-	snprintf(error_buffer, sizeof(error_buffer), "%s: error %d",
-		msg, errno);
+	last_error.code = code;
+	last_error.error = errno;
+	last_error.context = context;
 }
 
 const char*
 po_last_error()
 {
 
+	if (last_error.code == PO_ERROR_NONE) {
+		return (NULL);
+	}
+
+	snprintf(error_buffer, sizeof(error_buffer), "%s: error %d",
+		last_error.context, last_error.error);
+
 	return (error_buffer);
 }
+
+enum po_error
+po_last_error_code()
+{
+
+	return (last_error.code);
+}
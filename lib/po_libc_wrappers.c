@@ -34,13 +34,19 @@
  * @brief  Wrappers of libc functions that access global variables.
  */
 
+#include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <limits.h>
+#include <paths.h>
+#include <pthread.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -49,6 +55,8 @@
 
 #include "internal.h"
 
+extern char **environ;
+
 /**
  * A default po_map that can be used implicitly by libc wrappers.
  *
@@ -57,20 +65,256 @@
 static struct po_map *global_map;
 
 /**
- * Find a relative path within the po_map given by SHARED_MEMORYFD (if it
- * exists).
+ * Maximum depth of a thread's stack of maps (see po_push_thread_map).
+ *
+ * @internal
+ */
+#define	THREAD_MAP_DEPTH	8
+
+/**
+ * Maps pushed by the calling thread, which take precedence over global_map.
+ *
+ * @internal
+ */
+static _Thread_local struct po_map *thread_maps[THREAD_MAP_DEPTH];
+
+/**
+ * Number of maps in thread_maps.
+ *
+ * @internal
+ */
+static _Thread_local unsigned int thread_map_depth;
+
+/**
+ * The virtual working directory that relative paths are resolved against
+ * (or -1 if `chdir` or `fchdir` hasn't been called).
+ *
+ * @internal
+ */
+static _Atomic(int) cwd_fd = -1;
+
+/**
+ * Number of lookups that may still be using a virtual working directory
+ * that they loaded from @b cwd_fd. Lookups count themselves before loading
+ * it, so superseded directories can be closed once there are none.
+ *
+ * @internal
+ */
+static _Atomic(unsigned int) cwd_readers;
+
+/**
+ * Number of @b cwd_readers that the calling thread accounts for
+ * (see release_cwd).
+ *
+ * @internal
+ */
+static _Thread_local unsigned int cwd_holds;
+
+/**
+ * Superseded virtual working directories that are waiting for the lookups
+ * using them to finish.
+ *
+ * @internal
+ */
+static int *retired_cwds;
+
+/**
+ * Number of descriptors in @b retired_cwds (only changed with @b cwd_lock
+ * held, but checked without it).
  *
- * @returns  a struct po_relpath with dirfd and relative_path as set by po_find
- *           if there is an available po_map, or AT_FDCWD/path otherwise
+ * @internal
  */
-static struct po_relpath find_relative(const char *path, cap_rights_t *);
+static _Atomic(size_t) nretired_cwds;
+
+/**
+ * The logical path of the virtual working directory, as reported by `getcwd`
+ * (or the empty string if it is unknown).
+ *
+ * @internal
+ */
+static char cwd_path[MAXPATHLEN];
+
+/**
+ * Protects @b cwd_path and @b retired_cwds, and serializes changes to
+ * @b cwd_fd (which lookups read without it).
+ *
+ * @internal
+ */
+static pthread_rwlock_t cwd_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * The library path set by po_set_library_path (or NULL to use the default).
+ *
+ * @internal
+ */
+static char *library_path;
+
+/**
+ * The library path used if po_set_library_path hasn't been called and
+ * `PO_LIBRARY_PATH` is not set.
+ *
+ * @internal
+ */
+#define	DEFAULT_LIBRARY_PATH	"/lib:/usr/lib:/usr/local/lib"
+
+/**
+ * The next definition of a libc function that we wrap, i.e., the "real" one,
+ * for use when there is nothing to emulate it with.
+ *
+ * @internal
+ */
+#define	REAL(name)	((__typeof__(&name)) dlsym(RTLD_NEXT, #name))
+
+/**
+ * Number of lookups that the calling thread will do before the next one is
+ * passed to po_trace_record.
+ *
+ * @internal
+ */
+static _Thread_local uint32_t trace_countdown = 1;
+
+/**
+ * Paths rewritten by symlink resolution (see po_resolve_symlinks), which
+ * relative paths returned by find_relative may point into. There are two so
+ * that `rename` can hold on to both of its lookups.
+ *
+ * @internal
+ */
+static _Thread_local char resolved[2][MAXPATHLEN];
+
+/**
+ * The next buffer in @b resolved to use.
+ *
+ * @internal
+ */
+static _Thread_local unsigned int next_resolved;
+
+/**
+ * Find a relative path within the calling thread's po_map (see
+ * po_push_thread_map) or else the po_map given by SHARED_MEMORYFD (if it
+ * exists), falling back to the descriptor broker (see po_set_broker).
+ * Relative paths are resolved against the working directory (see set_cwd),
+ * but not while the calling thread has a map of its own.
+ *
+ * @param    access  the PO_ACCESS_* modes that the operation requires of the
+ *                   directory (so that, e.g., a read-only entry is not
+ *                   chosen for a write)
+ * @param    call    the wrapper doing the lookup (for tracing)
+ *
+ * @returns  a struct po_relpath with dirfd and relative_path as set by
+ *           po_find_access if there is an available po_map,
+ *           or AT_FDCWD/path otherwise
+ */
+static struct po_relpath find_relative(const char *path,
+	unsigned int access, enum po_trace_call call);
+
+/**
+ * Like find_relative, but also find the I/O policy of the matching po_map
+ * entry (NULL if the path didn't match one or the entry has no policy).
+ *
+ * @param    follow  whether to follow a symbolic link in the last component
+ *                   of @b path (when resolving links in user space)
+ */
+static struct po_relpath find_relative_io(const char *path,
+	unsigned int access, enum po_trace_call call, bool follow,
+	const struct po_io_policy **policyp);
+
+/**
+ * Open a file relative to a directory according to an I/O policy (if any).
+ */
+static int	open_with_policy(struct po_relpath rel, int flags, int mode,
+	const struct po_io_policy *policy);
+
+/**
+ * The PO_ACCESS_* modes required by an `access(2)` mode.
+ */
+static unsigned int	access_mode(int mode);
+
+/**
+ * Replace the virtual working directory.
+ *
+ * @param   fd      the new working directory (which this takes ownership of)
+ * @param   path    its logical path (or "" if unknown)
+ */
+static void	set_cwd(int fd, const char *path);
+
+/**
+ * Stop using the working directories that the calling thread's lookups
+ * have returned since it accounted for @b held of them, closing superseded
+ * ones that no other lookup is using.
+ *
+ * Wrappers record `cwd_holds` before their lookups and call this once they
+ * are done with the results.
+ */
+static void	release_cwd(unsigned int held);
+
+/**
+ * Close the superseded working directories if no lookup is using them
+ * (with @b cwd_lock held for writing).
+ */
+static void	close_retired_cwds(void);
 
 /**
  * Get the map that was handed into the process via `SHARED_MEMORYFD`
  * (if it exists).
+ *
+ * If `SHARED_MEMORYSOCK` is also set, the process attaches to the shared
+ * segment (see `po_attach`) and receives updates over that socket. Only the
+ * first `SHARED_MEMORYCOUNT` entries (none, if it isn't set) use inherited
+ * descriptors: the rest must be sent over the socket.
  */
 static struct po_map*	get_shared_map(void);
 
+/**
+ * Get the map that the calling thread's lookups use: the map on top of its
+ * stack (see po_push_thread_map) or else the shared map (if any).
+ */
+static struct po_map*	current_map(void);
+
+/**
+ * Resolve a candidate executable path (for po_search).
+ */
+static struct po_relpath	resolve_exec(const char *path,
+	unsigned int access);
+
+/**
+ * Resolve a candidate library path (for po_search).
+ */
+static struct po_relpath	resolve_library(const char *path,
+	unsigned int access);
+
+/**
+ * The directories that the `dlopen` wrapper searches for sonames:
+ * `LD_LIBRARY_PATH` followed by the library path.
+ *
+ * @returns false if they don't fit in @b size bytes
+ */
+static bool	library_search(char *buf, size_t size);
+
+/**
+ * Execute a file relative to a pre-opened directory with `fexecve(2)`,
+ * running it with the shell if it isn't in an executable format (as
+ * `execvp(3)` does).
+ *
+ * @param   found   set to whether the file could be opened (so that a
+ *                  failure came from executing it rather than finding it)
+ *
+ * @returns -1 (like `execve(2)`, this only returns on failure)
+ */
+static int	exec_relative(const char *path, char *const argv[],
+	char *const envp[], bool *found);
+
+/**
+ * Run the shell on the script open as @b fd (which must stay open).
+ */
+static void	exec_shell(int fd, char *const argv[], char *const envp[]);
+
+/**
+ * Discard the metadata and union caches after a call that may have changed
+ * the filesystem (preserving the call's errno).
+ */
+static void	invalidate_caches(void);
+
 
 /*
  * Wrappers around system calls:
@@ -90,19 +334,31 @@ static struct po_map*	get_shared_map(void);
 int
 _open(const char *path, int flags, ...)
 {
+	const struct po_io_policy *policy;
 	struct po_relpath rel;
+	unsigned int held;
 	va_list args;
-	int mode;
+	int fd, mode;
 
 	va_start(args, flags);
 	mode = va_arg(args, int);
-	rel = find_relative(path, NULL);
+	held = cwd_holds;
+	rel = find_relative_io(path, po_open_access(flags), PO_TRACE_OPEN,
+		!(flags & O_NOFOLLOW), &policy);
 
 	// If the file is already opened, no need of relative opening!
-	if( strcmp(rel.relative_path,".") == 0 )
-		return dup(rel.dirfd);
+	if( rel.dirfd != AT_FDCWD && strcmp(rel.relative_path,".") == 0 )
+		fd = dup(rel.dirfd);
 	else
-		return openat(rel.dirfd, rel.relative_path, flags, mode);
+		fd = open_with_policy(rel, flags, mode, policy);
+	release_cwd(held);
+
+	// Opening a file for writing may create it or change its metadata.
+	if (flags & (O_CREAT | O_TRUNC | O_WRONLY | O_RDWR)) {
+		invalidate_caches();
+	}
+
+	return (fd);
 }
 
 /**
@@ -119,9 +375,68 @@ _open(const char *path, int flags, ...)
 int
 access(const char *path, int mode)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, access_mode(mode),
+		PO_TRACE_ACCESS);
+	int result;
+
+	result = po_cached_faccessat(rel.dirfd, rel.relative_path, mode);
+	release_cwd(held);
+
+	return (result);
+}
+
+/**
+ * Capability-safe emulation of the `chdir(2)` system call.
+ *
+ * `chdir(2)` changes the process' working directory, which cannot be used in
+ * a sandbox. Instead, when a po_map is available, this wrapper opens the
+ * directory (relative to a pre-opened directory or the current virtual
+ * working directory) and makes it the virtual working directory: relative
+ * paths passed to the other wrappers are then opened relative to it without
+ * searching the po_map, and `getcwd(3)` reports its logical path.
+ * The real working directory is also changed where that is permitted.
+ */
+int
+chdir(const char *path)
+{
+	struct po_relpath rel;
+	char logical[MAXPATHLEN];
+	unsigned int held;
+	int fd;
+
+	if (get_shared_map() == NULL && cwd_fd == -1) {
+		return (REAL(chdir)(path));
+	}
 
-	return faccessat(rel.dirfd, rel.relative_path, mode,0);
+	// Lookups pass a NULL path through (which the real chdir(2) rejects
+	// with EFAULT), but we mustn't use it below.
+	held = cwd_holds;
+	rel = find_relative(path, 0, PO_TRACE_CHDIR);
+	if (rel.relative_path == NULL) {
+		release_cwd(held);
+		errno = EFAULT;
+		return (-1);
+	}
+
+	fd = openat(rel.dirfd, rel.relative_path,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	release_cwd(held);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	// A relative path from an unknown directory leads somewhere unknown.
+	pthread_rwlock_rdlock(&cwd_lock);
+	if ((path[0] != '/' && cwd_path[0] == '\0')
+	    || !po_logical_path(logical, sizeof(logical), cwd_path, path)) {
+		logical[0] = '\0';
+	}
+	pthread_rwlock_unlock(&cwd_lock);
+
+	set_cwd(fd, logical);
+
+	return (0);
 }
 
 /**
@@ -139,12 +454,17 @@ int
 connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
 	struct po_relpath rel;
+	unsigned int held;
+	int result;
 
 	if (name->sa_family == AF_UNIX) {
 	    struct sockaddr_un *usock = (struct sockaddr_un *)name;
-	    rel = find_relative(usock->sun_path, NULL);
+	    held = cwd_holds;
+	    rel = find_relative(usock->sun_path, 0, PO_TRACE_CONNECT);
 	    strlcpy(usock->sun_path, rel.relative_path, sizeof(usock->sun_path));
-	    return connectat(rel.dirfd, s, name, namelen);
+	    result = connectat(rel.dirfd, s, name, namelen);
+	    release_cwd(held);
+	    return (result);
 	}
 
 	return connectat(AT_FDCWD, s, name, namelen);
@@ -164,9 +484,51 @@ connect(int s, const struct sockaddr *name, socklen_t namelen)
 int
 eaccess(const char *path, int mode)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, access_mode(mode),
+		PO_TRACE_EACCESS);
+	int result;
+
+	result = po_cached_faccessat(rel.dirfd, rel.relative_path, mode);
+	release_cwd(held);
 
-	return faccessat(rel.dirfd, rel.relative_path, mode, 0);
+	return (result);
+}
+
+/**
+ * Capability-safe emulation of the `fchdir(2)` system call.
+ *
+ * When a po_map is available, this wrapper makes (a duplicate of) @b fd the
+ * virtual working directory, as described for `chdir(2)`. Its logical path is
+ * not known, so `getcwd(3)` will fall back to the real working directory.
+ */
+int
+fchdir(int fd)
+{
+	struct stat sb;
+	int newfd;
+
+	if (get_shared_map() == NULL && cwd_fd == -1) {
+		return (REAL(fchdir)(fd));
+	}
+
+	if (fstat(fd, &sb) != 0) {
+		return (-1);
+	}
+
+	if (!S_ISDIR(sb.st_mode)) {
+		errno = ENOTDIR;
+		return (-1);
+	}
+
+	newfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (newfd == -1) {
+		return (-1);
+	}
+
+	set_cwd(newfd, "");
+
+	return (0);
 }
 
 /**
@@ -183,9 +545,15 @@ eaccess(const char *path, int mode)
 int
 lstat(const char *path, struct stat *st)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, 0, PO_TRACE_LSTAT);
+	int result;
+
+	result = po_cached_fstatat(rel.dirfd, rel.relative_path, st,
+		AT_SYMLINK_NOFOLLOW);
+	release_cwd(held);
 
-	return fstatat(rel.dirfd, rel.relative_path,st,AT_SYMLINK_NOFOLLOW);
+	return (result);
 }
 
 /**
@@ -219,11 +587,19 @@ open(const char *path, int flags, ...)
 int
 rename(const char *from, const char *to)
 {
-	struct po_relpath rel_from = find_relative(from, NULL);
-	struct po_relpath rel_to = find_relative(to, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel_from = find_relative(from, PO_ACCESS_WRITE,
+		PO_TRACE_RENAME);
+	struct po_relpath rel_to = find_relative(to, PO_ACCESS_WRITE,
+		PO_TRACE_RENAME);
+	int result;
 
-	return renameat(rel_from.dirfd, rel_from.relative_path, rel_to.dirfd,
+	result = renameat(rel_from.dirfd, rel_from.relative_path, rel_to.dirfd,
 		rel_to.relative_path);
+	release_cwd(held);
+	invalidate_caches();
+
+	return (result);
 }
 
 /**
@@ -240,9 +616,15 @@ rename(const char *from, const char *to)
 int
 stat(const char *path, struct stat *st)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, 0, PO_TRACE_STAT);
+	int result;
+
+	result = po_cached_fstatat(rel.dirfd, rel.relative_path, st,
+		AT_SYMLINK_NOFOLLOW);
+	release_cwd(held);
 
-	return fstatat(rel.dirfd, rel.relative_path,st, AT_SYMLINK_NOFOLLOW);
+	return (result);
 }
 
 /**
@@ -259,9 +641,16 @@ stat(const char *path, struct stat *st)
 int
 unlink(const char *path)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, PO_ACCESS_WRITE,
+		PO_TRACE_UNLINK);
+	int result;
+
+	result = unlinkat(rel.dirfd, rel.relative_path, 0);
+	release_cwd(held);
+	invalidate_caches();
 
-	return unlinkat(rel.dirfd, rel.relative_path, 0);
+	return (result);
 }
 
 /*
@@ -278,13 +667,294 @@ unlink(const char *path)
  * possible. If the current po_map does not contain the sought-after path, this
  * wrapper will call `fdlopen(openat(AT_FDCWD, original_path), ...)`, which is
  * the same as the unwrapped `dlopen(3)` call (i.e., will fail with `ECAPMODE`).
+ *
+ * Libraries named without a '/' are searched for in `LD_LIBRARY_PATH` and then
+ * the library path (see `po_set_library_path`), resolving each directory
+ * against the po_map. Where each library was found (or not found) is cached
+ * (see po_search), so loading the same plugin again takes a single `openat`.
+ * Names that can't be found this way are passed to the real `dlopen(3)`,
+ * which may already have them loaded.
  */
 void *
 dlopen(const char *path, int mode)
 {
-	struct po_relpath rel = find_relative(path, NULL);
+	char found[MAXPATHLEN], search[2 * MAXPATHLEN];
+	struct po_relpath rel;
+	unsigned int held;
+	void *handle;
+	int error, fd;
+
+	if (path == NULL) {
+		return (REAL(dlopen)(path, mode));
+	}
+
+	held = cwd_holds;
+
+	if (strchr(path, '/') == NULL) {
+		error = !library_search(search, sizeof(search))
+		    || po_search(PO_SEARCH_LIBRARY, path, search,
+		    current_map(), resolve_library, found, sizeof(found)) != 0;
+		release_cwd(held);
+		if (error) {
+			return (REAL(dlopen)(path, mode));
+		}
+
+		path = found;
+	}
 
-	return fdlopen(openat(rel.dirfd, rel.relative_path, 0, mode), mode);
+	rel = find_relative(path, PO_ACCESS_READ | PO_ACCESS_EXEC,
+		PO_TRACE_DLOPEN);
+
+	fd = openat(rel.dirfd, rel.relative_path, O_RDONLY | O_CLOEXEC);
+	release_cwd(held);
+	if (fd == -1) {
+		return (NULL);
+	}
+
+	// The run-time linker keeps its own reference to the file.
+	handle = fdlopen(fd, mode);
+	close(fd);
+
+	return (handle);
+}
+
+/**
+ * Capability-safe wrapper around the `execvp(3)` libc function.
+ *
+ * This is `execvpe(3)` with the current environment.
+ */
+int
+execvp(const char *file, char *const argv[])
+{
+	return (execvpe(file, argv, environ));
+}
+
+/**
+ * Capability-safe wrapper around the `execvpe(3)` libc function.
+ *
+ * Each directory in `PATH` is resolved against the current po_map, and the
+ * executable that is found is run with `fexecve(2)` relative to its
+ * directory's descriptor (or, if it isn't in an executable format, with
+ * `/bin/sh`). Where commands were found (or not found) is cached by name
+ * (see po_search), so repeatedly executing a command doesn't search `PATH`
+ * again.
+ */
+int
+execvpe(const char *file, char *const argv[], char *const envp[])
+{
+	char path[MAXPATHLEN];
+	const char *search;
+	unsigned int held;
+	bool found;
+	int error;
+
+	if (strchr(file, '/') != NULL) {
+		return (exec_relative(file, argv, envp, &found));
+	}
+
+	search = getenv("PATH");
+	if (search == NULL) {
+		search = _PATH_DEFPATH;
+	}
+
+	held = cwd_holds;
+	error = po_search(PO_SEARCH_COMMAND, file, search, current_map(),
+		resolve_exec, path, sizeof(path));
+	release_cwd(held);
+	if (error != 0) {
+		errno = error;
+		return (-1);
+	}
+
+	exec_relative(path, argv, envp, &found);
+
+	// Perhaps the command has been removed since we found it? (If it was
+	// there, ENOENT means that its interpreter is missing.)
+	if (!found && errno == ENOENT) {
+		po_search_forget(PO_SEARCH_COMMAND, file, current_map());
+
+		error = po_search(PO_SEARCH_COMMAND, file, search,
+			current_map(), resolve_exec, path, sizeof(path));
+		release_cwd(held);
+		if (error != 0) {
+			errno = error;
+			return (-1);
+		}
+
+		exec_relative(path, argv, envp, &found);
+	}
+
+	return (-1);
+}
+
+/**
+ * Capability-safe wrapper around the `nftw(3)` libc function.
+ *
+ * The starting directory is looked up in the current po_map and every
+ * directory beneath it is opened relative to its parent (see po_nftwat), so
+ * the walk never needs ambient authority once it has started. Walks with
+ * `FTW_CHDIR` are passed to the real `nftw(3)`.
+ */
+int
+nftw(const char *path, po_nftw_fn fn, int nopenfd, int flags)
+{
+	struct po_relpath rel;
+	unsigned int held;
+	int result;
+
+#ifdef FTW_ACTIONRETVAL
+	if (flags & (FTW_CHDIR | FTW_ACTIONRETVAL)) {
+#else
+	if (flags & FTW_CHDIR) {
+#endif
+		return (REAL(nftw)(path, fn, nopenfd, flags));
+	}
+
+	held = cwd_holds;
+	rel = find_relative(path, PO_ACCESS_READ, PO_TRACE_NFTW);
+	result = po_nftwat(rel.dirfd, rel.relative_path, path, fn, flags);
+	release_cwd(held);
+
+	return (result);
+}
+
+/**
+ * Capability-safe wrapper around the `opendir(3)` libc function.
+ *
+ * The directory is looked up in the current po_map, opened with `openat(2)`
+ * and wrapped with `fdopendir(3)`.
+ */
+DIR *
+opendir(const char *path)
+{
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, PO_ACCESS_READ,
+		PO_TRACE_OPENDIR);
+	DIR *dir;
+
+	dir = po_opendirat(rel.dirfd, rel.relative_path);
+	release_cwd(held);
+
+	return (dir);
+}
+
+/**
+ * Wrapper around the `posix_spawnp(3)` libc function.
+ *
+ * This finds the executable like `execvpe` does (using the same cache) and
+ * passes it to `posix_spawn(3)`, which skips the search of `PATH` in the
+ * child. The child is still executed by path, so this needs a process that
+ * has not entered capability mode (use `po_spawn` for sandboxed children).
+ */
+int
+posix_spawnp(pid_t *pid, const char *file,
+	const posix_spawn_file_actions_t *actions,
+	const posix_spawnattr_t *attr, char *const argv[], char *const envp[])
+{
+	char path[MAXPATHLEN];
+	const char *search;
+	unsigned int held;
+	int error;
+
+	if (strchr(file, '/') != NULL) {
+		return (posix_spawn(pid, file, actions, attr, argv, envp));
+	}
+
+	search = getenv("PATH");
+	if (search == NULL) {
+		search = _PATH_DEFPATH;
+	}
+
+	held = cwd_holds;
+	error = po_search(PO_SEARCH_COMMAND, file, search, current_map(),
+		resolve_exec, path, sizeof(path));
+	release_cwd(held);
+	if (error != 0) {
+		return (error);
+	}
+
+	error = posix_spawn(pid, path, actions, attr, argv, envp);
+	if (error == ENOENT) {
+		po_search_forget(PO_SEARCH_COMMAND, file, current_map());
+
+		error = po_search(PO_SEARCH_COMMAND, file, search,
+			current_map(), resolve_exec, path, sizeof(path));
+		release_cwd(held);
+		if (error == 0) {
+			error = posix_spawn(pid, path, actions, attr, argv,
+				envp);
+		}
+	}
+
+	return (error);
+}
+
+/**
+ * Capability-safe wrapper around the `scandir(3)` libc function.
+ *
+ * The directory is looked up in the current po_map and read through a
+ * descriptor opened with `openat(2)`.
+ */
+int
+scandir(const char *path, struct dirent ***namelist,
+	int (*select)(const struct dirent *),
+	int (*compar)(const struct dirent **, const struct dirent **))
+{
+	unsigned int held = cwd_holds;
+	struct po_relpath rel = find_relative(path, PO_ACCESS_READ,
+		PO_TRACE_SCANDIR);
+	int n;
+
+	n = po_scandirat(rel.dirfd, rel.relative_path, namelist, select,
+		compar);
+	release_cwd(held);
+
+	return (n);
+}
+
+/**
+ * Capability-safe emulation of the `getcwd(3)` libc function.
+ *
+ * If a virtual working directory with a known logical path has been set by
+ * `chdir(2)`, this wrapper reports that path. Otherwise, it reports the real
+ * working directory (which will fail with `ECAPMODE` in a sandbox).
+ */
+char *
+getcwd(char *buf, size_t size)
+{
+	char path[MAXPATHLEN];
+	size_t len;
+
+	pthread_rwlock_rdlock(&cwd_lock);
+	len = strlcpy(path, cwd_path, sizeof(path));
+	pthread_rwlock_unlock(&cwd_lock);
+
+	if (len == 0) {
+		return (REAL(getcwd)(buf, size));
+	}
+
+	if (buf == NULL) {
+		size = (size == 0) ? len + 1 : size;
+		if (len + 1 > size) {
+			errno = ERANGE;
+			return (NULL);
+		}
+
+		buf = malloc(size);
+		if (buf == NULL) {
+			return (NULL);
+		}
+	} else if (size == 0) {
+		errno = EINVAL;
+		return (NULL);
+	} else if (len + 1 > size) {
+		errno = ERANGE;
+		return (NULL);
+	}
+
+	memcpy(buf, path, len + 1);
+
+	return (buf);
 }
 
 /* Provide tests with mechanism to set our static po_map */
@@ -302,29 +972,455 @@ po_set_libc_map(struct po_map *map)
 	global_map = map;
 }
 
+int
+po_set_library_path(const char *path)
+{
+	char *copy = NULL;
+
+	if (path != NULL && (copy = strdup(path)) == NULL) {
+		po_seterror(PO_ERROR_NOMEM, "failed to copy library path");
+		return (-1);
+	}
+
+	free(library_path);
+	library_path = copy;
+
+	return (0);
+}
+
+int
+po_push_thread_map(struct po_map *map)
+{
+	po_map_assertvalid(map);
+
+	if (thread_map_depth == THREAD_MAP_DEPTH) {
+		errno = EOVERFLOW;
+		po_seterror(PO_ERROR_INVALID, "thread map stack is full");
+		return (-1);
+	}
+
+	map->refcount += 1;
+	thread_maps[thread_map_depth++] = map;
+
+	return (0);
+}
+
+int
+po_pop_thread_map(void)
+{
+	struct po_map *map;
+
+	if (thread_map_depth == 0) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID, "no thread map to pop");
+		return (-1);
+	}
+
+	map = thread_maps[--thread_map_depth];
+	thread_maps[thread_map_depth] = NULL;
+	po_map_release(map);
+
+	return (0);
+}
+
+static unsigned int
+access_mode(int mode)
+{
+	unsigned int access = 0;
+
+	if (mode & R_OK) {
+		access |= PO_ACCESS_READ;
+	}
+
+	if (mode & W_OK) {
+		access |= PO_ACCESS_WRITE;
+	}
+
+	if (mode & X_OK) {
+		access |= PO_ACCESS_EXEC;
+	}
+
+	return (access);
+}
+
+static struct po_relpath
+find_relative(const char *path, unsigned int access, enum po_trace_call call)
+{
+
+	// These calls operate on links themselves rather than their targets.
+	bool follow = (call != PO_TRACE_LSTAT && call != PO_TRACE_RENAME
+		&& call != PO_TRACE_UNLINK);
+
+	return (find_relative_io(path, access, call, follow, NULL));
+}
+
 static struct po_relpath
-find_relative(const char *path, cap_rights_t *rights)
+find_relative_io(const char *path, unsigned int access,
+	enum po_trace_call call, bool follow,
+	const struct po_io_policy **policyp)
 {
 	struct po_relpath rel;
 	struct po_map *map;
+	const char *searched;
+	char *buf;
 
-	map = get_shared_map();
-	if (map == NULL) {
-		rel.dirfd = AT_FDCWD;
+	if (policyp != NULL) {
+		*policyp = NULL;
+	}
+
+	// Links that were followed can make the searched path differ from
+	// the caller's, and the relative path is a suffix of the former.
+	searched = path;
+
+	// A thread map is the whole of the thread's namespace: the working
+	// directory and the broker belong to the process-wide map.
+	if (thread_map_depth > 0) {
+		map = thread_maps[thread_map_depth - 1];
+		rel = po_find_resolved(map, path, access, follow,
+			resolved[next_resolved++ % 2], MAXPATHLEN, &searched,
+			policyp);
+		if (rel.dirfd != -1) {
+			goto done;
+		}
+
+		searched = path;
+		goto miss;
+	}
+
+	// Relative paths don't need a search once we have a working directory
+	// (which, once set, is never unset). Count ourselves as using it
+	// before loading it, so that set_cwd can't close it under us.
+	if (path != NULL && path[0] != '/'
+	    && atomic_load_explicit(&cwd_fd, memory_order_relaxed) != -1) {
+		atomic_fetch_add(&cwd_readers, 1);
+		cwd_holds++;
+		rel.dirfd = atomic_load(&cwd_fd);
 		rel.relative_path = path;
-	} else {
-		rel = po_find(map, path, NULL);
+		goto done;
+	}
+
+	map = get_shared_map();
+	if (map != NULL) {
+		buf = resolved[next_resolved++ % 2];
+		rel = po_find_resolved(map, path, access, follow, buf,
+			MAXPATHLEN, &searched, policyp);
+		if (rel.dirfd != -1) {
+			goto done;
+		}
+	}
+
+	// Ask the descriptor broker (if any) about paths that we can't find.
+	searched = path;
+	rel = po_broker_find(path, access);
+	if (rel.dirfd != -1) {
+		goto done;
+	}
+
+miss:
+	rel.dirfd = AT_FDCWD;
+	rel.relative_path = path;
+
+done:
+	if (path != NULL) {
+		po_stats_record(call, searched, rel);
+	}
+
+	if (--trace_countdown == 0 && path != NULL) {
+		trace_countdown = po_trace_record(call, path, rel,
+			po_match_length(searched, rel));
 	}
 
 	return (rel);
 }
 
+static int
+open_with_policy(struct po_relpath rel, int flags, int mode,
+	const struct po_io_policy *policy)
+{
+	int fd, saved;
+
+	if (policy == NULL) {
+		return (openat(rel.dirfd, rel.relative_path, flags, mode));
+	}
+
+	fd = openat(rel.dirfd, rel.relative_path, flags | policy->flags, mode);
+
+#ifdef O_NOATIME
+	// Only the file's owner (or a privileged process) may use O_NOATIME.
+	if (fd == -1 && errno == EPERM && (policy->flags & O_NOATIME)
+	    && !(flags & O_NOATIME)) {
+		fd = openat(rel.dirfd, rel.relative_path,
+			(flags | policy->flags) & ~O_NOATIME, mode);
+	}
+#endif
+
+	if (fd == -1 || (flags & O_ACCMODE) == O_WRONLY
+	    || (flags & O_DIRECTORY)) {
+		return (fd);
+	}
+
+	// Advice is only a hint: don't let it change the caller's errno.
+	saved = errno;
+
+	if (policy->advice != POSIX_FADV_NORMAL) {
+		(void) posix_fadvise(fd, 0, 0, policy->advice);
+	}
+
+	// POSIX_FADV_WILLNEED starts reading without waiting for the I/O.
+	if (policy->readahead > 0) {
+		(void) posix_fadvise(fd, 0, policy->readahead,
+			POSIX_FADV_WILLNEED);
+	}
+
+	errno = saved;
+
+	return (fd);
+}
+
+static void
+set_cwd(int fd, const char *path)
+{
+	size_t n;
+	int *fds, old;
+
+	pthread_rwlock_wrlock(&cwd_lock);
+
+	// Lookups may still be using the old directory: retire it, and close
+	// retired directories once nothing is (including the new one's lookup).
+	old = atomic_exchange(&cwd_fd, fd);
+	if (old != -1) {
+		n = atomic_load_explicit(&nretired_cwds, memory_order_relaxed);
+		fds = realloc(retired_cwds, (n + 1) * sizeof(*fds));
+		if (fds != NULL) {
+			retired_cwds = fds;
+			retired_cwds[n] = old;
+			atomic_store(&nretired_cwds, n + 1);
+		} else if (atomic_load(&cwd_readers) == 0) {
+			close(old);
+		}
+	}
+	close_retired_cwds();
+	strlcpy(cwd_path, path, sizeof(cwd_path));
+
+	// Cached results for the old descriptor number no longer apply.
+	po_stat_cache_invalidate();
+
+	// Keep the real working directory in step where we are allowed to.
+	(void) REAL(fchdir)(fd);
+
+	pthread_rwlock_unlock(&cwd_lock);
+}
+
+static void
+release_cwd(unsigned int held)
+{
+	unsigned int n;
+	int saved;
+
+	n = cwd_holds - held;
+	if (n == 0) {
+		return;
+	}
+
+	cwd_holds = held;
+	if (atomic_fetch_sub(&cwd_readers, n) != n
+	    || atomic_load(&nretired_cwds) == 0) {
+		return;
+	}
+
+	// We were the last lookup using a superseded directory.
+	saved = errno;
+	pthread_rwlock_wrlock(&cwd_lock);
+	close_retired_cwds();
+	pthread_rwlock_unlock(&cwd_lock);
+	errno = saved;
+}
+
+static void
+close_retired_cwds(void)
+{
+	size_t i, n;
+
+	// Lookups that start from now on will load the current directory.
+	if (atomic_load(&cwd_readers) != 0) {
+		return;
+	}
+
+	n = atomic_load_explicit(&nretired_cwds, memory_order_relaxed);
+	for (i = 0; i < n; i++) {
+		close(retired_cwds[i]);
+	}
+
+	free(retired_cwds);
+	retired_cwds = NULL;
+	atomic_store(&nretired_cwds, 0);
+}
+
+static struct po_relpath
+resolve_exec(const char *path, unsigned int access)
+{
+	return (find_relative(path, access, PO_TRACE_EXEC));
+}
+
+static struct po_relpath
+resolve_library(const char *path, unsigned int access)
+{
+	return (find_relative(path, access, PO_TRACE_DLOPEN));
+}
+
+static bool
+library_search(char *buf, size_t size)
+{
+	const char *env, *libpath;
+	int len;
+
+	libpath = library_path;
+	if (libpath == NULL) {
+		libpath = getenv("PO_LIBRARY_PATH");
+	}
+	if (libpath == NULL || *libpath == '\0') {
+		libpath = DEFAULT_LIBRARY_PATH;
+	}
+
+	env = getenv("LD_LIBRARY_PATH");
+	if (env == NULL || *env == '\0') {
+		len = snprintf(buf, size, "%s", libpath);
+	} else {
+		len = snprintf(buf, size, "%s:%s", env, libpath);
+	}
+
+	return (len >= 0 && (size_t) len < size);
+}
+
+static int
+exec_relative(const char *path, char *const argv[], char *const envp[],
+	bool *found)
+{
+	struct po_relpath rel;
+	unsigned int held;
+	int fd, saved;
+
+	held = cwd_holds;
+	rel = find_relative(path, PO_ACCESS_EXEC, PO_TRACE_EXEC);
+	fd = openat(rel.dirfd, rel.relative_path, O_RDONLY | O_CLOEXEC);
+	release_cwd(held);
+	*found = (fd != -1);
+	if (fd == -1) {
+		return (-1);
+	}
+
+	// The kernel runs a script's interpreter on a /dev/fd path, which
+	// wouldn't exist if the descriptor were closed on exec.
+	if (po_is_script(fd)) {
+		fcntl(fd, F_SETFD, 0);
+	}
+
+	fexecve(fd, argv, envp);
+
+	if (errno == ENOEXEC) {
+		exec_shell(fd, argv, envp);
+	}
+
+	saved = errno;
+	close(fd);
+	errno = saved;
+
+	return (-1);
+}
+
+static void
+exec_shell(int fd, char *const argv[], char *const envp[])
+{
+	char script[32], **args;
+	struct po_relpath rel;
+	unsigned int held;
+	size_t argc;
+	int saved, shell;
+
+	// Like the kernel does for a script's interpreter, give the shell a
+	// /dev/fd path (the script's own path may not exist outside the map).
+	snprintf(script, sizeof(script), "/dev/fd/%d", fd);
+
+	for (argc = 0; argv[argc] != NULL; argc++) {
+	}
+
+	// sh script argv[1]...
+	args = malloc((argc + 2) * sizeof(*args));
+	if (args == NULL) {
+		return;
+	}
+
+	args[0] = "sh";
+	args[1] = script;
+	memcpy(args + 2, argv + MIN(argc, 1),
+		(argc - MIN(argc, 1) + 1) * sizeof(*args));
+
+	held = cwd_holds;
+	rel = find_relative(_PATH_BSHELL, PO_ACCESS_EXEC, PO_TRACE_EXEC);
+	shell = openat(rel.dirfd, rel.relative_path, O_RDONLY | O_CLOEXEC);
+	release_cwd(held);
+
+	if (shell != -1) {
+		fcntl(fd, F_SETFD, 0);
+		fexecve(shell, args, envp);
+
+		saved = errno;
+		close(shell);
+		errno = saved;
+	}
+
+	saved = errno;
+	free(args);
+	errno = saved;
+}
+
+static void
+invalidate_caches(void)
+{
+	int saved = errno;
+
+	po_stat_cache_invalidate();
+	po_union_cache_invalidate();
+	errno = saved;
+}
+
+int
+po_getenv_fd(const char *name)
+{
+	char *end, *env;
+	long fd;
+
+	env = getenv(name);
+	if (env == NULL || *env == '\0') {
+		return (-1);
+	}
+
+	// We expect this environment variable to be an integer and nothing but
+	// an integer.
+	fd = strtol(env, &end, 10);
+	if (*end != '\0' || fd < 0 || fd > INT_MAX) {
+		return (-1);
+	}
+
+	return (fd);
+}
+
+static struct po_map*
+current_map()
+{
+
+	if (thread_map_depth > 0) {
+		return (thread_maps[thread_map_depth - 1]);
+	}
+
+	return (get_shared_map());
+}
+
 static struct po_map*
 get_shared_map()
 {
 	struct po_map *map;
-	char *end, *env;
-	long fd;
+	int count, fd, sock;
 
 	// Do we already have a default map?
 	if (global_map) {
@@ -334,19 +1430,21 @@ get_shared_map()
 
 	// Attempt to unwrap po_map from a shared memory segment specified by
 	// SHARED_MEMORYFD
-	env = getenv("SHARED_MEMORYFD");
-	if (env == NULL || *env == '\0') {
+	fd = po_getenv_fd("SHARED_MEMORYFD");
+	if (fd == -1) {
 		return (NULL);
 	}
 
-	// We expect this environment variable to be an integer and nothing but
-	// an integer.
-	fd = strtol(env, &end, 10);
-	if (*end != '\0') {
-		return (NULL);
+	// If we have been given a socket to receive updates on, look up
+	// directly in the (live) shared segment.
+	sock = po_getenv_fd("SHARED_MEMORYSOCK");
+	if (sock != -1) {
+		count = po_getenv_fd("SHARED_MEMORYCOUNT");
+		map = po_attach(fd, sock, count == -1 ? 0 : (size_t) count);
+	} else {
+		map = po_unpack(fd);
 	}
 
-	map = po_unpack(fd);
 	if (map == NULL) {
 		return (NULL);
 	}
@@ -0,0 +1,190 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file  po_manifest.c
+ * @brief Pre-opening many paths concurrently
+ *
+ * When pre-opening thousands of directories on network or overlay
+ * filesystems, startup is dominated by metadata latency rather than CPU time.
+ * `po_preopen_manifest` overlaps that latency by opening paths from a pool of
+ * worker threads and then adds all of the results to a po_map in one batch.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/**
+ * Work shared by the threads opening a manifest.
+ */
+struct manifest_work {
+	struct po_manifest_entry *entries;
+	size_t count;
+
+	/** Index of the next entry to be opened */
+	_Atomic(size_t) next;
+};
+
+/**
+ * Open manifest entries until there are none left (pthread entry point).
+ */
+static void*	open_entries(void *work);
+
+
+int
+po_preopen_manifest(struct po_map *map, struct po_manifest_entry manifest[],
+	size_t n, int nthreads)
+{
+	struct manifest_work work;
+	pthread_t *threads;
+	const char **paths;
+	size_t added, i;
+	int error, failures, *fds, started;
+
+	paths = NULL;
+	fds = NULL;
+
+	po_map_assertvalid(map);
+
+	work.entries = manifest;
+	work.count = n;
+	atomic_init(&work.next, 0);
+
+	if (nthreads < 1) {
+		nthreads = 1;
+	}
+	if ((size_t) nthreads > n) {
+		nthreads = n;
+	}
+
+	// The calling thread is one of the workers.
+	threads = calloc(nthreads, sizeof(*threads));
+	started = 0;
+	if (threads != NULL) {
+		for (; started < nthreads - 1; started++) {
+			if (pthread_create(threads + started, NULL,
+			    open_entries, &work) != 0) {
+				break;
+			}
+		}
+	}
+
+	open_entries(&work);
+
+	for (i = 0; i < (size_t) started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	paths = calloc(n, sizeof(*paths));
+	fds = calloc(n, sizeof(*fds));
+	if ((paths == NULL || fds == NULL) && n > 0) {
+		po_seterror(PO_ERROR_NOMEM,
+			"failed to allocate manifest batch");
+		error = ENOMEM;
+		goto fail;
+	}
+
+	failures = 0;
+	added = 0;
+	for (i = 0; i < n; i++) {
+		if (manifest[i].fd == -1) {
+			failures++;
+			continue;
+		}
+
+		paths[added] = manifest[i].path;
+		fds[added] = manifest[i].fd;
+		added++;
+	}
+
+	// Every entry failed for the same reason as the batch.
+	if (po_add_many(map, paths, fds, added) == NULL) {
+		error = errno;
+		goto fail;
+	}
+
+	free(paths);
+	free(fds);
+
+	return (failures);
+
+fail:
+	for (i = 0; i < n; i++) {
+		if (manifest[i].fd != -1) {
+			close(manifest[i].fd);
+			manifest[i].fd = -1;
+			manifest[i].error = error;
+		}
+	}
+
+	free(paths);
+	free(fds);
+
+	return (-1);
+}
+
+static void*
+open_entries(void *arg)
+{
+	struct manifest_work *work = arg;
+	struct po_manifest_entry *entry;
+	size_t i;
+
+	while (true) {
+		i = atomic_fetch_add_explicit(&work->next, 1,
+			memory_order_relaxed);
+		if (i >= work->count) {
+			break;
+		}
+
+		entry = work->entries + i;
+		entry->fd = -1;
+		entry->error = 0;
+
+		if (entry->path == NULL) {
+			entry->error = EINVAL;
+			continue;
+		}
+
+		entry->fd = openat(AT_FDCWD, entry->path, entry->flags, 0);
+		if (entry->fd == -1) {
+			entry->error = errno;
+		}
+	}
+
+	return (NULL);
+}
@@ -34,12 +34,39 @@
  * @brief Implementation of po_map management functions
  */
 
+#include <sys/param.h>
+
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "internal.h"
 
+/**
+ * Reallocate a po_map's entries to hold exactly @b capacity entries
+ * (which must not be less than its length).
+ *
+ * If the allocation fails, the function will return NULL but the original
+ * map will remain valid.
+ */
+static struct po_map*	resize(struct po_map *map, size_t capacity);
+
+/**
+ * The identifier of the most recently created map.
+ */
+static _Atomic(uint64_t) last_id;
+
+/**
+ * Free the lazy-opening state of an entry (if any), closing the descriptor
+ * that was opened for it.
+ */
+static void	release_lazy(struct po_map_entry *);
+
+
 struct po_map*
 po_map_create(int capacity)
 {
@@ -59,6 +86,13 @@ po_map_create(int capacity)
 	map->refcount = 1;
 	map->capacity = capacity;
 	map->length = 0;
+	map->segment = NULL;
+	map->base = NULL;
+	map->frozen = false;
+	map->generation = 0;
+	map->spawn_fd = -1;
+	map->id = po_map_new_id();
+	atomic_init(&map->searches, NULL);
 
 	po_map_assertvalid(map);
 
@@ -66,37 +100,128 @@ po_map_create(int capacity)
 }
 
 struct po_map*
-po_map_enlarge(struct po_map *map)
+po_map_overlay(struct po_map *base, int capacity)
 {
-	struct po_map_entry *enlarged;
-	enlarged = calloc(sizeof(struct po_map_entry), 2 * map->capacity);
-	if (enlarged == NULL) {
+	struct po_map *map;
+
+	po_map_assertvalid(base);
+
+	map = po_map_create(capacity);
+	if (map == NULL) {
 		return (NULL);
 	}
-	memcpy(enlarged, map->entries, map->length * sizeof(*enlarged));
-	free(map->entries);
-	map->entries = enlarged;
-	map->capacity = 2 * map->capacity;
-	return map;
+
+	base->refcount += 1;
+	map->base = base;
+
+	po_map_assertvalid(map);
+
+	return (map);
+}
+
+int
+po_map_freeze(struct po_map *map)
+{
+	struct po_map *layer;
+
+	po_map_assertvalid(map);
+
+	// Lookups in frozen maps mustn't open anything (see po_find_r).
+	for (layer = map; layer != NULL; layer = layer->base) {
+		if (layer->frozen) {
+			continue;
+		}
+
+		for (size_t i = 0; i < layer->length; i++) {
+			if (po_entry_fd(layer->entries + i) == -1) {
+				po_seterror(PO_ERROR_SYSTEM,
+					"failed to open lazy po_map entry");
+				return (-1);
+			}
+		}
+	}
+
+	for (; map != NULL; map = map->base) {
+		if (map->frozen) {
+			continue;
+		}
+
+		if (map->segment != NULL) {
+			po_segment_freeze(map->segment);
+		}
+
+		map->frozen = true;
+	}
+
+	return (0);
+}
+
+struct po_map*
+po_map_enlarge(struct po_map *map)
+{
+
+	return (po_map_reserve(map, MAX(2 * map->capacity, 1)));
+}
+
+struct po_map*
+po_map_reserve(struct po_map *map, size_t capacity)
+{
+
+	po_map_assertvalid(map);
+
+	if (capacity <= map->capacity) {
+		return (map);
+	}
+
+	return (resize(map, capacity));
+}
+
+struct po_map*
+po_map_shrink_to_fit(struct po_map *map)
+{
+
+	po_map_assertvalid(map);
+
+	if (map->length == map->capacity) {
+		return (map);
+	}
+
+	return (resize(map, map->length));
 }
 
 size_t
 po_map_foreach(const struct po_map *map, po_map_iter_cb cb)
 {
 	struct po_map_entry *entry;
-	size_t n;
+	cap_rights_t rights;
+	size_t n, total;
 
 	po_map_assertvalid(map);
 
-	for (n = 0; n < map->length; n++) {
-		entry = map->entries + n;
+	total = 0;
+	for (; map != NULL; map = map->base) {
+		if (map->segment != NULL) {
+			return (total + po_segment_foreach(map->segment, cb));
+		}
+
+		for (n = 0; n < map->length; n++) {
+			entry = map->entries + n;
 
-		if (!cb(entry->name, entry->fd, entry->rights)) {
-			break;
+#ifdef WITH_CAPSICUM
+			rights = entry->rights;
+#else
+			memset(&rights, 0, sizeof(rights));
+#endif
+
+			if (!cb(entry->name, entry->fd, rights)) {
+				return (total + n);
+			}
 		}
+
+		total += n;
 	}
 
-	return (n);
+	return (total);
 }
 
 void
@@ -108,10 +233,145 @@ po_map_release(struct po_map *map)
 
 	po_map_assertvalid(map);
 
-	map->refcount -= 1;
-
-	if (map->refcount == 0) {
+	// Maps can be shared between threads (e.g., by po_push_thread_map),
+	// so only the thread that drops the last reference frees the map.
+	if (atomic_fetch_sub(&map->refcount, 1) == 1) {
+		if (map->segment != NULL) {
+			po_segment_release(map->segment);
+		}
+		if (map->spawn_fd != -1) {
+			close(map->spawn_fd);
+		}
+		po_search_release(atomic_load_explicit(&map->searches,
+			memory_order_acquire));
+		for (size_t i = 0; i < map->length; i++) {
+			release_lazy(map->entries + i);
+			free((char*) map->entries[i].name);
+			free(map->entries[i].policy);
+		}
+		po_map_release(map->base);
 		free(map->entries);
 		free(map);
 	}
 }
+
+size_t
+po_map_close_idle(struct po_map *map, unsigned int seconds)
+{
+	struct po_lazy_entry *lazy;
+	struct timespec ts;
+	size_t closed, i;
+	int fd;
+
+	po_map_assertvalid(map);
+
+	// Frozen maps promise that lookups never need to open anything.
+	if (map->frozen) {
+		return (0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	closed = 0;
+
+	for (i = 0; i < map->length; i++) {
+		lazy = map->entries[i].lazy;
+		if (lazy == NULL || ts.tv_sec - atomic_load_explicit(
+		    &lazy->last_used, memory_order_relaxed) < seconds) {
+			continue;
+		}
+
+		fd = atomic_exchange(&map->entries[i].fd, -1);
+		if (fd != -1) {
+			close(fd);
+			closed++;
+		}
+	}
+
+	// Descriptors have changed, so spawned children need a new segment
+	// and cached results keyed by the old descriptors are meaningless.
+	if (closed > 0) {
+		map->generation++;
+		po_stat_cache_invalidate();
+		po_union_cache_invalidate();
+	}
+
+	return (closed);
+}
+
+uint32_t
+po_map_generation(const struct po_map *map)
+{
+	struct po_segment_view *view;
+	uint32_t generation = 0;
+
+	for (; map != NULL; map = map->base) {
+		generation += map->generation;
+
+		// Other processes add entries to the segment directly.
+		if (map->segment != NULL) {
+			view = atomic_load_explicit(&map->segment->view,
+				memory_order_acquire);
+			generation += atomic_load_explicit(
+				&view->packed->generation, memory_order_acquire);
+		}
+	}
+
+	return (generation);
+}
+
+uint64_t
+po_map_new_id(void)
+{
+
+	return (atomic_fetch_add_explicit(&last_id, 1,
+		memory_order_relaxed) + 1);
+}
+
+static struct po_map*
+resize(struct po_map *map, size_t capacity)
+{
+	struct po_map_entry *entries;
+
+	assert(capacity >= map->length);
+
+	if (map->frozen) {
+		errno = EPERM;
+		po_seterror(PO_ERROR_INVALID, "cannot resize a frozen po_map");
+		return (NULL);
+	}
+
+	if (capacity == 0) {
+		free(map->entries);
+		map->entries = NULL;
+		map->capacity = 0;
+		return (map);
+	}
+
+	entries = realloc(map->entries, capacity * sizeof(*entries));
+	if (entries == NULL) {
+		po_seterror(PO_ERROR_NOMEM, "failed to resize po_map");
+		return (NULL);
+	}
+
+	map->entries = entries;
+	map->capacity = capacity;
+
+	return (map);
+}
+
+static void
+release_lazy(struct po_map_entry *entry)
+{
+	struct po_lazy_entry *lazy = entry->lazy;
+
+	if (lazy == NULL) {
+		return;
+	}
+
+	if (entry->fd != -1) {
+		close(entry->fd);
+	}
+
+	free(lazy->path);
+	free(lazy);
+}
@@ -34,8 +34,11 @@
  * @brief Code for [in]packing po_map into/from dense shared memory segments
  */
 
+#include <sys/param.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <errno.h>
@@ -47,153 +50,660 @@
 #include "internal.h"
 
 /**
- * An entry in a po_packed_map.
+ * Check that a po_map can be packed (it must not be segment-backed or an
+ * overlay), setting an error message if not.
+ */
+static bool	packable(const struct po_map *);
+
+/**
+ * The number of bytes needed to pack a po_map's entries, starting with
+ * entry @b first.
+ *
+ * @param   front_coded  whether to pack po_packed_fcentry values
  *
- * @internal
+ * @returns the length, or 0 if a name is too long to be front-coded
  */
-struct po_packed_entry {
-	/** Integer file descriptor */
-	int fd;
+static size_t	packed_length(const struct po_map *, size_t first,
+	bool front_coded);
 
-	/** Offset of the entry's name within the po_packed_map's string table */
-	int offset;
+/**
+ * The length of the prefix that entry @b i shares with the previous entry.
+ */
+static size_t	shared_prefix(const struct po_map *, size_t i);
 
-	/** Length of the entry's name (not including any null terminator) */
-	int len;
-};
+/**
+ * Open any lazy entries of a po_map, starting with entry @b first: packed
+ * entries can only refer to open descriptors.
+ */
+static bool	open_entries(struct po_map *, size_t first);
 
 /**
- * Packed-in-a-buffer representation of a po_map.
+ * Write a po_map's entries, starting with entry @b first, into a packed map
+ * at byte @b offset of its entry area.
  *
- * An object of this type will be immediately followed in memory by a string
- * table of length `tablelen`.
+ * @param   fds     whether to record the entries' descriptors (or -1)
  *
- * @internal
+ * @returns the offset just past the last entry written
  */
-struct po_packed_map {
-	/** The number of po_packed_entry values in the packed map */
-	int count;
-
-	/**
-	 * Length of the name string table that follows this po_packed_map in the
-	 * shared memory segment.
-	 */
-	int tablelen;
+static size_t	pack_entries(struct po_packed_map *, size_t offset,
+	const struct po_map *, size_t first, bool fds);
 
-	/** The actual packed entries */
-	struct po_packed_entry entries[0];
-};
 
 int
 po_pack(struct po_map *map)
 {
-	struct po_packed_entry *entry;
+
+	return (po_pack_flags(map, 0));
+}
+
+int
+po_pack_flags(struct po_map *map, unsigned int flags)
+{
 	struct po_packed_map *packed;
-	char *strtab;
-	size_t chars;   /* total characters to be copied into string table */
-	size_t size;
-	int fd, i, offset;
+	int fd;
 
 	po_map_assertvalid(map);
 
+	if (flags & ~PO_PACK_FRONT_CODED) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID, "unknown po_pack flags");
+		return (-1);
+	}
+
 	fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
 	if (fd == -1){
-		po_errormessage("failed to shm_open SHM for packed map");
+		po_seterror(PO_ERROR_SYSTEM,
+			"failed to shm_open SHM for packed map");
 		return (-1);
 	}
 
-	chars = 0;
-	for(i = 0; i < map->length; i++) {
-		chars += strlen(map->entries[i].name) + 1;
+	if (ftruncate(fd, sizeof(*packed)) != 0) {
+		po_seterror(PO_ERROR_SYSTEM,
+			"failed to truncate shared memory segment");
+		close(fd);
+		return (-1);
 	}
 
-	size = sizeof(struct po_packed_map)
-		+ map->length * sizeof(struct po_packed_entry)
-		+ chars;
-
-	if (ftruncate(fd, size) != 0) {
-		po_errormessage("failed to truncate shared memory segment");
+	packed = mmap(0, sizeof(*packed), PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	if (packed == MAP_FAILED) {
+		po_seterror(PO_ERROR_SYSTEM, "mmap");
 		close(fd);
 		return (-1);
 	}
 
-	packed = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (packed == MAP_FAILED) {
-		po_errormessage("shm_open");
+	packed->magic = PO_PACKED_MAGIC;
+	packed->version = PO_PACKED_VERSION;
+	packed->flags = flags;
+	atomic_init(&packed->generation, 0);
+	atomic_init(&packed->count, 0);
+	atomic_init(&packed->length, 0);
+	munmap(packed, sizeof(*packed));
+
+	if (po_pack_update(map, fd) != 0) {
 		close(fd);
 		return (-1);
 	}
 
-	packed->count = map->length;
-	packed->tablelen = chars;
-	strtab = ((char*) packed) + size - chars;
-	offset = 0;
+	return fd;
+}
 
-	for(i=0; i < map->length; i++){
-		entry = packed->entries + i;
+int
+po_pack_update(struct po_map *map, int fd)
+{
+	struct po_packed_map *packed;
+	size_t count, length, newlength, newsize, size;
+	uint32_t generation;
 
-		entry->fd = map->entries[i].fd;
-		entry->offset = offset;
-		entry->len = strlen(map->entries[i].name);
-		strlcpy(strtab + offset, map->entries[i].name,
-			chars - offset);
+	po_map_assertvalid(map);
 
-		offset += entry->len;
+	if (!packable(map)) {
+		return (-1);
 	}
 
-	return fd;
+	packed = po_packed_mmap(fd, PROT_READ | PROT_WRITE, &size);
+	if (packed == NULL) {
+		return (-1);
+	}
+
+	/* We are the only writer, so we don't need to synchronize loads. */
+	count = atomic_load_explicit(&packed->count, memory_order_relaxed);
+	length = atomic_load_explicit(&packed->length, memory_order_relaxed);
+
+	if (count > map->length) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID,
+			"packed map has more entries than po_map");
+		munmap(packed, size);
+		return (-1);
+	}
+
+	if (!open_entries(map, count)) {
+		munmap(packed, size);
+		return (-1);
+	}
+
+	newlength = packed_length(map, count,
+		packed->flags & PO_PACK_FRONT_CODED);
+	if (newlength == 0 && count < map->length) {
+		errno = ENAMETOOLONG;
+		po_seterror(PO_ERROR_TOOBIG,
+			"name too long for a front-coded packed map");
+		munmap(packed, size);
+		return (-1);
+	}
+
+	newlength += length;
+	if (newlength > UINT32_MAX) {
+		errno = EFBIG;
+		po_seterror(PO_ERROR_TOOBIG, "packed map too large");
+		munmap(packed, size);
+		return (-1);
+	}
+
+	if (sizeof(*packed) + newlength > size) {
+		/*
+		 * Grow geometrically so that a sequence of small updates
+		 * doesn't cost an ftruncate(2) each. We only ever extend the
+		 * segment, so existing mappings of it remain valid.
+		 */
+		newsize = MAX(sizeof(*packed) + newlength, 2 * size);
+		munmap(packed, size);
+
+		if (ftruncate(fd, newsize) != 0) {
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to extend shared memory segment");
+			return (-1);
+		}
+
+		packed = po_packed_mmap(fd, PROT_READ | PROT_WRITE, &size);
+		if (packed == NULL) {
+			return (-1);
+		}
+	}
+
+	generation = atomic_load_explicit(&packed->generation,
+		memory_order_relaxed);
+	atomic_store_explicit(&packed->generation, generation + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	length = pack_entries(packed, length, map, count, true);
+	assert(length == newlength);
+
+	/* Publish the new entries: readers acquire via count. */
+	atomic_store_explicit(&packed->length, length, memory_order_release);
+	atomic_store_explicit(&packed->count, map->length,
+		memory_order_release);
+	atomic_store_explicit(&packed->generation, generation + 2,
+		memory_order_release);
+
+	munmap(packed, size);
+
+	return (0);
+}
+
+int
+po_pack_publish(struct po_map *map, int fd, const int socks[], size_t nsocks)
+{
+	char control[CMSG_SPACE(PO_FDS_PER_MESSAGE * sizeof(int))];
+	struct po_fd_message header;
+	struct po_packed_map *packed;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	size_t count, i, j, n, size;
+	int error;
+
+	po_map_assertvalid(map);
+
+	packed = po_packed_mmap(fd, PROT_READ, &size);
+	if (packed == NULL) {
+		return (-1);
+	}
+
+	count = atomic_load_explicit(&packed->count, memory_order_relaxed);
+	munmap(packed, size);
+
+	if (!open_entries(map, count)) {
+		return (-1);
+	}
+
+	/*
+	 * Send the new descriptors before publishing the entries that refer
+	 * to them: by the time an attached map observes the new entries,
+	 * their descriptors are already waiting in its socket.
+	 */
+	error = 0;
+	for (i = count; i < map->length; i += n) {
+		n = MIN(map->length - i, PO_FDS_PER_MESSAGE);
+
+		header.first = i;
+		header.count = n;
+		iov.iov_base = &header;
+		iov.iov_len = sizeof(header);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+		for (j = 0; j < n; j++) {
+			((int*) CMSG_DATA(cmsg))[j] = map->entries[i + j].fd;
+		}
+
+		for (j = 0; j < nsocks; j++) {
+			if (sendmsg(socks[j], &msg, MSG_NOSIGNAL) < 0) {
+				po_seterror(PO_ERROR_SYSTEM,
+					"failed to send descriptors");
+				error = -1;
+			}
+		}
+	}
+
+	if (po_pack_update(map, fd) != 0) {
+		return (-1);
+	}
+
+	return (error);
+}
+
+int
+po_map_save(struct po_map *map, int fd)
+{
+	struct po_packed_map *packed;
+	size_t length, offset, size;
+	ssize_t written;
+
+	po_map_assertvalid(map);
+
+	if (!packable(map)) {
+		return (-1);
+	}
+
+	length = packed_length(map, 0, false);
+	if (length > UINT32_MAX) {
+		errno = EFBIG;
+		po_seterror(PO_ERROR_TOOBIG, "packed map too large");
+		return (-1);
+	}
+
+	size = sizeof(*packed) + length;
+	packed = calloc(1, size);
+	if (packed == NULL) {
+		po_seterror(PO_ERROR_NOMEM, "failed to allocate packed map");
+		return (-1);
+	}
+
+	packed->magic = PO_PACKED_MAGIC;
+	packed->version = PO_PACKED_VERSION;
+	packed->flags = 0;
+	atomic_init(&packed->generation, 0);
+	atomic_init(&packed->count, map->length);
+	atomic_init(&packed->length, length);
+
+	// Descriptor numbers mean nothing outside of this process.
+	pack_entries(packed, 0, map, 0, false);
+
+	// po_map_load maps the file from its start, so that's where the map
+	// goes, and anything left over from a longer map is cut off.
+	for (offset = 0; offset < size; offset += written) {
+		written = pwrite(fd, (char*) packed + offset, size - offset,
+			offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				written = 0;
+				continue;
+			}
+
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to write packed map");
+			free(packed);
+			return (-1);
+		}
+	}
+
+	free(packed);
+
+	if (ftruncate(fd, size) != 0) {
+		po_seterror(PO_ERROR_SYSTEM, "failed to truncate packed map");
+		return (-1);
+	}
+
+	return (0);
 }
 
 struct po_map*
 po_unpack(int fd)
 {
-	struct stat sb;
+	struct po_packed_cursor cursor;
 	struct po_map_entry *entry;
 	struct po_map *map;
 	struct po_packed_map *packed;
-	char *strtab;
-	int i;
+	size_t count, limit, size;
+	size_t i;
 
-	if(fstat(fd, &sb) < 0) {
-		po_errormessage("failed to fstat() shared memory segment");
+	packed = po_packed_mmap(fd, PROT_READ, &size);
+	if (packed == NULL) {
 		return (NULL);
 	}
 
-	packed = mmap(0, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (packed == MAP_FAILED) {
-		po_errormessage("mmap");
-		return (NULL);
-	}
-
-	strtab = ((char*) packed->entries)
-		+ packed->count * sizeof(struct po_packed_entry);
-	assert(strtab - ((char*) packed) <= sb.st_size);
+	count = atomic_load_explicit(&packed->count, memory_order_acquire);
+	limit = MIN(atomic_load_explicit(&packed->length, memory_order_relaxed),
+		size - sizeof(*packed));
 
 	map = malloc(sizeof(struct po_map));
 	if (map == NULL) {
-		munmap(packed, sb.st_size);
+		munmap(packed, size);
 		return (NULL);
 	}
 
-	map->entries = calloc(packed->count, sizeof(struct po_map_entry));
-	if (map->entries == NULL) {
-		munmap(packed, sb.st_size);
+	map->entries = calloc(count, sizeof(struct po_map_entry));
+	if (map->entries == NULL && count > 0) {
+		munmap(packed, size);
 		free(map);
 		return (NULL);
 	}
 
 	map->refcount = 1;
-	map->capacity = packed->count;
-	map->length = packed->count;
-	for(i = 0; i < map->length; i++) {
-		entry = map->entries + i;
+	map->capacity = count;
+	map->length = 0;
+	map->segment = NULL;
+	map->base = NULL;
+	map->frozen = false;
+	map->generation = 0;
+	map->spawn_fd = -1;
+	map->id = po_map_new_id();
+	atomic_init(&map->searches, NULL);
+
+	po_packed_cursor_init(&cursor, packed, 0, limit, true);
+	for (i = 0; i < count; i++) {
+		if (!po_packed_next(&cursor)) {
+			errno = EINVAL;
+			po_seterror(PO_ERROR_FORMAT,
+				"truncated packed map entry");
+			goto fail;
+		}
 
-		entry->fd = packed->entries[i].fd;
-		entry->name = strndup(strtab + packed->entries[i].offset,
-			packed->entries[i].len);
+		entry = map->entries + i;
+		entry->fd = cursor.fd;
+		entry->access = cursor.access;
+		entry->lazy = NULL;
+		entry->layers = 0;
+		entry->policy = NULL;
+		entry->name = strndup(cursor.name, cursor.len);
+		if (entry->name == NULL) {
+			po_seterror(PO_ERROR_NOMEM,
+				"failed to copy packed entry name");
+			goto fail;
+		}
+		map->length++;
 	}
 
+	munmap(packed, size);
+
 	po_map_assertvalid(map);
 
 	return map;
+
+fail:
+	munmap(packed, size);
+	po_map_release(map);
+	return (NULL);
+}
+
+const struct po_packed_entry*
+po_packed_entry_at(const struct po_packed_map *packed, size_t offset,
+	size_t limit)
+{
+	const struct po_packed_entry *entry;
+
+	if (offset + sizeof(*entry) > limit) {
+		return (NULL);
+	}
+
+	entry = (const struct po_packed_entry*) (packed->entries + offset);
+	if (entry->len < 0
+	    || offset + po_packed_entrysize(entry->len) > limit) {
+		return (NULL);
+	}
+
+	return (entry);
+}
+
+void
+po_packed_cursor_init(struct po_packed_cursor *cursor,
+	const struct po_packed_map *packed, size_t offset, size_t limit,
+	bool names)
+{
+
+	cursor->packed = packed;
+	cursor->offset = offset;
+	cursor->limit = limit;
+	cursor->front_coded = (packed->flags & PO_PACK_FRONT_CODED) != 0;
+	cursor->names = names;
+	cursor->len = 0;
+	cursor->name = NULL;
+}
+
+bool
+po_packed_next(struct po_packed_cursor *cursor)
+{
+	const struct po_packed_fcentry *fc;
+	const struct po_packed_entry *entry;
+	size_t offset = cursor->offset;
+
+	if (!cursor->front_coded) {
+		entry = po_packed_entry_at(cursor->packed, offset,
+			cursor->limit);
+		if (entry == NULL) {
+			return (false);
+		}
+
+		cursor->fd = entry->fd;
+		cursor->access = entry->access;
+		cursor->len = entry->len;
+		cursor->shared = 0;
+		cursor->suffix = entry->name;
+		cursor->name = entry->name;
+		cursor->offset += po_packed_entrysize(entry->len);
+
+		return (true);
+	}
+
+	if (offset + offsetof(struct po_packed_fcentry, suffix)
+	    > cursor->limit) {
+		return (false);
+	}
+
+	fc = (const struct po_packed_fcentry*) (cursor->packed->entries
+		+ offset);
+	if (offset + po_packed_fcentrysize(fc->suffixlen) > cursor->limit
+	    || (size_t) fc->shared + fc->suffixlen >= sizeof(cursor->buffer)
+	    || (cursor->names && fc->shared > cursor->len)) {
+		return (false);
+	}
+
+	cursor->fd = fc->fd;
+	cursor->access = fc->access;
+	cursor->len = fc->shared + fc->suffixlen;
+	cursor->shared = fc->shared;
+	cursor->suffix = fc->suffix;
+	cursor->offset += po_packed_fcentrysize(fc->suffixlen);
+
+	// The buffer still holds the previous name, whose prefix we share.
+	if (cursor->names) {
+		memcpy(cursor->buffer + fc->shared, fc->suffix, fc->suffixlen);
+		cursor->buffer[cursor->len] = '\0';
+		cursor->name = cursor->buffer;
+	}
+
+	return (true);
+}
+
+struct po_packed_map*
+po_packed_mmap(int fd, int prot, size_t *sizep)
+{
+	struct stat sb;
+	struct po_packed_map *packed;
+
+	if (fstat(fd, &sb) < 0) {
+		po_seterror(PO_ERROR_SYSTEM,
+			"failed to fstat() shared memory segment");
+		return (NULL);
+	}
+
+	if ((size_t) sb.st_size < sizeof(*packed)) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_FORMAT,
+			"shared memory segment too small for packed map");
+		return (NULL);
+	}
+
+	packed = mmap(0, sb.st_size, prot, MAP_SHARED, fd, 0);
+	if (packed == MAP_FAILED) {
+		po_seterror(PO_ERROR_SYSTEM, "mmap");
+		return (NULL);
+	}
+
+	if (packed->magic != PO_PACKED_MAGIC
+	    || packed->version != PO_PACKED_VERSION) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_FORMAT, "not a packed po_map");
+		munmap(packed, sb.st_size);
+		return (NULL);
+	}
+
+	*sizep = sb.st_size;
+
+	return (packed);
+}
+
+static bool
+packable(const struct po_map *map)
+{
+
+	if (map->segment != NULL || map->base != NULL) {
+		errno = EINVAL;
+		po_seterror(PO_ERROR_INVALID,
+			"cannot pack a segment-backed or overlay po_map");
+		return (false);
+	}
+
+	// Packed entries are searched one by one, so a union would silently
+	// become its first directory.
+	for (size_t i = 0; i < map->length; i++) {
+		if (map->entries[i].layers > 1) {
+			errno = EINVAL;
+			po_seterror(PO_ERROR_INVALID,
+				"cannot pack a po_map with union directories");
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static bool
+open_entries(struct po_map *map, size_t first)
+{
+	size_t i;
+
+	for (i = first; i < map->length; i++) {
+		if (po_entry_fd(map->entries + i) == -1) {
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to open lazy po_map entry");
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static size_t
+packed_length(const struct po_map *map, size_t first, bool front_coded)
+{
+	size_t i, len, length;
+
+	length = 0;
+	for (i = first; i < map->length; i++) {
+		len = strlen(map->entries[i].name);
+
+		if (!front_coded) {
+			length += po_packed_entrysize(len);
+			continue;
+		}
+
+		if (len >= MAXPATHLEN) {
+			return (0);
+		}
+
+		length += po_packed_fcentrysize(len - shared_prefix(map, i));
+	}
+
+	return (length);
+}
+
+static size_t
+shared_prefix(const struct po_map *map, size_t i)
+{
+	const char *name, *prev;
+	size_t n;
+
+	if (i == 0) {
+		return (0);
+	}
+
+	prev = map->entries[i - 1].name;
+	name = map->entries[i].name;
+
+	for (n = 0; name[n] != '\0' && name[n] == prev[n]; n++)
+		;
+
+	return (n);
+}
+
+static size_t
+pack_entries(struct po_packed_map *packed, size_t offset,
+	const struct po_map *map, size_t first, bool fds)
+{
+	struct po_packed_fcentry *fc;
+	struct po_packed_entry *entry;
+	size_t i, len, shared;
+
+	for (i = first; i < map->length; i++) {
+		len = strlen(map->entries[i].name);
+
+		if (packed->flags & PO_PACK_FRONT_CODED) {
+			shared = shared_prefix(map, i);
+			fc = (struct po_packed_fcentry*) (packed->entries
+				+ offset);
+
+			fc->fd = fds ? map->entries[i].fd : -1;
+			fc->shared = shared;
+			fc->suffixlen = len - shared;
+			fc->access = map->entries[i].access;
+			memcpy(fc->suffix, map->entries[i].name + shared,
+				len - shared);
+
+			offset += po_packed_fcentrysize(len - shared);
+			continue;
+		}
+
+		entry = (struct po_packed_entry*) (packed->entries + offset);
+
+		entry->fd = fds ? map->entries[i].fd : -1;
+		entry->len = len;
+		entry->access = map->entries[i].access;
+		memcpy(entry->name, map->entries[i].name, len + 1);
+
+		offset += po_packed_entrysize(len);
+	}
+
+	return (offset);
 }
@@ -0,0 +1,476 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_search.c
+ * @brief Cached searches for commands and libraries
+ *
+ * `execvp(3)` and friends look for a command in every directory of `PATH`
+ * in turn, and `dlopen(3)` does the same for libraries named without a '/',
+ * so each spawn or plugin load costs a burst of failed lookups. The wrappers
+ * instead resolve each candidate against the po_map and remember where each
+ * name was found (or that it wasn't found), so repeatedly using the same
+ * tool or plugin doesn't search at all. Each po_map has a cache for each
+ * kind of search (so threads using different maps don't evict each other's
+ * results), which is discarded when its list of directories or the map
+ * changes.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/** Number of hash buckets in each cache. */
+#define	RESULT_BUCKETS	64
+
+/** How long a name that wasn't found is remembered (in seconds). */
+#define	MISS_TTL	2
+
+/**
+ * A name that has been searched for.
+ */
+struct result {
+	/** The name that was searched for */
+	char *name;
+
+	/** Where the name was found (or NULL if it wasn't) */
+	char *path;
+
+	/** The errno value to fail with if the name wasn't found */
+	int error;
+
+	/** When a miss should be searched for again (CLOCK_MONOTONIC) */
+	time_t expires;
+
+	/** The next result in the same bucket */
+	struct result *next;
+};
+
+/**
+ * The results of one kind of search.
+ */
+struct cache {
+	/** The PO_ACCESS_* modes that candidates are resolved with */
+	unsigned int access;
+
+	/** The `access(2)` mode that a candidate must allow */
+	int mode;
+
+	/** The cached results */
+	struct result *buckets[RESULT_BUCKETS];
+
+	/** The directories that the cached results were searched for in */
+	char *search;
+
+	/** The id of the map that the cached results were resolved against */
+	uint64_t map;
+
+	/** The generation of that map that the cached results reflect */
+	uint32_t generation;
+
+	/** Protects the cache */
+	pthread_mutex_t lock;
+};
+
+/**
+ * The caches for each kind of search resolved against one map.
+ */
+struct po_search_cache {
+	struct cache kinds[PO_SEARCH_KINDS];
+};
+
+/**
+ * Search the directories in @b search for a regular file called @b file
+ * that allows @b cache's access mode.
+ *
+ * @param   relative    set if a relative directory was searched, so that
+ *                      the result depends on the working directory
+ *
+ * @returns the file's path (which the caller must free) or NULL,
+ *          setting @b error
+ */
+static char*	search_dirs(struct cache *cache, const char *file,
+	const char *search, po_resolve_fn resolve, int *error,
+	bool *relative);
+
+/**
+ * Get the cache for one kind of search against @b map, creating the map's
+ * caches if necessary.
+ *
+ * @returns the cache, or NULL if it could not be allocated
+ */
+static struct cache*	cache_for(enum po_search_kind, struct po_map *map);
+
+/**
+ * Whether @b cache holds results for @b search and the map with the given
+ * id and generation (with the cache's lock held).
+ */
+static bool	current(const struct cache *, const char *search,
+	uint64_t map, uint32_t generation);
+
+/**
+ * Discard every cached result (with the cache's lock held).
+ */
+static void	flush(struct cache *);
+
+/**
+ * The bucket that a name belongs in.
+ */
+static struct result**	bucket(struct cache *, const char *name);
+
+/**
+ * Seconds on the CLOCK_MONOTONIC clock.
+ */
+static time_t	now(void);
+
+/**
+ * The caches for searches that aren't resolved against a map (which also
+ * serve as templates for maps' caches).
+ */
+static struct po_search_cache unmapped = {
+	.kinds = {
+		[PO_SEARCH_COMMAND] = {
+			.access = PO_ACCESS_EXEC,
+			.mode = X_OK,
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+		},
+		[PO_SEARCH_LIBRARY] = {
+			.access = PO_ACCESS_READ | PO_ACCESS_EXEC,
+			.mode = R_OK,
+			.lock = PTHREAD_MUTEX_INITIALIZER,
+		},
+	},
+};
+
+
+int
+po_search(enum po_search_kind kind, const char *file, const char *search,
+	struct po_map *map, po_resolve_fn resolve, char *path, size_t size)
+{
+	struct cache *cache;
+	struct result *c, **head;
+	uint32_t generation;
+	uint64_t id;
+	bool relative;
+	char *found;
+	int error;
+
+	cache = cache_for(kind, map);
+	id = (map == NULL) ? 0 : map->id;
+	generation = (map == NULL) ? 0 : po_map_generation(map);
+
+	// Without a cache, we can still search.
+	if (cache == NULL) {
+		found = search_dirs(&unmapped.kinds[kind], file, search,
+			resolve, &error, &relative);
+		if (found != NULL && strlcpy(path, found, size) >= size) {
+			error = ENAMETOOLONG;
+		}
+		free(found);
+		return (error);
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (!current(cache, search, id, generation)) {
+		flush(cache);
+		free(cache->search);
+		cache->search = strdup(search);
+		cache->map = id;
+		cache->generation = generation;
+	}
+
+	head = bucket(cache, file);
+	for (c = *head; c != NULL; c = c->next) {
+		if (strcmp(c->name, file) == 0) {
+			break;
+		}
+	}
+
+	if (c != NULL && (c->path != NULL || c->expires > now())) {
+		error = (c->path == NULL) ? c->error
+			: (strlcpy(path, c->path, size) >= size)
+			? ENAMETOOLONG : 0;
+		pthread_mutex_unlock(&cache->lock);
+		return (error);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	found = search_dirs(cache, file, search, resolve, &error, &relative);
+	if (found != NULL && strlcpy(path, found, size) >= size) {
+		error = ENAMETOOLONG;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	// Don't cache the result if it depends on the working directory, or
+	// if the directories or map changed while we were searching.
+	if (relative || !current(cache, search, id, generation)) {
+		free(found);
+		pthread_mutex_unlock(&cache->lock);
+		return (error);
+	}
+
+	for (c = *head; c != NULL; c = c->next) {
+		if (strcmp(c->name, file) == 0) {
+			break;
+		}
+	}
+
+	if (c == NULL) {
+		c = calloc(1, sizeof(*c));
+		if (c != NULL && (c->name = strdup(file)) == NULL) {
+			free(c);
+			c = NULL;
+		}
+		if (c != NULL) {
+			c->next = *head;
+			*head = c;
+		}
+	}
+
+	if (c != NULL) {
+		free(c->path);
+		c->path = found;
+		c->error = error;
+		c->expires = now() + MISS_TTL;
+	} else {
+		free(found);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return (error);
+}
+
+void
+po_search_forget(enum po_search_kind kind, const char *file,
+	struct po_map *map)
+{
+	struct cache *cache;
+	struct result *c, **prev;
+
+	cache = cache_for(kind, map);
+	if (cache == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (prev = bucket(cache, file); (c = *prev) != NULL;
+	    prev = &c->next) {
+		if (strcmp(c->name, file) == 0) {
+			*prev = c->next;
+			free(c->name);
+			free(c->path);
+			free(c);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void
+po_search_release(struct po_search_cache *caches)
+{
+
+	if (caches == NULL) {
+		return;
+	}
+
+	for (size_t k = 0; k < PO_SEARCH_KINDS; k++) {
+		flush(caches->kinds + k);
+		free(caches->kinds[k].search);
+		pthread_mutex_destroy(&caches->kinds[k].lock);
+	}
+
+	free(caches);
+}
+
+bool
+po_is_script(int fd)
+{
+	char magic[2];
+
+	return (pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+		&& magic[0] == '#' && magic[1] == '!');
+}
+
+static char*
+search_dirs(struct cache *cache, const char *file, const char *search,
+	po_resolve_fn resolve, int *error, bool *relative)
+{
+	char candidate[MAXPATHLEN];
+	struct po_relpath rel;
+	const char *dir, *end;
+	struct stat sb;
+	char *found;
+	size_t len;
+	int n;
+
+	*error = ENOENT;
+	*relative = false;
+
+	for (dir = search; ; dir = end + 1) {
+		end = dir + strcspn(dir, ":");
+		len = end - dir;
+
+		if (len == 0 || dir[0] != '/') {
+			*relative = true;
+		}
+
+		// An empty component means the working directory.
+		if (len == 0) {
+			n = snprintf(candidate, sizeof(candidate), "./%s", file);
+		} else {
+			n = snprintf(candidate, sizeof(candidate), "%.*s/%s",
+				(int) len, dir, file);
+		}
+
+		if (n > 0 && (size_t) n < sizeof(candidate)) {
+			rel = resolve(candidate, cache->access);
+
+			if (fstatat(rel.dirfd, rel.relative_path, &sb, 0) == 0
+			    && S_ISREG(sb.st_mode)) {
+				if (faccessat(rel.dirfd, rel.relative_path,
+				    cache->mode, AT_EACCESS) == 0) {
+					found = strdup(candidate);
+					*error = found ? 0 : ENOMEM;
+					return (found);
+				}
+
+				// Keep looking, but report EACCES (as
+				// execvp does) if nothing else is found.
+				*error = EACCES;
+			}
+		}
+
+		if (*end == '\0') {
+			break;
+		}
+	}
+
+	return (NULL);
+}
+
+static struct cache*
+cache_for(enum po_search_kind kind, struct po_map *map)
+{
+	struct po_search_cache *caches, *expected;
+
+	if (map == NULL) {
+		return (unmapped.kinds + kind);
+	}
+
+	caches = atomic_load_explicit(&map->searches, memory_order_acquire);
+	if (caches != NULL) {
+		return (caches->kinds + kind);
+	}
+
+	caches = calloc(1, sizeof(*caches));
+	if (caches == NULL) {
+		return (NULL);
+	}
+
+	for (size_t k = 0; k < PO_SEARCH_KINDS; k++) {
+		caches->kinds[k].access = unmapped.kinds[k].access;
+		caches->kinds[k].mode = unmapped.kinds[k].mode;
+		pthread_mutex_init(&caches->kinds[k].lock, NULL);
+	}
+
+	// Another thread may have beaten us to it.
+	expected = NULL;
+	if (!atomic_compare_exchange_strong(&map->searches, &expected,
+	    caches)) {
+		po_search_release(caches);
+		caches = expected;
+	}
+
+	return (caches->kinds + kind);
+}
+
+static bool
+current(const struct cache *cache, const char *search, uint64_t map,
+	uint32_t generation)
+{
+
+	return (cache->search != NULL && strcmp(cache->search, search) == 0
+		&& cache->map == map && cache->generation == generation);
+}
+
+static void
+flush(struct cache *cache)
+{
+	struct result *c, *next;
+
+	for (size_t i = 0; i < RESULT_BUCKETS; i++) {
+		for (c = cache->buckets[i]; c != NULL; c = next) {
+			next = c->next;
+			free(c->name);
+			free(c->path);
+			free(c);
+		}
+		cache->buckets[i] = NULL;
+	}
+}
+
+static struct result**
+bucket(struct cache *cache, const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (unsigned char) *name) * 16777619u;
+	}
+
+	return (cache->buckets + (hash % RESULT_BUCKETS));
+}
+
+static time_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec);
+}
@@ -0,0 +1,527 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_segment.c
+ * @brief Lookups in po_maps whose entries live in a shared segment
+ *
+ * A supervisor process can pack a po_map into a shared memory segment with
+ * `po_pack` and hand it to its children, which attach to it with `po_attach`.
+ * As the supervisor adds entries with `po_pack_publish`, it passes the new
+ * directory descriptors over a per-child socket and appends the entries to
+ * the segment. Children notice the new generation on their next lookup and
+ * pick up the new entries without restarting.
+ *
+ * Maps saved to a file with `po_map_save` are loaded in the same way, with
+ * descriptors supplied by a resolver rather than inherited.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/**
+ * Get the current view of a segment, synchronizing with the segment first
+ * if it has changed since the view was created.
+ */
+static struct po_segment_view*	current_view(struct po_map_segment *);
+
+/**
+ * Receive any descriptors waiting on a segment's socket, storing them in
+ * @b view (which may be reallocated to make room).
+ *
+ * @returns the (possibly reallocated) view, or NULL on allocation failure
+ */
+static struct po_segment_view*	receive_fds(struct po_map_segment *,
+	struct po_segment_view *view);
+
+/**
+ * Create a new view of a segment from its current contents.
+ *
+ * The caller must hold the segment's `syncing` flag.
+ *
+ * @param   held    the number of readers that the caller accounts for
+ *                  (1 when called from a lookup, otherwise 0)
+ */
+static void	sync_segment(struct po_map_segment *, unsigned int held);
+
+/**
+ * Free the views superseded by @b view, unless a lookup other than the
+ * caller's (see sync_segment) might still be using one of them.
+ *
+ * The caller must hold the segment's `syncing` flag.
+ */
+static void	reclaim(struct po_map_segment *, struct po_segment_view *view,
+	unsigned int held);
+
+/**
+ * Free a chain of views, unmapping the mappings that they own unless
+ * @b keep is using them.
+ */
+static void	free_views(struct po_segment_view *, struct po_segment_view *keep);
+
+
+struct po_map*
+po_attach(int fd, int sock, size_t inherited)
+{
+	struct po_map_segment *seg;
+	struct po_segment_view *view;
+	struct po_map *map;
+	const struct po_packed_map *packed;
+	size_t size;
+
+	packed = po_packed_mmap(fd, PROT_READ, &size);
+	if (packed == NULL) {
+		return (NULL);
+	}
+
+	map = calloc(1, sizeof(*map));
+	seg = calloc(1, sizeof(*seg));
+	view = calloc(1, sizeof(*view));
+	if (map == NULL || seg == NULL || view == NULL) {
+		munmap((void*) packed, size);
+		free(map);
+		free(seg);
+		free(view);
+		return (NULL);
+	}
+
+	/*
+	 * Start with an empty view of an odd (i.e., impossible) generation:
+	 * the first synchronization will fill it in.
+	 */
+	view->packed = packed;
+	view->size = size;
+	view->owns_mapping = true;
+	view->generation = 1;
+
+	atomic_init(&seg->view, view);
+	atomic_flag_clear(&seg->syncing);
+	atomic_init(&seg->readers, 0);
+	atomic_init(&seg->frozen, false);
+	seg->fd = fd;
+	seg->sock = sock;
+	seg->inherited = inherited;
+
+	map->refcount = 1;
+	map->segment = seg;
+	map->spawn_fd = -1;
+	map->id = po_map_new_id();
+	atomic_init(&map->searches, NULL);
+
+	atomic_flag_test_and_set_explicit(&seg->syncing, memory_order_acquire);
+	sync_segment(seg, 0);
+	atomic_flag_clear_explicit(&seg->syncing, memory_order_release);
+
+	po_map_assertvalid(map);
+
+	return (map);
+}
+
+struct po_map*
+po_map_load(int fd, po_map_resolver resolver)
+{
+	struct po_packed_cursor cursor;
+	struct po_segment_view *view;
+	struct po_map *map;
+	uint32_t i;
+
+	// None of the descriptors are inherited: they all come from the resolver.
+	map = po_attach(fd, -1, 0);
+	if (map == NULL) {
+		return (NULL);
+	}
+
+	/*
+	 * Nobody else can see this map yet, so we can fill in the descriptors
+	 * of the current view in place.
+	 */
+	view = atomic_load_explicit(&map->segment->view, memory_order_relaxed);
+	po_packed_cursor_init(&cursor, view->packed, 0, view->limit, true);
+
+	for (i = 0; i < view->count; i++) {
+		if (!po_packed_next(&cursor)) {
+			assert(false);
+			break;
+		}
+
+		view->fds[i] = resolver(cursor.name);
+	}
+
+	po_map_assertvalid(map);
+
+	return (map);
+}
+
+int
+po_segment_find(struct po_map_segment *seg, const char *path,
+	unsigned int access, size_t *bestlenp)
+{
+	struct po_packed_cursor cursor;
+	struct po_segment_view *view;
+	size_t bestlen, match;
+	uint32_t i;
+	int best;
+
+	atomic_fetch_add(&seg->readers, 1);
+	view = current_view(seg);
+	bestlen = *bestlenp;
+	best = -1;
+
+	// How many bytes of path the current entry's name matches. Plain
+	// entries share nothing with the previous entry, so this is just a
+	// prefix comparison; front-coded entries are compared without
+	// reconstructing their names.
+	match = 0;
+	po_packed_cursor_init(&cursor, view->packed, 0, view->limit, false);
+
+	for (i = 0; i < view->count && po_packed_next(&cursor); i++) {
+		// A name that shares more with the previous name than that
+		// name matched diverges from path at the same place.
+		if (cursor.shared <= match) {
+			match = cursor.shared;
+			while (match < cursor.len
+			    && path[match] == cursor.suffix[match
+			    - cursor.shared]) {
+				match++;
+			}
+		}
+
+		if (view->fds[i] < 0 || (cursor.access & access) != access
+		    || cursor.len <= bestlen || match != cursor.len
+		    || (path[match] != '/' && path[match] != '\0')) {
+			continue;
+		}
+
+		best = view->fds[i];
+		bestlen = cursor.len;
+	}
+
+	atomic_fetch_sub_explicit(&seg->readers, 1, memory_order_release);
+	*bestlenp = bestlen;
+
+	return (best);
+}
+
+size_t
+po_segment_foreach(struct po_map_segment *seg, po_map_iter_cb cb)
+{
+	struct po_packed_cursor cursor;
+	struct po_segment_view *view;
+	cap_rights_t rights;
+	size_t n;
+
+	// Packed maps don't record rights.
+	memset(&rights, 0, sizeof(rights));
+
+	atomic_fetch_add(&seg->readers, 1);
+	view = current_view(seg);
+	po_packed_cursor_init(&cursor, view->packed, 0, view->limit, true);
+
+	for (n = 0; n < view->count; n++) {
+		if (!po_packed_next(&cursor)) {
+			break;
+		}
+
+		if (view->fds[n] < 0) {
+			continue;
+		}
+
+		if (!cb(cursor.name, view->fds[n], rights)) {
+			break;
+		}
+	}
+
+	atomic_fetch_sub_explicit(&seg->readers, 1, memory_order_release);
+
+	return (n);
+}
+
+void
+po_segment_freeze(struct po_map_segment *seg)
+{
+
+	// Wait for any other synchronization to finish, then do our own.
+	while (atomic_flag_test_and_set_explicit(&seg->syncing,
+	    memory_order_acquire)) {
+		sched_yield();
+	}
+
+	sync_segment(seg, 0);
+	atomic_store_explicit(&seg->frozen, true, memory_order_relaxed);
+	atomic_flag_clear_explicit(&seg->syncing, memory_order_release);
+}
+
+void
+po_segment_release(struct po_map_segment *seg)
+{
+	struct po_segment_view *view;
+
+	// Close the descriptors that we received (the newest view has all of
+	// them), but not the ones that we inherited along with the segment.
+	view = atomic_load_explicit(&seg->view, memory_order_relaxed);
+	for (size_t i = seg->inherited; i < view->nfds; i++) {
+		if (view->fds[i] >= 0) {
+			close(view->fds[i]);
+		}
+	}
+
+	free_views(view, NULL);
+	free(seg);
+}
+
+static struct po_segment_view*
+current_view(struct po_map_segment *seg)
+{
+	struct po_segment_view *view;
+	uint32_t generation;
+
+	view = atomic_load_explicit(&seg->view, memory_order_acquire);
+	generation = atomic_load_explicit(&view->packed->generation,
+		memory_order_relaxed);
+
+	if (generation == view->generation
+	    || atomic_load_explicit(&seg->frozen, memory_order_relaxed)) {
+		return (view);
+	}
+
+	// If another thread is already synchronizing, use the current view.
+	if (atomic_flag_test_and_set_explicit(&seg->syncing,
+	    memory_order_acquire)) {
+		return (view);
+	}
+
+	// Our caller is a reader, but it will only use the new view.
+	sync_segment(seg, 1);
+	atomic_flag_clear_explicit(&seg->syncing, memory_order_release);
+
+	return (atomic_load_explicit(&seg->view, memory_order_acquire));
+}
+
+static struct po_segment_view*
+receive_fds(struct po_map_segment *seg, struct po_segment_view *view)
+{
+	char control[CMSG_SPACE(PO_FDS_PER_MESSAGE * sizeof(int))];
+	struct po_fd_message header;
+	struct po_segment_view *grown;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	const int *fds;
+	size_t i, n, nfds;
+
+	while (true) {
+		iov.iov_base = &header;
+		iov.iov_len = sizeof(header);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(seg->sock, &msg, MSG_DONTWAIT) != sizeof(header)) {
+			// Nothing (more) to receive, or a malformed message.
+			return (view);
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+
+		fds = (const int*) CMSG_DATA(cmsg);
+		n = MIN(header.count,
+			(cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+		if (header.first + n > view->nfds) {
+			nfds = header.first + n;
+			grown = realloc(view, sizeof(*view) + nfds * sizeof(int));
+			if (grown == NULL) {
+				for (i = 0; i < n; i++) {
+					close(fds[i]);
+				}
+				free(view);
+				return (NULL);
+			}
+
+			view = grown;
+			for (i = view->nfds; i < nfds; i++) {
+				view->fds[i] = -1;
+			}
+			view->nfds = nfds;
+		}
+
+		// Keep the descriptors that we already have (inherited or
+		// received) so that each is closed exactly once.
+		for (i = 0; i < n; i++) {
+			if (header.first + i < seg->inherited
+			    || view->fds[header.first + i] != -1) {
+				close(fds[i]);
+			} else {
+				view->fds[header.first + i] = fds[i];
+			}
+		}
+	}
+}
+
+static void
+sync_segment(struct po_map_segment *seg, unsigned int held)
+{
+	struct po_packed_cursor cursor;
+	struct po_segment_view *old, *view;
+	const struct po_packed_map *packed;
+	size_t length, nfds, size;
+	uint32_t count, generation, i;
+	bool remapped;
+
+	old = atomic_load_explicit(&seg->view, memory_order_relaxed);
+	packed = old->packed;
+	size = old->size;
+	remapped = false;
+
+	generation = atomic_load_explicit(&packed->generation,
+		memory_order_acquire);
+	if (generation & 1) {
+		// The writer is mid-update: try again on the next lookup.
+		return;
+	}
+
+	count = atomic_load_explicit(&packed->count, memory_order_acquire);
+	length = atomic_load_explicit(&packed->length, memory_order_relaxed);
+
+	if (sizeof(*packed) + length > size) {
+		packed = po_packed_mmap(seg->fd, PROT_READ, &size);
+		if (packed == NULL) {
+			return;
+		}
+
+		remapped = true;
+		length = MIN(length, size - sizeof(*packed));
+	}
+
+	nfds = MAX(count, old->nfds);
+	view = malloc(sizeof(*view) + nfds * sizeof(int));
+	if (view == NULL) {
+		goto fail;
+	}
+
+	view->packed = packed;
+	view->size = size;
+	view->owns_mapping = remapped;
+	view->generation = generation;
+	view->limit = length;
+	view->prev = old;
+	view->nfds = nfds;
+	memcpy(view->fds, old->fds, old->nfds * sizeof(int));
+	for (i = old->nfds; i < nfds; i++) {
+		view->fds[i] = -1;
+	}
+
+	// Entries that existed when we were forked have inherited descriptors.
+	po_packed_cursor_init(&cursor, packed, old->limit, length, false);
+	for (i = old->count; i < count; i++) {
+		if (!po_packed_next(&cursor)) {
+			break;
+		}
+
+		if (i < seg->inherited && view->fds[i] == -1) {
+			view->fds[i] = cursor.fd;
+		}
+	}
+	view->count = i;
+	view->limit = cursor.offset;
+
+	if (seg->sock >= 0) {
+		view = receive_fds(seg, view);
+		if (view == NULL) {
+			goto fail;
+		}
+	}
+
+	atomic_store(&seg->view, view);
+	reclaim(seg, view, held);
+	return;
+
+fail:
+	if (remapped) {
+		munmap((void*) packed, size);
+	}
+}
+
+static void
+reclaim(struct po_map_segment *seg, struct po_segment_view *view,
+	unsigned int held)
+{
+
+	/*
+	 * Lookups count themselves before loading the view, and the new view
+	 * was published before we count them: any lookup that we don't see
+	 * will load the new view, so nothing else can be using older ones.
+	 */
+	if (view->prev == NULL || atomic_load(&seg->readers) != held) {
+		return;
+	}
+
+	free_views(view->prev, view);
+	view->prev = NULL;
+}
+
+static void
+free_views(struct po_segment_view *view, struct po_segment_view *keep)
+{
+	struct po_segment_view *prev;
+
+	for (; view != NULL; view = prev) {
+		prev = view->prev;
+
+		// A newer view that didn't need to remap the segment takes
+		// over the mapping that it shares with this one.
+		if (view->owns_mapping && keep != NULL
+		    && keep->packed == view->packed) {
+			keep->owns_mapping = true;
+		} else if (view->owns_mapping) {
+			munmap((void*) view->packed, view->size);
+		}
+
+		free(view);
+	}
+}
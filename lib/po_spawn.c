@@ -0,0 +1,261 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_spawn.c
+ * @brief Spawning processes that inherit a po_map
+ */
+
+#include <errno.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/** The environment variable that a child finds its packed map in. */
+#define	MAP_VARIABLE	"SHARED_MEMORYFD"
+
+/** Update socket variable, which would be stale in the child. */
+#define	SOCK_VARIABLE	"SHARED_MEMORYSOCK"
+
+/** Inherited entry count, which would be stale in the child. */
+#define	COUNT_VARIABLE	"SHARED_MEMORYCOUNT"
+
+extern char **environ;
+
+/**
+ * Copy the entries of an overlay and all of its bases into a single map that
+ * can be packed, with the overlay's entries first so that they still win
+ * ties.
+ *
+ * @returns the new map, or NULL on error
+ */
+static struct po_map*	flatten(struct po_map *map);
+
+
+int
+po_spawn_file_actions(struct po_map *map, posix_spawn_file_actions_t *actions)
+{
+	struct po_map *flat, *layer;
+	uint32_t generation;
+	size_t i;
+	int error, fd;
+	bool reuse;
+#ifdef WITH_CAPSICUM
+	cap_rights_t rights;
+#endif
+
+	po_map_assertvalid(map);
+
+	// With Capsicum, children can only read the segment, so they can all
+	// share it until the map (or a base) changes. Otherwise, any child
+	// could rewrite what later siblings unpack: give each its own.
+	generation = po_map_generation(map);
+#ifdef WITH_CAPSICUM
+	reuse = (map->spawn_fd != -1 && map->spawn_generation == generation);
+#else
+	reuse = false;
+#endif
+
+	// Overlays can't be packed themselves, so pack a copy.
+	if (!reuse) {
+		flat = (map->base == NULL) ? map : flatten(map);
+		if (flat == NULL) {
+			return (-1);
+		}
+
+		fd = po_pack(flat);
+		if (flat != map) {
+			po_map_release(flat);
+		}
+		if (fd == -1) {
+			return (-1);
+		}
+
+#ifdef WITH_CAPSICUM
+		cap_rights_init(&rights, CAP_READ, CAP_MMAP_R, CAP_FSTAT);
+		if (cap_rights_limit(fd, &rights) != 0) {
+			po_seterror(PO_ERROR_SYSTEM,
+				"failed to limit packed map rights");
+			close(fd);
+			return (-1);
+		}
+#endif
+
+		if (map->spawn_fd != -1) {
+			close(map->spawn_fd);
+		}
+
+		map->spawn_fd = fd;
+		map->spawn_generation = generation;
+	}
+
+	/*
+	 * Duplicating a descriptor onto itself clears its close-on-exec flag
+	 * in the child only, so the parent's descriptors are left alone.
+	 */
+	error = posix_spawn_file_actions_adddup2(actions, map->spawn_fd,
+		map->spawn_fd);
+
+	// Share our statistics segment (if any) with the child.
+	fd = po_getenv_fd("PO_STATS_FD");
+	if (error == 0 && fd != -1) {
+		error = posix_spawn_file_actions_adddup2(actions, fd, fd);
+	}
+
+	for (layer = map; error == 0 && layer != NULL; layer = layer->base) {
+		for (i = 0; error == 0 && i < layer->length; i++) {
+			fd = layer->entries[i].fd;
+			error = posix_spawn_file_actions_adddup2(actions, fd,
+				fd);
+		}
+	}
+
+	if (error != 0) {
+		errno = error;
+		po_seterror(PO_ERROR_SYSTEM, "failed to add spawn file action");
+		return (-1);
+	}
+
+	return (map->spawn_fd);
+}
+
+int
+po_spawn(pid_t *pid, const char *path, struct po_map *map,
+	const posix_spawnattr_t *attr, char *const argv[], char *const envp[])
+{
+	posix_spawn_file_actions_t actions;
+	char variable[sizeof(MAP_VARIABLE) + 16];
+	char **env;
+	size_t i, n;
+	int error, fd;
+
+	if (envp == NULL) {
+		envp = environ;
+	}
+
+	for (n = 0; envp[n] != NULL; n++)
+		;
+
+	env = calloc(n + 2, sizeof(*env));
+	if (env == NULL) {
+		return (errno);
+	}
+
+	error = posix_spawn_file_actions_init(&actions);
+	if (error != 0) {
+		free(env);
+		return (error);
+	}
+
+	fd = po_spawn_file_actions(map, &actions);
+	if (fd == -1) {
+		error = errno;
+		goto out;
+	}
+
+	// Pass on the environment, except for any stale map descriptors.
+	snprintf(variable, sizeof(variable), MAP_VARIABLE "=%d", fd);
+	env[0] = variable;
+
+	for (i = 0, n = 1; envp[i] != NULL; i++) {
+		if (strncmp(envp[i], MAP_VARIABLE "=",
+		    sizeof(MAP_VARIABLE)) != 0
+		    && strncmp(envp[i], SOCK_VARIABLE "=",
+		    sizeof(SOCK_VARIABLE)) != 0
+		    && strncmp(envp[i], COUNT_VARIABLE "=",
+		    sizeof(COUNT_VARIABLE)) != 0) {
+			env[n++] = envp[i];
+		}
+	}
+
+	error = posix_spawn(pid, path, &actions, attr, argv, env);
+
+out:
+	posix_spawn_file_actions_destroy(&actions);
+	free(env);
+
+	return (error);
+}
+
+static struct po_map*
+flatten(struct po_map *map)
+{
+	struct po_map_entry *entry;
+	struct po_map *flat, *layer;
+	size_t length = 0;
+	int fd;
+
+	for (layer = map; layer != NULL; layer = layer->base) {
+		// Segment entries can't be copied without their names.
+		if (layer->segment != NULL) {
+			errno = EINVAL;
+			po_seterror(PO_ERROR_INVALID,
+				"cannot spawn with an overlay of a "
+				"segment-backed po_map");
+			return (NULL);
+		}
+
+		length += layer->length;
+	}
+
+	flat = po_map_create(length);
+	if (flat == NULL) {
+		return (NULL);
+	}
+
+	for (layer = map; layer != NULL; layer = layer->base) {
+		for (size_t i = 0; i < layer->length; i++) {
+			entry = layer->entries + i;
+
+			fd = po_entry_fd(entry);
+			if (fd == -1) {
+				po_seterror(PO_ERROR_SYSTEM,
+					"failed to open lazy po_map entry");
+				po_map_release(flat);
+				return (NULL);
+			}
+
+			if (po_add_access(flat, entry->name, fd,
+			    entry->access) == NULL) {
+				po_map_release(flat);
+				return (NULL);
+			}
+
+			// Let po_pack refuse unions, as it does for plain maps.
+			flat->entries[flat->length - 1].layers = entry->layers;
+		}
+	}
+
+	return (flat);
+}
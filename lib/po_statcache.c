@@ -0,0 +1,688 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file  po_statcache.c
+ * @brief Cache of metadata lookups made by the libc wrappers
+ *
+ * When enabled (via `PO_STAT_CACHE` or `po_stat_cache`), the results of
+ * `fstatat(2)` and `faccessat(2)` calls made on behalf of the `stat`,
+ * `lstat`, `access` and `eaccess` wrappers (and of the `readlinkat(2)` calls
+ * made by po_find_resolved) are kept in a fixed-size table
+ * keyed by directory descriptor, relative path and kind of call. Failures
+ * are cached too, since build systems probe for many files that don't exist.
+ *
+ * Cached results expire after a TTL. A thread also watches directories
+ * that cached paths were looked up in and discards the whole cache when
+ * any of them changes. On Linux, inotify watches the directory containing
+ * each path (found via `/proc/self/fd`); on FreeBSD, a kqueue watches the
+ * directory descriptor itself, which works in capability mode but only
+ * notices entries being added, removed or renamed directly within it.
+ * Each directory is only added to the watcher once. Wrappers that change
+ * the filesystem discard the cache immediately (see
+ * po_stat_cache_invalidate). Anything else, including changes to
+ * directories further up the tree, can leave stale results in the cache for
+ * up to the TTL.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#elif defined(__FreeBSD__)
+#include <sys/event.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/** Number of entries in the cache (a power of two). */
+#define	CACHE_SIZE	4096
+
+/** Number of locks protecting the cache's entries. */
+#define	CACHE_LOCKS	64
+
+/** Whether directories can be watched for changes (inotify or kqueue). */
+#if defined(__linux__) || defined(__FreeBSD__)
+#define	WATCH_DIRS
+#endif
+
+/** Number of directories that can be watched (a power of two). */
+#define	WATCH_SLOTS	256
+
+/** Number of slots to try before giving up on watching a directory. */
+#define	WATCH_PROBES	8
+
+/**
+ * Kinds of cached call (access modes are added to ACCESS_KIND).
+ */
+enum {
+	STAT_KIND = 1,
+	LSTAT_KIND,
+	READLINK_KIND,
+	ACCESS_KIND = 16,
+};
+
+/**
+ * A cached result.
+ */
+struct cache_entry {
+	/** Hash of the key (0 if the entry is unused) */
+	uint32_t hash;
+
+	/** The directory that @b path is relative to */
+	int dirfd;
+
+	/**
+	 * The kind of call (STAT_KIND, LSTAT_KIND, READLINK_KIND or
+	 * ACCESS_KIND + mode)
+	 */
+	int kind;
+
+	/** The path passed to the call */
+	char *path;
+
+	/** The call's return value */
+	int result;
+
+	/** The errno value that the call failed with (if it failed) */
+	int error;
+
+	/** What `fstatat(2)` returned (for successful stat kinds) */
+	struct stat st;
+
+	/** The link's null-terminated target (for successful readlinks) */
+	char *target;
+
+	/** The cache generation that this result belongs to */
+	uint64_t generation;
+
+	/** When this result expires (CLOCK_MONOTONIC nanoseconds) */
+	uint64_t expires;
+};
+
+/**
+ * Read `PO_STAT_CACHE` (if it is set).
+ */
+static void	cache_init(void);
+
+/**
+ * Make sure that the cache is allocated (and, if possible, watched).
+ *
+ * @returns whether the cache can be used
+ */
+static bool	cache_setup(void);
+
+/**
+ * Look up a result, or make the call and cache its result.
+ */
+static int	cached_call(int dirfd, const char *path, int kind,
+	struct stat *st, char *buf, size_t bufsize);
+
+/**
+ * Make the call that a cache entry describes.
+ */
+static int	real_call(int dirfd, const char *path, int kind,
+	struct stat *st, char *buf, size_t bufsize);
+
+/**
+ * Hash a cache key, using at most @b len bytes of @b path.
+ */
+static uint32_t	hash_key(int dirfd, const char *path, size_t len, int kind);
+
+/**
+ * The current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t	now(void);
+
+#ifdef WATCH_DIRS
+/**
+ * Watch the directory that a cached path is looked up in (if we haven't
+ * already tried to).
+ */
+static void	watch_parent(int dirfd, const char *path);
+
+/**
+ * Add a directory to the watcher: on Linux, the first @b len bytes of
+ * @b path beneath @b dirfd, and on FreeBSD, @b dirfd itself.
+ *
+ * @returns 0 on success, -1 on failure
+ */
+static int	add_watch(int dirfd, const char *path, size_t len);
+
+/**
+ * Discard the cache whenever a watched directory changes.
+ */
+static void*	watch_thread(void *);
+
+/**
+ * Forget the watcher thread (which doesn't exist) in a new child process.
+ */
+static void	cache_atfork_child(void);
+
+/**
+ * The inotify instance or kqueue that watches cached directories (or -1).
+ */
+static int watch_fd = -1;
+
+/**
+ * Hashes of the directories that have been added to the watcher (or 0).
+ *
+ * Directories that can't be watched (or whose hashes collide with a watched
+ * directory's) are only noticed by the TTL.
+ */
+static _Atomic(uint32_t) watched[WATCH_SLOTS];
+
+/**
+ * Serializes additions to @b watched.
+ */
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Whether a child process needs a watcher of its own (see cache_setup).
+ */
+static bool restart_watcher;
+#endif
+
+/**
+ * How long results may be used for (in milliseconds), or 0 if the cache is
+ * disabled.
+ */
+static _Atomic(unsigned int) ttl_ms;
+
+/**
+ * Incremented to discard every cached result at once.
+ */
+static _Atomic(uint64_t) generation;
+
+/**
+ * The cached results (allocated when the cache is first enabled).
+ */
+static struct cache_entry *entries;
+
+/**
+ * Locks protecting @b entries (entry i is protected by i % CACHE_LOCKS).
+ */
+static pthread_mutex_t locks[CACHE_LOCKS];
+
+/**
+ * Protects the allocation of @b entries and the creation of the watcher.
+ */
+static pthread_mutex_t setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Ensures that cache_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+int
+po_stat_cache(unsigned int ttl)
+{
+	pthread_once(&init_once, cache_init);
+
+	if (ttl > 0 && !cache_setup()) {
+		return (-1);
+	}
+
+	po_stat_cache_invalidate();
+	atomic_store(&ttl_ms, ttl);
+
+#ifdef WATCH_DIRS
+	// Descriptors may have been closed and reused since they were watched.
+	pthread_mutex_lock(&watch_lock);
+	for (size_t i = 0; i < WATCH_SLOTS; i++) {
+		atomic_store_explicit(watched + i, 0, memory_order_relaxed);
+	}
+	pthread_mutex_unlock(&watch_lock);
+#endif
+
+	return (0);
+}
+
+void
+po_stat_cache_invalidate(void)
+{
+	atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+}
+
+int
+po_cached_fstatat(int dirfd, const char *path, struct stat *st, int flags)
+{
+	int kind = (flags & AT_SYMLINK_NOFOLLOW) ? LSTAT_KIND : STAT_KIND;
+
+	// We only know how to cache the common kinds of call.
+	if ((flags & ~AT_SYMLINK_NOFOLLOW) != 0) {
+		return (fstatat(dirfd, path, st, flags));
+	}
+
+	return (cached_call(dirfd, path, kind, st, NULL, 0));
+}
+
+int
+po_cached_faccessat(int dirfd, const char *path, int mode)
+{
+	return (cached_call(dirfd, path,
+		ACCESS_KIND + (mode & (R_OK | W_OK | X_OK)), NULL, NULL, 0));
+}
+
+int
+po_cached_readlinkat(int dirfd, const char *path, char *buf, size_t size)
+{
+	return (cached_call(dirfd, path, READLINK_KIND, NULL, buf, size));
+}
+
+static void
+cache_init(void)
+{
+	const char *env;
+	char *end;
+	unsigned long ttl;
+
+	for (size_t i = 0; i < CACHE_LOCKS; i++) {
+		pthread_mutex_init(locks + i, NULL);
+	}
+
+#ifdef WATCH_DIRS
+	pthread_atfork(NULL, NULL, cache_atfork_child);
+#endif
+
+	env = getenv("PO_STAT_CACHE");
+	if (env == NULL || *env == '\0') {
+		return;
+	}
+
+	ttl = strtoul(env, &end, 10);
+	if (*end != '\0' || ttl == 0 || ttl > UINT_MAX || !cache_setup()) {
+		return;
+	}
+
+	atomic_store(&ttl_ms, ttl);
+}
+
+static bool
+cache_setup(void)
+{
+	bool ok;
+
+	pthread_mutex_lock(&setup_lock);
+
+	if (entries == NULL) {
+		entries = calloc(CACHE_SIZE, sizeof(*entries));
+	}
+	ok = (entries != NULL);
+
+#ifdef WATCH_DIRS
+	if (ok && watch_fd == -1) {
+		pthread_t thread;
+
+		// Without a watcher, results are only discarded by the TTL.
+#ifdef __linux__
+		watch_fd = inotify_init1(IN_CLOEXEC);
+#else
+		watch_fd = kqueue();
+		if (watch_fd != -1) {
+			fcntl(watch_fd, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if (watch_fd != -1
+		    && pthread_create(&thread, NULL, watch_thread, NULL) == 0) {
+			pthread_detach(thread);
+		} else if (watch_fd != -1) {
+			close(watch_fd);
+			watch_fd = -1;
+		}
+	}
+#endif
+
+	pthread_mutex_unlock(&setup_lock);
+
+	if (!ok) {
+		po_seterror(PO_ERROR_NOMEM, "failed to allocate stat cache");
+	}
+
+	return (ok);
+}
+
+static int
+cached_call(int dirfd, const char *path, int kind, struct stat *st,
+	char *buf, size_t bufsize)
+{
+	struct cache_entry *entry;
+	pthread_mutex_t *lock;
+	uint64_t gen, t;
+	unsigned int ttl;
+	uint32_t hash;
+	size_t i;
+	int result;
+
+	pthread_once(&init_once, cache_init);
+
+	ttl = atomic_load_explicit(&ttl_ms, memory_order_relaxed);
+	if (ttl == 0 || path == NULL) {
+		return (real_call(dirfd, path, kind, st, buf, bufsize));
+	}
+
+	hash = hash_key(dirfd, path, SIZE_MAX, kind);
+	i = hash & (CACHE_SIZE - 1);
+	entry = entries + i;
+	lock = locks + (i % CACHE_LOCKS);
+
+	gen = atomic_load_explicit(&generation, memory_order_acquire);
+	t = now();
+
+	pthread_mutex_lock(lock);
+	if (entry->hash == hash && entry->dirfd == dirfd
+	    && entry->kind == kind && entry->generation == gen
+	    && entry->expires > t && strcmp(entry->path, path) == 0) {
+		result = entry->result;
+		if (kind == READLINK_KIND && result >= 0) {
+			result = MIN((size_t) result, bufsize);
+			memcpy(buf, entry->target, result);
+		} else if (result == 0 && st != NULL) {
+			*st = entry->st;
+		} else if (result != 0) {
+			errno = entry->error;
+		}
+
+		pthread_mutex_unlock(lock);
+		return (result);
+	}
+	pthread_mutex_unlock(lock);
+
+#ifdef WATCH_DIRS
+	// Threads aren't inherited: start a new watcher after fork(2).
+	if (restart_watcher) {
+		restart_watcher = false;
+		cache_setup();
+	}
+
+	// Watch before calling, so that we can't miss a change in between.
+	watch_parent(dirfd, path);
+#endif
+
+	result = real_call(dirfd, path, kind, st, buf, bufsize);
+
+	// A truncated link target can't be reused by bigger buffers.
+	if (kind == READLINK_KIND && (size_t) result == bufsize) {
+		return (result);
+	}
+
+	pthread_mutex_lock(lock);
+	if (entry->path == NULL || strcmp(entry->path, path) != 0) {
+		free(entry->path);
+		entry->path = strdup(path);
+	}
+
+	if (entry->path != NULL) {
+		entry->hash = hash;
+		entry->dirfd = dirfd;
+		entry->kind = kind;
+		entry->result = result;
+		entry->error = (result == 0) ? 0 : errno;
+		if (result == 0 && st != NULL) {
+			entry->st = *st;
+		}
+
+		free(entry->target);
+		entry->target = NULL;
+		if (kind == READLINK_KIND && result >= 0) {
+			entry->target = strndup(buf, result);
+			if (entry->target == NULL) {
+				entry->hash = 0;
+			}
+		}
+
+		// If the cache was invalidated during the call, our result
+		// may already be stale: don't let anyone use it.
+		entry->generation = gen;
+		entry->expires = t + (uint64_t) ttl * 1000000;
+	} else {
+		entry->hash = 0;
+	}
+	pthread_mutex_unlock(lock);
+
+	return (result);
+}
+
+static int
+real_call(int dirfd, const char *path, int kind, struct stat *st,
+	char *buf, size_t bufsize)
+{
+	switch (kind) {
+	case STAT_KIND:
+		return (fstatat(dirfd, path, st, 0));
+
+	case LSTAT_KIND:
+		return (fstatat(dirfd, path, st, AT_SYMLINK_NOFOLLOW));
+
+	case READLINK_KIND:
+		return (readlinkat(dirfd, path, buf, bufsize));
+
+	default:
+		return (faccessat(dirfd, path, kind - ACCESS_KIND, 0));
+	}
+}
+
+static uint32_t
+hash_key(int dirfd, const char *path, size_t len, int kind)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = (hash ^ (uint32_t) dirfd) * 16777619u;
+	hash = (hash ^ (uint32_t) kind) * 16777619u;
+
+	for (size_t i = 0; i < len && path[i] != '\0'; i++) {
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+	}
+
+	return (hash == 0 ? 1 : hash);
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#ifdef WATCH_DIRS
+static void
+watch_parent(int dirfd, const char *path)
+{
+	uint32_t hash, h;
+	size_t i, len, probe;
+
+	if (watch_fd == -1) {
+		return;
+	}
+
+#ifdef __linux__
+	const char *slash = strrchr(path, '/');
+	len = (slash == NULL) ? 0 : (size_t) (slash - path);
+#else
+	// kqueue can only watch descriptors that we already have.
+	if (dirfd == AT_FDCWD) {
+		return;
+	}
+	len = 0;
+#endif
+
+	hash = hash_key(dirfd, path, len, 0);
+
+	for (probe = 0; probe < WATCH_PROBES; probe++) {
+		i = (hash + probe) & (WATCH_SLOTS - 1);
+		h = atomic_load_explicit(watched + i, memory_order_acquire);
+		if (h == hash) {
+			return;
+		} else if (h == 0) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&watch_lock);
+	for (probe = 0; probe < WATCH_PROBES; probe++) {
+		i = (hash + probe) & (WATCH_SLOTS - 1);
+		h = atomic_load_explicit(watched + i, memory_order_relaxed);
+		if (h == hash) {
+			break;
+		} else if (h == 0) {
+			// Only try once: a directory that can't be watched
+			// now (e.g., because it doesn't exist) relies on the
+			// TTL rather than costing a system call every miss.
+			(void) add_watch(dirfd, path, len);
+			atomic_store_explicit(watched + i, hash,
+				memory_order_release);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&watch_lock);
+}
+
+#ifdef __linux__
+static int
+add_watch(int dirfd, const char *path, size_t len)
+{
+	char parent[MAXPATHLEN];
+	int n;
+
+	if (dirfd == AT_FDCWD) {
+		if (len == 0 && path[0] != '/') {
+			n = snprintf(parent, sizeof(parent), ".");
+		} else {
+			n = snprintf(parent, sizeof(parent), "%.*s/",
+				(int) len, path);
+		}
+	} else if (len == 0) {
+		n = snprintf(parent, sizeof(parent), "/proc/self/fd/%d",
+			dirfd);
+	} else {
+		n = snprintf(parent, sizeof(parent), "/proc/self/fd/%d/%.*s",
+			dirfd, (int) len, path);
+	}
+
+	if (n < 0 || (size_t) n >= sizeof(parent)) {
+		return (-1);
+	}
+
+	return (inotify_add_watch(watch_fd, parent, IN_ATTRIB | IN_CREATE
+		| IN_DELETE | IN_DELETE_SELF | IN_MODIFY | IN_MOVE
+		| IN_MOVE_SELF | IN_ONLYDIR) == -1 ? -1 : 0);
+}
+
+static void*
+watch_thread(void *arg)
+{
+	char buffer[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	int fd = watch_fd;
+	ssize_t len;
+
+	while ((len = read(fd, buffer, sizeof(buffer))) != 0) {
+		if (len < 0 && errno == EINTR) {
+			continue;
+		} else if (len < 0) {
+			break;
+		}
+
+		// We don't keep track of which entries are in which
+		// directory: discard them all.
+		po_stat_cache_invalidate();
+	}
+
+	return (NULL);
+}
+#else
+static int
+add_watch(int dirfd, const char *path, size_t len)
+{
+	struct kevent change;
+
+	EV_SET(&change, dirfd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_LINK
+		| NOTE_DELETE | NOTE_RENAME | NOTE_REVOKE, 0, NULL);
+
+	return (kevent(watch_fd, &change, 1, NULL, 0, NULL));
+}
+
+static void*
+watch_thread(void *arg)
+{
+	struct kevent events[16];
+	int fd = watch_fd;
+	int n;
+
+	while ((n = kevent(fd, NULL, 0, events, nitems(events), NULL)) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			break;
+		}
+
+		// We don't keep track of which entries are in which
+		// directory: discard them all.
+		po_stat_cache_invalidate();
+	}
+
+	return (NULL);
+}
+#endif
+
+static void
+cache_atfork_child(void)
+{
+	// kqueues aren't inherited, and an inherited inotify instance would
+	// be shared with the parent: start again with a new watcher.
+	if (watch_fd != -1) {
+		close(watch_fd);
+		watch_fd = -1;
+		restart_watcher = true;
+	}
+
+	for (size_t i = 0; i < WATCH_SLOTS; i++) {
+		atomic_store_explicit(watched + i, 0, memory_order_relaxed);
+	}
+
+	po_stat_cache_invalidate();
+}
+#endif
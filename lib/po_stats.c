@@ -0,0 +1,276 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_stats.c
+ * @brief Lookup statistics shared by a whole tree of processes
+ *
+ * A supervisor (or `tools/po-top`) creates a statistics segment with
+ * `po_stats_create` and passes it to its children via `PO_STATS_FD`, next to
+ * their packed map. Every lookup made by the children's libc wrappers is then
+ * counted per wrapper and per pre-opened directory, with relaxed atomic
+ * increments. Each counter has a copy per stripe on its own cache line and
+ * each process only updates the copies of its own stripe, so many processes
+ * can count at once without fighting over the same lines.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/** Number of entries to probe for a directory before giving up. */
+#define	MAX_PROBES	8
+
+/**
+ * Map the segment given by `PO_STATS_FD` (if any) into @b segment.
+ */
+static void	stats_init(void);
+
+/**
+ * Choose a new stripe in a child process.
+ */
+static void	stats_atfork_child(void);
+
+/**
+ * Find (or claim) the entry for a directory.
+ *
+ * @returns the entry, or NULL if there is no room for it
+ */
+static struct po_stats_entry*	find_entry(const char *name, size_t len);
+
+/**
+ * Record an entry's name, keeping the end of names that are too long (which
+ * is usually the more interesting part).
+ */
+static void	set_name(struct po_stats_entry *, const char *name, size_t len);
+
+/**
+ * The statistics segment (or NULL if statistics are disabled).
+ */
+static struct po_stats_segment *segment;
+
+/**
+ * The stripe of counters that this process updates.
+ */
+static unsigned int stripe;
+
+/**
+ * Ensures that stats_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+int
+po_stats_create(const char *name)
+{
+	struct po_stats_segment *seg;
+	int fd;
+
+	if (name == NULL) {
+		fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+	} else {
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	}
+
+	if (fd == -1) {
+		po_seterror(PO_ERROR_SYSTEM,
+			"failed to create statistics segment");
+		return (-1);
+	}
+
+	if (ftruncate(fd, sizeof(*seg)) != 0) {
+		po_seterror(PO_ERROR_SYSTEM,
+			"failed to truncate statistics segment");
+		close(fd);
+		return (-1);
+	}
+
+	seg = mmap(0, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		po_seterror(PO_ERROR_SYSTEM, "mmap");
+		close(fd);
+		return (-1);
+	}
+
+	// The segment starts out zeroed, so all of the counters are ready.
+	seg->magic = PO_STATS_MAGIC;
+	seg->version = PO_STATS_VERSION;
+	munmap(seg, sizeof(*seg));
+
+	return (fd);
+}
+
+void
+po_stats_record(enum po_trace_call call, const char *path,
+	struct po_relpath rel)
+{
+	struct po_stats_entry *entry;
+	struct po_stats_call *calls;
+	size_t len;
+	bool hit;
+
+	pthread_once(&init_once, stats_init);
+
+	if (segment == NULL) {
+		return;
+	}
+
+	hit = (rel.dirfd != -1 && rel.dirfd != AT_FDCWD);
+	calls = &segment->calls[stripe][call];
+
+	atomic_fetch_add_explicit(&calls->lookups, 1, memory_order_relaxed);
+	if (!hit) {
+		return;
+	}
+
+	atomic_fetch_add_explicit(&calls->hits, 1, memory_order_relaxed);
+
+	// Lookups relative to the working directory don't have an entry.
+	len = po_match_length(path, rel);
+	while (len > 1 && path[len - 1] == '/') {
+		len--;
+	}
+	if (len == 0) {
+		return;
+	}
+
+	entry = find_entry(path, len);
+	if (entry == NULL) {
+		atomic_fetch_add_explicit(&segment->unclaimed, 1,
+			memory_order_relaxed);
+		return;
+	}
+
+	atomic_fetch_add_explicit(&entry->hits[stripe].value, 1,
+		memory_order_relaxed);
+}
+
+static void
+stats_init(void)
+{
+	struct po_stats_segment *seg;
+	struct stat sb;
+	int fd;
+
+	fd = po_getenv_fd("PO_STATS_FD");
+	if (fd == -1 || fstat(fd, &sb) != 0
+	    || (size_t) sb.st_size < sizeof(*seg)) {
+		return;
+	}
+
+	seg = mmap(0, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		return;
+	}
+
+	if (seg->magic != PO_STATS_MAGIC || seg->version != PO_STATS_VERSION) {
+		munmap(seg, sizeof(*seg));
+		return;
+	}
+
+	stripe = getpid() % PO_STATS_STRIPES;
+	atomic_fetch_add_explicit(&seg->processes, 1, memory_order_relaxed);
+	pthread_atfork(NULL, NULL, stats_atfork_child);
+
+	segment = seg;
+}
+
+static void
+stats_atfork_child(void)
+{
+	stripe = getpid() % PO_STATS_STRIPES;
+	atomic_fetch_add_explicit(&segment->processes, 1,
+		memory_order_relaxed);
+}
+
+static struct po_stats_entry*
+find_entry(const char *name, size_t len)
+{
+	struct po_stats_entry *entry;
+	uint32_t expected, hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	}
+
+	if (hash == 0) {
+		hash = 1;
+	}
+
+	for (unsigned int i = 0; i < MAX_PROBES; i++) {
+		entry = segment->entries + ((hash + i) % PO_STATS_ENTRIES);
+
+		expected = atomic_load_explicit(&entry->hash,
+			memory_order_acquire);
+		if (expected == hash) {
+			return (entry);
+		}
+
+		if (expected != 0) {
+			continue;
+		}
+
+		// Claim the free entry: the name is written after the hash,
+		// so readers may briefly see an entry without a name.
+		if (atomic_compare_exchange_strong_explicit(&entry->hash,
+		    &expected, hash, memory_order_acq_rel,
+		    memory_order_acquire)) {
+			set_name(entry, name, len);
+			return (entry);
+		}
+
+		if (expected == hash) {
+			return (entry);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+set_name(struct po_stats_entry *entry, const char *name, size_t len)
+{
+	const size_t max = sizeof(entry->name) - 1;
+
+	if (len <= max) {
+		memcpy(entry->name, name, len);
+		return;
+	}
+
+	memcpy(entry->name, "...", 3);
+	memcpy(entry->name + 3, name + len - (max - 3), max - 3);
+}
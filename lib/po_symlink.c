@@ -0,0 +1,262 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_symlink.c
+ * @brief User-space resolution of symbolic links beneath po_map entries
+ *
+ * When enabled (via `PO_RESOLVE_SYMLINKS` or `po_resolve_symlinks`), the
+ * libc wrappers follow symbolic links themselves, one path component at a
+ * time, rewriting the looked-up path lexically and searching the po_map
+ * again for the result. This lets absolute link targets (which the kernel
+ * can't follow from a directory descriptor in capability mode) find the
+ * entry that they point into, and with the metadata cache (see
+ * po_stat_cache) link targets are only read once.
+ */
+
+#include <sys/param.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#ifndef MAXSYMLINKS
+#define	MAXSYMLINKS	32
+#endif
+
+/**
+ * Read `PO_RESOLVE_SYMLINKS` (if it is set).
+ */
+static void	resolve_init(void);
+
+/**
+ * Whether the wrappers should resolve symbolic links.
+ */
+static _Atomic(bool) enabled;
+
+/**
+ * Ensures that resolve_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+void
+po_resolve_symlinks(bool enable)
+{
+	pthread_once(&init_once, resolve_init);
+	atomic_store(&enabled, enable);
+}
+
+struct po_relpath
+po_find_resolved(struct po_map *map, const char *path, unsigned int access,
+	bool follow, char *buf, size_t size, const char **searchedp,
+	const struct po_io_policy **policyp)
+{
+	char next[MAXPATHLEN], target[MAXPATHLEN];
+	struct po_relpath rel;
+	char *component, *end, saved;
+	unsigned int links;
+	bool dotdot;
+	int len;
+
+	pthread_once(&init_once, resolve_init);
+
+	*searchedp = path;
+
+	if (!atomic_load_explicit(&enabled, memory_order_relaxed)
+	    || path == NULL || path[0] != '/'
+	    || strlcpy(buf, path, size) >= size) {
+		return (po_find_io(map, path, access, policyp));
+	}
+
+	*searchedp = buf;
+
+	for (links = 0; links <= MAXSYMLINKS;) {
+		rel = po_find_io(map, buf, access, policyp);
+		if (rel.dirfd == -1 || strcmp(rel.relative_path, ".") == 0) {
+			return (rel);
+		}
+
+		// The relative path points into buf: walk its components,
+		// terminating each prefix in turn.
+		component = (char*) rel.relative_path;
+		for (;; component = end) {
+			while (*component == '/') {
+				component++;
+			}
+			if (*component == '\0') {
+				return (rel);
+			}
+
+			end = component + strcspn(component, "/");
+
+			// None of the components before ".." are links, so it
+			// can be resolved lexically.
+			dotdot = (end - component == 2
+				&& strncmp(component, "..", 2) == 0);
+			if (dotdot) {
+				break;
+			}
+
+			if (*end == '\0' && !follow) {
+				return (rel);
+			}
+
+			saved = *end;
+			*end = '\0';
+			len = po_cached_readlinkat(rel.dirfd, rel.relative_path,
+				target, sizeof(target) - 1);
+			*end = saved;
+
+			if (len >= 0) {
+				break;
+			}
+
+			// Let the real call report anything but "not a link".
+			if (errno != EINVAL) {
+				return (rel);
+			}
+		}
+
+		if (dotdot) {
+			// Collapse everything up to and including "..".
+			len = snprintf(next, sizeof(next), "%.*s",
+				(int) (end - buf), buf);
+		} else if ((size_t) len == sizeof(target) - 1) {
+			return (rel);
+		} else {
+			// Replace the link with its target (relative targets
+			// are relative to the link's directory).
+			target[len] = '\0';
+			len = snprintf(next, sizeof(next), "%.*s%s",
+				target[0] == '/' ? 0 : (int) (component - buf),
+				buf, target);
+			links++;
+		}
+
+		// Only the path up to the link (or "..") is normalized: the
+		// rest is walked again, so that a ".." following a link is
+		// resolved against the link's target rather than the link.
+		// Don't touch buf (which rel points into) unless we succeed.
+		if (len < 0 || (size_t) len >= sizeof(next)
+		    || !po_logical_path(target, sizeof(target), "/", next)) {
+			return (rel);
+		}
+
+		// The rest of the path (if any) starts with its own '/'.
+		if (*end != '\0' && strcmp(target, "/") == 0) {
+			target[0] = '\0';
+		}
+
+		if (strlcat(target, end, sizeof(target)) >= sizeof(target)
+		    || strlen(target) >= size) {
+			return (rel);
+		}
+
+		strlcpy(buf, target, size);
+	}
+
+	// Too many links: let the kernel follow the rest (or report ELOOP).
+	return (po_find_io(map, buf, access, policyp));
+}
+
+bool
+po_logical_path(char *dest, size_t size, const char *base, const char *path)
+{
+	const char *end, *p;
+	size_t len, n;
+
+	len = 0;
+	if (path[0] != '/') {
+		len = strlcpy(dest, base, size);
+		if (len >= size) {
+			return (false);
+		}
+	}
+
+	while (len > 0 && dest[len - 1] == '/') {
+		len--;
+	}
+
+	for (p = path; *p != '\0'; p = end) {
+		while (*p == '/') {
+			p++;
+		}
+
+		end = p + strcspn(p, "/");
+		n = end - p;
+
+		if (n == 0 || (n == 1 && p[0] == '.')) {
+			continue;
+		}
+
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			while (len > 0 && dest[len - 1] != '/') {
+				len--;
+			}
+			if (len > 0) {
+				len--;
+			}
+			continue;
+		}
+
+		if (len + n + 2 > size) {
+			return (false);
+		}
+
+		dest[len++] = '/';
+		memcpy(dest + len, p, n);
+		len += n;
+	}
+
+	if (len == 0) {
+		dest[len++] = '/';
+	}
+	dest[len] = '\0';
+
+	return (true);
+}
+
+static void
+resolve_init(void)
+{
+	const char *env;
+
+	env = getenv("PO_RESOLVE_SYMLINKS");
+	if (env != NULL && strcmp(env, "1") == 0) {
+		atomic_store(&enabled, true);
+	}
+}
@@ -0,0 +1,283 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_trace.c
+ * @brief Sampled recording of the libc wrappers' path lookups
+ *
+ * A tracing tool (see `tools/po-trace`) creates a po_trace_segment and passes
+ * it to the traced process via `PO_TRACE_FD`. The wrappers then record one
+ * lookup in every `period` into a ring that belongs to the calling thread,
+ * so recording never takes a lock or contends with other threads, and the
+ * tool drains the rings while the process runs. A thread's ring is released
+ * when it exits, so that processes with short-lived threads don't run out.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/**
+ * Map the segment given by `PO_TRACE_FD` (if any) into @b segment.
+ */
+static void	trace_init(void);
+
+/**
+ * Forget the calling thread's ring in a new child process: the ring belongs
+ * to the parent's thread, and only one thread may write to it.
+ */
+static void	trace_atfork_child(void);
+
+/**
+ * Claim a ring for the calling thread: one that has never been claimed if
+ * there are any left, or else one that an exited thread released.
+ *
+ * @returns the ring, or NULL if they are all owned
+ */
+static struct po_trace_ring*	claim_ring(void);
+
+/**
+ * Release an exiting thread's ring (a destructor for @b ring_key).
+ */
+static void	release_ring(void *);
+
+/**
+ * 32-bit FNV-1a hash of a string.
+ */
+static uint32_t	hash_path(const char *);
+
+/**
+ * The trace segment (or NULL if tracing is disabled).
+ */
+static struct po_trace_segment *segment;
+
+/**
+ * Ensures that trace_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The calling thread's ring (NULL until the thread's first sample).
+ */
+static _Thread_local struct po_trace_ring *ring;
+
+/**
+ * Also holds the calling thread's ring, so that release_ring is called for
+ * it when the thread exits.
+ */
+static pthread_key_t ring_key;
+
+/**
+ * Whether the calling thread has tried to claim a ring.
+ */
+static _Thread_local bool claimed;
+
+
+uint32_t
+po_trace_record(enum po_trace_call call, const char *path,
+	struct po_relpath rel, size_t matchlen)
+{
+	struct po_trace_record *record;
+	struct timespec ts;
+	uint64_t head, tail;
+
+	pthread_once(&init_once, trace_init);
+
+	if (segment == NULL) {
+		// Don't come back for a long time.
+		return (UINT32_MAX);
+	}
+
+	if (!claimed) {
+		ring = claim_ring();
+		claimed = true;
+
+		if (ring != NULL) {
+			pthread_setspecific(ring_key, ring);
+		}
+	}
+
+	if (ring == NULL) {
+		atomic_fetch_add_explicit(&segment->unclaimed, 1,
+			memory_order_relaxed);
+		return (segment->period);
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	if (head - tail >= segment->slots) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+			memory_order_relaxed);
+		return (segment->period);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	record = ring->records + (head & (segment->slots - 1));
+	record->timestamp = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	record->hash = hash_path(path);
+	record->entry = (rel.dirfd == AT_FDCWD) ? -1 : rel.dirfd;
+	record->call = call;
+	record->matchlen = MIN(matchlen, UINT16_MAX);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+	return (segment->period);
+}
+
+size_t
+po_match_length(const char *path, struct po_relpath rel)
+{
+	uintptr_t start, end, relpath;
+
+	if (rel.dirfd == -1 || rel.dirfd == AT_FDCWD) {
+		return (0);
+	}
+
+	// The relative path points into the original path unless the whole
+	// path matched (in which case it is ".").
+	start = (uintptr_t) path;
+	end = start + strlen(path);
+	relpath = (uintptr_t) rel.relative_path;
+
+	if (relpath >= start && relpath <= end) {
+		return (relpath - start);
+	}
+
+	return (end - start);
+}
+
+static void
+trace_init(void)
+{
+	struct po_trace_segment *seg;
+	struct stat sb;
+	int fd;
+
+	fd = po_getenv_fd("PO_TRACE_FD");
+	if (fd == -1 || fstat(fd, &sb) != 0
+	    || (size_t) sb.st_size < sizeof(*seg)) {
+		return;
+	}
+
+	seg = mmap(0, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		return;
+	}
+
+	if (seg->magic != PO_TRACE_MAGIC || seg->version != PO_TRACE_VERSION
+	    || seg->period == 0 || seg->slots == 0
+	    || (seg->slots & (seg->slots - 1)) != 0
+	    || (size_t) sb.st_size < po_trace_size(seg->nrings, seg->slots)) {
+		munmap(seg, sb.st_size);
+		return;
+	}
+
+	if (pthread_key_create(&ring_key, release_ring) != 0) {
+		munmap(seg, sb.st_size);
+		return;
+	}
+
+	pthread_atfork(NULL, NULL, trace_atfork_child);
+	segment = seg;
+}
+
+static void
+trace_atfork_child(void)
+{
+	ring = NULL;
+	claimed = false;
+
+	// The ring still belongs to the parent's thread.
+	pthread_setspecific(ring_key, NULL);
+}
+
+static struct po_trace_ring*
+claim_ring(void)
+{
+	struct po_trace_ring *r;
+	uint32_t i;
+
+	i = atomic_fetch_add_explicit(&segment->claimed, 1,
+		memory_order_relaxed);
+	if (i < segment->nrings) {
+		r = po_trace_ring_at(segment, i);
+		atomic_store_explicit(&r->owned, 1, memory_order_relaxed);
+		r->pid = getpid();
+		return (r);
+	}
+
+	// Every ring has been claimed once: look for one that was released.
+	for (i = 0; i < segment->nrings; i++) {
+		uint32_t expected = 0;
+
+		r = po_trace_ring_at(segment, i);
+		if (atomic_compare_exchange_strong_explicit(&r->owned,
+		    &expected, 1, memory_order_acquire,
+		    memory_order_relaxed)) {
+			r->pid = getpid();
+			return (r);
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+release_ring(void *r)
+{
+
+	// Our records stay in the ring until the tool drains them; the next
+	// owner appends after them.
+	atomic_store_explicit(&((struct po_trace_ring*) r)->owned, 0,
+		memory_order_release);
+}
+
+static uint32_t
+hash_path(const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *path != '\0'; path++) {
+		hash = (hash ^ (unsigned char) *path) * 16777619u;
+	}
+
+	return (hash);
+}
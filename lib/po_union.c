@@ -0,0 +1,249 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file  po_union.c
+ * @brief Lookups in union directories
+ *
+ * A union directory (see po_add_union) is a run of po_map entries with the
+ * same name. Finding a path in one means probing each directory in turn
+ * until one of them contains the path, so the winning directory is cached
+ * in a fixed-size table keyed by union and relative path. Only successful
+ * probes are cached: a path that doesn't exist anywhere is probed again
+ * next time, in case it has since been created.
+ *
+ * Wrappers that change the filesystem discard the whole cache (see
+ * po_union_cache_invalidate).
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "internal.h"
+
+/** Number of entries in the cache (a power of two). */
+#define	CACHE_SIZE	1024
+
+/** Number of locks protecting the cache's entries. */
+#define	CACHE_LOCKS	16
+
+/**
+ * The directory that a path was found in.
+ */
+struct cache_entry {
+	/** Hash of the key (0 if the entry is unused) */
+	uint32_t hash;
+
+	/** The union that @b path was looked up in */
+	uint32_t union_id;
+
+	/** The path, relative to the union */
+	char *path;
+
+	/** Index of the directory that @b path was found in */
+	unsigned int layer;
+
+	/** The cache generation that this entry belongs to */
+	uint64_t generation;
+};
+
+/**
+ * Find the first directory in a union that contains a path.
+ *
+ * @returns the index of the directory, or -1 if none contains the path
+ */
+static int	probe(struct po_map_entry *first, const char *relpath,
+	unsigned int access);
+
+/**
+ * Hash a cache key.
+ */
+static uint32_t	hash_key(uint32_t union_id, const char *path);
+
+/**
+ * Allocate the cache and initialize its locks.
+ */
+static void	cache_init(void);
+
+/**
+ * Incremented to discard every cached result at once.
+ */
+static _Atomic(uint64_t) generation;
+
+/**
+ * The cached results (or NULL if they couldn't be allocated).
+ */
+static struct cache_entry *entries;
+
+/**
+ * Locks protecting @b entries (entry i is protected by i % CACHE_LOCKS).
+ */
+static pthread_mutex_t locks[CACHE_LOCKS];
+
+/**
+ * Ensures that cache_init only happens once.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+
+int
+po_union_find(struct po_map_entry *first, const char *relpath,
+	unsigned int access)
+{
+	struct cache_entry *entry;
+	pthread_mutex_t *lock;
+	uint64_t gen;
+	uint32_t hash;
+	size_t i;
+	int layer;
+
+	// The union's root exists in every layer.
+	if (strcmp(relpath, ".") == 0) {
+		return (po_entry_fd(first));
+	}
+
+	pthread_once(&init_once, cache_init);
+
+	if (entries == NULL) {
+		layer = probe(first, relpath, access);
+		return (po_entry_fd(first + MAX(layer, 0)));
+	}
+
+	hash = hash_key(first->union_id, relpath);
+	i = hash & (CACHE_SIZE - 1);
+	entry = entries + i;
+	lock = locks + (i % CACHE_LOCKS);
+
+	gen = atomic_load_explicit(&generation, memory_order_acquire);
+
+	pthread_mutex_lock(lock);
+	if (entry->hash == hash && entry->union_id == first->union_id
+	    && entry->generation == gen && entry->layer < first->layers
+	    && strcmp(entry->path, relpath) == 0) {
+		layer = entry->layer;
+		pthread_mutex_unlock(lock);
+
+		// The winner may not support this lookup's access modes.
+		if ((first[layer].access & access) == access) {
+			return (po_entry_fd(first + layer));
+		}
+	} else {
+		pthread_mutex_unlock(lock);
+	}
+
+	layer = probe(first, relpath, access);
+	if (layer == -1) {
+		return (po_entry_fd(first));
+	}
+
+	pthread_mutex_lock(lock);
+	if (entry->path == NULL || strcmp(entry->path, relpath) != 0) {
+		free(entry->path);
+		entry->path = strdup(relpath);
+	}
+
+	if (entry->path != NULL) {
+		entry->hash = hash;
+		entry->union_id = first->union_id;
+		entry->layer = layer;
+
+		// If the cache was invalidated during the probe, our result
+		// may already be stale: don't let anyone use it.
+		entry->generation = gen;
+	} else {
+		entry->hash = 0;
+	}
+	pthread_mutex_unlock(lock);
+
+	return (po_entry_fd(first + layer));
+}
+
+void
+po_union_cache_invalidate(void)
+{
+	atomic_fetch_add_explicit(&generation, 1, memory_order_release);
+}
+
+static int
+probe(struct po_map_entry *first, const char *relpath, unsigned int access)
+{
+	struct stat sb;
+	int fd;
+
+	for (unsigned int i = 0; i < first->layers; i++) {
+		if ((first[i].access & access) != access) {
+			continue;
+		}
+
+		fd = po_entry_fd(first + i);
+		if (fd == -1) {
+			continue;
+		}
+
+		// Anything but "not there" (e.g., EACCES) is this layer's
+		// answer to give.
+		if (fstatat(fd, relpath, &sb, AT_SYMLINK_NOFOLLOW) == 0
+		    || (errno != ENOENT && errno != ENOTDIR)) {
+			return (i);
+		}
+	}
+
+	return (-1);
+}
+
+static uint32_t
+hash_key(uint32_t union_id, const char *path)
+{
+	uint32_t hash = 2166136261u;
+
+	hash = (hash ^ union_id) * 16777619u;
+
+	for (; *path != '\0'; path++) {
+		hash = (hash ^ (unsigned char) *path) * 16777619u;
+	}
+
+	return (hash == 0 ? 1 : hash);
+}
+
+static void
+cache_init(void)
+{
+	for (size_t i = 0; i < CACHE_LOCKS; i++) {
+		pthread_mutex_init(locks + i, NULL);
+	}
+
+	entries = calloc(CACHE_SIZE, sizeof(*entries));
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map);
+
+int main(int argc, char *argv[])
+{
+	const char *paths[] = { "/foo", "/wibble", "/foo/bar" };
+	const char *bad[] = { "/baz", NULL };
+	struct po_map *map;
+	int fds[3];
+
+	// CHECK: fds: [[FOO:[0-9]+]] [[WIBBLE:[0-9]+]] [[FOOBAR:[0-9]+]]
+	fds[0] = openat(AT_FDCWD, TEST_DIR("/foo"), O_DIRECTORY);
+	fds[1] = openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	fds[2] = openat(AT_FDCWD, TEST_DIR("/foo/bar"), O_DIRECTORY);
+	printf("fds: %d %d %d\n", fds[0], fds[1], fds[2]);
+	assert(fds[0] != -1 && fds[1] != -1 && fds[2] != -1);
+
+	map = po_map_create(1);
+
+	// CHECK: po_map_reserve: ok
+	printf("po_map_reserve: %s\n",
+		po_map_reserve(map, 1024) == map ? "ok" : "failed");
+
+	// CHECK: po_add_many: ok
+	printf("po_add_many: %s\n",
+		po_add_many(map, paths, fds, 3) == map ? "ok" : "failed");
+
+	// A batch containing an invalid entry adds nothing:
+	// CHECK: po_add_many with NULL path: failed
+	printf("po_add_many with NULL path: %s\n",
+		po_add_many(map, bad, fds, 2) == map ? "ok" : "failed");
+
+	// CHECK: po_map_shrink_to_fit: ok
+	printf("po_map_shrink_to_fit: %s\n",
+		po_map_shrink_to_fit(map) == map ? "ok" : "failed");
+
+	// CHECK: iterated over 3 entries
+	printf("iterated over %zu entries\n",
+		po_map_foreach(map, po_print_entry));
+
+	// Adding after shrinking grows the map again:
+	// CHECK: po_add: ok
+	printf("po_add: %s\n",
+		po_add(map, "/bar", fds[2]) == map ? "ok" : "failed");
+
+	// CHECK: /foo/bar/hi.txt -> [[FOOBAR]]:hi.txt
+	find("/foo/bar/hi.txt", map);
+
+	// CHECK: /wibble/bye.txt -> [[WIBBLE]]:bye.txt
+	find("/wibble/bye.txt", map);
+
+	// CHECK: /bar/hi.txt -> [[FOOBAR]]:hi.txt
+	find("/bar/hi.txt", map);
+
+	po_map_release(map);
+
+	return 0;
+}
+
+static void
+find(const char *absolute, struct po_map *map)
+{
+	struct po_relpath rel = po_find(map, absolute, NULL);
+	printf("%s -> %d:%s\n", absolute, rel.dirfd, rel.relative_path);
+}
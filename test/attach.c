@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *attached, *map;
+	struct po_map *late;
+	int foo, received, shmfd, sv[2], wibble;
+
+	map = po_map_create(4);
+
+	// CHECK: foo: [[FOO:[0-9]+]]
+	foo = openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY | O_DIRECTORY);
+	printf("foo: %d\n", foo);
+	assert(foo != -1);
+	po_add(map, "/foo", foo);
+
+	shmfd = po_pack(map);
+	assert(shmfd != -1);
+
+	assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+
+	// Pretend that we were forked with the segment's one entry.
+	attached = po_attach(shmfd, sv[1], 1);
+	assert(attached != NULL);
+
+	// CHECK: /foo/bar -> [[FOO]]:bar
+	find("/foo/bar", attached);
+
+	// CHECK: /wibble/bye.txt -> -1:
+	find("/wibble/bye.txt", attached);
+
+	// Entries can't be added to an attached map directly:
+	// CHECK: po_add to attached map: failed
+	printf("po_add to attached map: %s\n",
+		po_add(attached, "/wibble", foo) == NULL ? "failed" : "ok");
+
+	// CHECK: wibble: [[WIBBLE:[0-9]+]]
+	wibble = openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	printf("wibble: %d\n", wibble);
+	assert(wibble != -1);
+	po_add(map, "/wibble", wibble);
+
+	// CHECK: po_pack_publish: 0
+	printf("po_pack_publish: %d\n",
+		po_pack_publish(map, shmfd, sv, 1));
+
+	// The new entry is visible on the next lookup, via a descriptor that
+	// was passed over the socket (and is therefore not WIBBLE):
+	// CHECK: /foo/bar -> [[FOO]]:bar
+	find("/foo/bar", attached);
+
+	// CHECK: /wibble/bye.txt -> [[RECEIVED:[0-9]+]]:bye.txt
+	// CHECK-NOT: /wibble/bye.txt -> [[WIBBLE]]:
+	find("/wibble/bye.txt", attached);
+
+	// CHECK: contents of attached map:
+	// CHECK-NEXT: name: '/foo', fd: [[FOO]]
+	// CHECK-NEXT: name: '/wibble', fd: [[RECEIVED]]
+	printf("contents of attached map:\n");
+	po_map_foreach(attached, po_print_entry);
+
+	// A process that was forked before /wibble was published (and which
+	// wasn't sent its descriptor) can't use the publisher's descriptor
+	// number, even though the entry was published before it attached.
+	late = po_attach(shmfd, -1, 1);
+	assert(late != NULL);
+
+	// CHECK: late: /foo/bar -> [[FOO]]:bar
+	// CHECK: late: /wibble/bye.txt -> -1:
+	printf("late: ");
+	find("/foo/bar", late);
+	printf("late: ");
+	find("/wibble/bye.txt", late);
+	po_map_release(late);
+
+	// Releasing the map closes the descriptors that it received, but not
+	// the ones that it shares with the original map.
+	received = po_find(attached, "/wibble", NULL).dirfd;
+	po_map_release(attached);
+
+	// CHECK: received descriptor closed: yes
+	// CHECK: inherited descriptor closed: no
+	printf("received descriptor closed: %s\n",
+		fcntl(received, F_GETFD) == -1 ? "yes" : "no");
+	printf("inherited descriptor closed: %s\n",
+		fcntl(foo, F_GETFD) == -1 ? "yes" : "no");
+
+	po_map_release(map);
+
+	return 0;
+}
+
+static void
+find(const char *absolute, struct po_map *map)
+{
+	struct po_relpath rel = po_find(map, absolute, NULL);
+	printf("%s -> %d:%s\n", absolute, rel.dirfd, rel.relative_path);
+}
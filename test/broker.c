@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -lpthread -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+static void	try_open(const char *path);
+static void*	open_thread(void *);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_map *policy;
+	pthread_t threads[2];
+	char sandbox[] = "/tmp/po-broker.XXXXXX";
+	char link[64];
+	pid_t broker;
+	int inputs, sandboxfd, sv[2];
+
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+
+	// The broker lets us use its test inputs, but calls them /brokered
+	// (which doesn't exist), so they can only be opened via the broker.
+	policy = po_map_create(4);
+	inputs = openat(AT_FDCWD, TEST_DATA_DIR, O_RDONLY | O_DIRECTORY);
+	assert(inputs != -1);
+	assert(po_add(policy, "/brokered", inputs) != NULL);
+
+	// Clients may be able to create links in the directories they are
+	// given, so a link mustn't lead the broker out of its policy.
+	assert(mkdtemp(sandbox) != NULL);
+	snprintf(link, sizeof(link), "%s/escape", sandbox);
+	assert(symlink(TEST_DATA_DIR, link) == 0);
+	sandboxfd = openat(AT_FDCWD, sandbox, O_RDONLY | O_DIRECTORY);
+	assert(sandboxfd != -1);
+	assert(po_add(policy, "/sandbox", sandboxfd) != NULL);
+
+	broker = fork();
+	assert(broker != -1);
+
+	if (broker == 0) {
+		close(sv[0]);
+		_exit(po_broker_serve(sv[1], policy) == 0 ? 0 : 1);
+	}
+
+	close(sv[1]);
+	po_map_release(policy);
+
+	// CHECK: set broker: 0
+	printf("set broker: %d\n", po_set_broker(sv[0]));
+
+	// CHECK: /brokered/foo/bar/hi.txt: opened
+	try_open("/brokered/foo/bar/hi.txt");
+
+	// CHECK: /elsewhere/hi.txt: {{.*}}
+	// CHECK-NOT: opened
+	try_open("/elsewhere/hi.txt");
+
+	// CHECK: /brokered/../brokered/foo/bar/hi.txt: {{.*}}
+	// CHECK-NOT: opened
+	try_open("/brokered/../brokered/foo/bar/hi.txt");
+
+	// CHECK: /sandbox/escape/foo/bar/hi.txt: {{.*}}
+	// CHECK-NOT: opened
+	try_open("/sandbox/escape/foo/bar/hi.txt");
+
+	// CHECK: /sandbox/escape/hi.txt: {{.*}}
+	// CHECK-NOT: opened
+	try_open("/sandbox/escape/hi.txt");
+
+	unlink(link);
+	rmdir(sandbox);
+
+	// Misses from concurrent threads are sent together.
+	pthread_create(threads + 0, NULL, open_thread,
+		"/brokered/baz/wibble/bye.txt");
+	pthread_create(threads + 1, NULL, open_thread, "/brokered/baz/wibble");
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+
+	// CHECK-DAG: /brokered/baz/wibble/bye.txt: opened
+	// CHECK-DAG: /brokered/baz/wibble: opened
+
+	// Once the broker has gone away, granted directories can still be
+	// used, but nothing new can be requested.
+	kill(broker, SIGTERM);
+	waitpid(broker, NULL, 0);
+
+	// CHECK: after broker exits:
+	// CHECK-NEXT: /brokered/foo/bar/hi.txt: opened
+	// CHECK-NEXT: /brokered/foo: {{.*}}
+	// CHECK-NOT: opened
+	printf("after broker exits:\n");
+	try_open("/brokered/foo/bar/hi.txt");
+	try_open("/brokered/foo");
+
+	return 0;
+}
+
+static void
+try_open(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	printf("%s: opened\n", path);
+	close(fd);
+}
+
+static void*
+open_thread(void *path)
+{
+	try_open(path);
+	return (NULL);
+}
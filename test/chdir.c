@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2016, 2018 Jonathan Anderson
+ * Copyright (c) 2016 Stanley Uche Godfrey
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/param.h>
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+int main(int argc, char *argv[])
+{
+	char cwd[MAXPATHLEN];
+	const char *volatile none = NULL;
+	struct po_map *map;
+	int fd, first, foo;
+
+	map = po_map_create(4);
+
+	// CHECK: foo: [[FOO:[0-9]+]]
+	foo = po_preopen(map, TEST_DIR("/foo"), O_DIRECTORY);
+	printf("foo: %d\n", foo);
+	assert(foo != -1);
+
+	po_set_libc_map(map);
+
+	// CHECK: entered capability mode
+	cap_enter();
+	printf("entered capability mode to disallow the real chdir(2)\n");
+
+	// The first working directory will get the lowest free descriptor.
+	first = dup(0);
+	close(first);
+
+	// CHECK-NOT: error in chdir
+	if (chdir(TEST_DIR("/foo/bar")) != 0) {
+		err(-1, "error in chdir('%s')", TEST_DIR("/foo/bar"));
+	}
+
+	// CHECK: cwd: {{.*}}/Inputs/foo/bar
+	printf("cwd: %s\n", getcwd(cwd, sizeof(cwd)));
+
+	// CHECK: hi.txt: {{[0-9]+}}
+	fd = open("hi.txt", O_RDONLY);
+	printf("hi.txt: %d\n", fd);
+	assert(fd != -1);
+	close(fd);
+
+	// CHECK-NOT: error in chdir
+	if (chdir("../bar/./..") != 0) {
+		err(-1, "error in chdir('../bar/./..')");
+	}
+
+	// CHECK: cwd: {{.*}}/Inputs/foo{{$}}
+	printf("cwd: %s\n", getcwd(cwd, sizeof(cwd)));
+
+	// Nothing is still using the directory that was replaced.
+	// CHECK: first directory closed: yes
+	printf("first directory closed: %s\n",
+		(fcntl(first, F_GETFD) == -1) ? "yes" : "no");
+
+	// CHECK: bar/hi.txt: {{[0-9]+}}
+	fd = open("bar/hi.txt", O_RDONLY);
+	printf("bar/hi.txt: %d\n", fd);
+	assert(fd != -1);
+	close(fd);
+
+	// CHECK: chdir('hi.txt'): -1
+	printf("chdir('hi.txt'): %d\n", chdir("bar/hi.txt"));
+
+	// CHECK: chdir(NULL): -1 (Bad address)
+	fd = chdir(none);
+	printf("chdir(NULL): %d (%s)\n", fd, strerror(errno));
+
+	return 0;
+}
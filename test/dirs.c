@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+void	po_set_libc_map(struct po_map *);
+
+static int	print_file(const char *, const struct stat *, int, struct FTW *);
+static int	stop_at_file(const char *, const struct stat *, int,
+	struct FTW *);
+
+
+int main(int argc, char *argv[])
+{
+	char scratch[] = "/tmp/po-dirs.XXXXXX";
+	struct dirent *entry, **list;
+	struct po_map *map;
+	DIR *dir;
+	int count, inputs, loop, result;
+
+	// The test inputs are only available as /inputs, which doesn't exist.
+	map = po_map_create(4);
+	inputs = openat(AT_FDCWD, TEST_DATA_DIR, O_RDONLY | O_DIRECTORY);
+	assert(inputs != -1);
+	assert(po_add(map, "/inputs", inputs) != NULL);
+	po_set_libc_map(map);
+
+	// CHECK: opendir:
+	// CHECK-DAG: entry: bar
+	// CHECK-DAG: entry: .
+	// CHECK-DAG: entry: ..
+	dir = opendir("/inputs/foo");
+	assert(dir != NULL);
+	printf("opendir:\n");
+	while ((entry = readdir(dir)) != NULL) {
+		printf("entry: %s\n", entry->d_name);
+	}
+	closedir(dir);
+
+	// CHECK: opendir missing: No such file or directory
+	dir = opendir("/inputs/missing");
+	printf("opendir missing: %s\n", dir ? "opened" : strerror(errno));
+
+	// CHECK: scandir: 3
+	// CHECK-NEXT: .
+	// CHECK-NEXT: ..
+	// CHECK-NEXT: hi.txt
+	count = scandir("/inputs/foo/bar", &list, NULL, alphasort);
+	printf("scandir: %d\n", count);
+	for (int i = 0; i < count; i++) {
+		printf("%s\n", list[i]->d_name);
+		free(list[i]);
+	}
+	free(list);
+
+	// CHECK: nftw:
+	// CHECK-NEXT: 0 D /inputs/foo (foo)
+	// CHECK-NEXT: 1 D /inputs/foo/bar (bar)
+	// CHECK-NEXT: 2 F /inputs/foo/bar/hi.txt (hi.txt)
+	// CHECK-NEXT: result: 0
+	printf("nftw:\n");
+	result = nftw("/inputs/foo", print_file, 4, FTW_PHYS);
+	printf("result: %d\n", result);
+
+	// CHECK: depth first:
+	// CHECK-NEXT: 2 F /inputs/foo/bar/hi.txt (hi.txt)
+	// CHECK-NEXT: 1 DP /inputs/foo/bar (bar)
+	// CHECK-NEXT: 0 DP /inputs/foo/ (foo/)
+	// CHECK-NEXT: result: 0
+	printf("depth first:\n");
+	result = nftw("/inputs/foo/", print_file, 4, FTW_PHYS | FTW_DEPTH);
+	printf("result: %d\n", result);
+
+	// CHECK: stopped: 42
+	printf("stopped: %d\n", nftw("/inputs", stop_at_file, 4, 0));
+
+	// CHECK: nftw missing: -1, No such file or directory
+	result = nftw("/inputs/missing", print_file, 4, 0);
+	printf("nftw missing: %d, %s\n", result, strerror(errno));
+
+	// Following a link back to an ancestor doesn't loop forever.
+	assert(mkdtemp(scratch) != NULL);
+	loop = openat(AT_FDCWD, scratch, O_RDONLY | O_DIRECTORY);
+	assert(loop != -1);
+	assert(symlinkat(".", loop, "self") == 0);
+	assert(symlinkat("/dev/null", loop, "null") == 0);
+	assert(po_add(map, "/loop", loop) != NULL);
+
+	// CHECK: cycle:
+	// CHECK-NEXT: 0 D /loop (loop)
+	// CHECK-DAG: 1 D /loop/self (self)
+	// CHECK-DAG: 1 F /loop/null (null)
+	// CHECK: result: 0
+	printf("cycle:\n");
+	result = nftw("/loop", print_file, 4, 0);
+	printf("result: %d\n", result);
+
+	// FTW_MOUNT only keeps the walk out of directories on other devices.
+	// CHECK: mount:
+	// CHECK-NEXT: 0 D /loop (loop)
+	// CHECK-NOT: /loop/dev
+	// CHECK-DAG: 1 D /loop/self (self)
+	// CHECK-DAG: 1 F /loop/null (null)
+	// CHECK-NOT: /loop/dev
+	// CHECK: result: 0
+	assert(symlinkat("/dev", loop, "dev") == 0);
+	printf("mount:\n");
+	result = nftw("/loop", print_file, 4, FTW_MOUNT);
+	printf("result: %d\n", result);
+
+	unlinkat(loop, "dev", 0);
+	unlinkat(loop, "null", 0);
+	unlinkat(loop, "self", 0);
+	rmdir(scratch);
+
+	return 0;
+}
+
+static int
+print_file(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+	const char *name;
+
+	switch (type) {
+	case FTW_D:	name = "D";	break;
+	case FTW_DP:	name = "DP";	break;
+	case FTW_F:	name = "F";	break;
+	default:	name = "?";	break;
+	}
+
+	printf("%d %s %s (%s)\n", ftw->level, name, path, path + ftw->base);
+
+	return (0);
+}
+
+static int
+stop_at_file(const char *path, const struct stat *sb, int type,
+	struct FTW *ftw)
+{
+	return (type == FTW_F ? 42 : 0);
+}
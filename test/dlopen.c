@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: mkdir -p %t.libs
+ * RUN: %cc %cflags -D PLUGIN -shared -fPIC %s -o %t.libs/libpo-plugin.so
+ * RUN: %cc -c %cflags %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t %t.libs > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#ifdef PLUGIN
+
+const char*
+plugin_name(void)
+{
+	return "po-plugin";
+}
+
+#else
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+void	po_set_libc_map(struct po_map *);
+
+static void	load(const char *name);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_map *map;
+	int libs;
+
+	assert(argc == 2);
+
+	// The plugin directory is only available as /po-libs (which doesn't
+	// exist), so the plugin can only be found via the map.
+	map = po_map_create(4);
+	libs = openat(AT_FDCWD, argv[1], O_RDONLY | O_DIRECTORY);
+	assert(libs != -1);
+	assert(po_add(map, "/po-libs", libs) != NULL);
+	po_set_libc_map(map);
+
+	unsetenv("LD_LIBRARY_PATH");
+
+	// CHECK: library path: 0
+	printf("library path: %d\n",
+		po_set_library_path("/nonexistent:/po-libs"));
+
+	// CHECK-NEXT: libpo-plugin.so: po-plugin
+	load("libpo-plugin.so");
+
+	// The second time, the library comes from the cache.
+	// CHECK-NEXT: libpo-plugin.so: po-plugin
+	load("libpo-plugin.so");
+
+	// CHECK-NEXT: /po-libs/libpo-plugin.so: po-plugin
+	load("/po-libs/libpo-plugin.so");
+
+	// CHECK-NEXT: libpo-missing.so: not loaded
+	load("libpo-missing.so");
+
+	// LD_LIBRARY_PATH is searched first.
+	setenv("LD_LIBRARY_PATH", "/po-libs", 1);
+	po_set_library_path("/nonexistent");
+
+	// CHECK-NEXT: libpo-plugin.so: po-plugin
+	load("libpo-plugin.so");
+
+	return 0;
+}
+
+static void
+load(const char *name)
+{
+	const char* (*plugin_name)(void);
+	void *handle;
+
+	handle = dlopen(name, RTLD_NOW);
+	if (handle == NULL) {
+		printf("%s: not loaded\n", name);
+		return;
+	}
+
+	plugin_name = (const char* (*)(void)) dlsym(handle, "plugin_name");
+	assert(plugin_name != NULL);
+	printf("%s: %s\n", name, plugin_name());
+}
+
+#endif
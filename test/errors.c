@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags %s -o %t.o
+ * RUN: %cc %t.o %ldflags -lpthread -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+static void*	fail_unpack(void *);
+static void*	fail_pack(void *);
+
+static pthread_barrier_t barrier;
+
+
+int main(int argc, char *argv[])
+{
+	pthread_t unpacker, packer;
+	char *unpack_error, *pack_error;
+
+	// CHECK: initial error: (null)
+	printf("initial error: %s\n", po_last_error() ? "?" : "(null)");
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	pthread_create(&unpacker, NULL, fail_unpack, NULL);
+	pthread_create(&packer, NULL, fail_pack, NULL);
+	pthread_join(unpacker, (void**) &unpack_error);
+	pthread_join(packer, (void**) &pack_error);
+
+	// CHECK: unpack: not a packed po_map: error {{[0-9]+}}
+	printf("unpack: %s\n", unpack_error);
+
+	// CHECK: pack: cannot pack a segment-backed or overlay po_map: error
+	printf("pack: %s\n", pack_error);
+
+	// Neither thread's failure is visible here.
+	// CHECK: main thread: 0
+	printf("main thread: %d\n", po_last_error_code());
+
+	return 0;
+}
+
+static void*
+fail_unpack(void *arg)
+{
+	int fd;
+
+	// A segment full of zeroes is no packed map.
+	fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+	assert(fd >= 0);
+	assert(ftruncate(fd, 4096) == 0);
+	assert(po_unpack(fd) == NULL);
+	assert(po_last_error_code() == PO_ERROR_FORMAT);
+
+	// Wait for the other thread to fail too before we look at our error.
+	pthread_barrier_wait(&barrier);
+
+	return (strdup(po_last_error()));
+}
+
+static void*
+fail_pack(void *arg)
+{
+	struct po_map *base, *overlay;
+
+	base = po_map_create(4);
+	overlay = po_map_overlay(base, 4);
+	assert(po_pack(overlay) == -1);
+	assert(po_last_error_code() == PO_ERROR_INVALID);
+
+	pthread_barrier_wait(&barrier);
+
+	return (strdup(po_last_error()));
+}
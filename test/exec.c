@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+void	po_set_libc_map(struct po_map *);
+
+extern char **environ;
+
+static void	run(const char *file, const char *message);
+static void	run_script(const char *file);
+
+
+int main(int argc, char *argv[])
+{
+	char *spawn_argv[] = { "sh", "-c", "echo spawned", NULL };
+	char scratch[] = "/tmp/po-exec.XXXXXX";
+	struct po_map *map;
+	pid_t child;
+	int bin, fd, scripts, status;
+
+	// /bin is only available as /po-bin (which doesn't exist), so that
+	// commands can only be found via the map.
+	map = po_map_create(4);
+	bin = openat(AT_FDCWD, "/bin", O_RDONLY | O_DIRECTORY);
+	assert(bin != -1);
+	assert(po_add(map, "/po-bin", bin) != NULL);
+	assert(po_preopen(map, "/bin", O_DIRECTORY) != -1);
+	po_set_libc_map(map);
+
+	setenv("PATH", "/nonexistent:/po-bin", 1);
+
+	// CHECK: hello
+	// CHECK-NEXT: exit status: 0
+	run("sh", "hello");
+
+	// The second time, the command comes from the cache.
+	// CHECK-NEXT: hello again
+	// CHECK-NEXT: exit status: 0
+	run("sh", "hello again");
+
+	// CHECK-NEXT: no-such-command: No such file or directory
+	// CHECK-NEXT: exit status: 127
+	run("no-such-command", NULL);
+
+	// Scripts are only available as /po-scripts.
+	assert(mkdtemp(scratch) != NULL);
+	scripts = openat(AT_FDCWD, scratch, O_RDONLY | O_DIRECTORY);
+	assert(scripts != -1);
+	assert(po_add(map, "/po-scripts", scripts) != NULL);
+	setenv("PATH", "/nonexistent:/po-scripts", 1);
+
+	fd = openat(scripts, "po-plain", O_WRONLY | O_CREAT, 0755);
+	assert(fd != -1);
+	dprintf(fd, "echo plain script: $1\n");
+	close(fd);
+
+	fd = openat(scripts, "po-interp", O_WRONLY | O_CREAT, 0755);
+	assert(fd != -1);
+	dprintf(fd, "#!/nonexistent/interpreter\n");
+	close(fd);
+
+	// A file that isn't in an executable format is run by the shell.
+	// CHECK-NEXT: plain script: arg
+	// CHECK-NEXT: exit status: 0
+	run_script("po-plain");
+
+	// A script whose interpreter is missing was still found.
+	// CHECK-NEXT: po-interp: No such file or directory
+	// CHECK-NEXT: exit status: 127
+	run_script("po-interp");
+
+	unlinkat(scripts, "po-plain", 0);
+	unlinkat(scripts, "po-interp", 0);
+	rmdir(scratch);
+
+	// posix_spawn(3) executes by path, so it needs the real /bin.
+	setenv("PATH", "/nonexistent:/bin", 1);
+
+	// CHECK-NEXT: spawned
+	// CHECK-NEXT: posix_spawnp: 0, exit status: 0
+	fflush(stdout);
+	status = posix_spawnp(&child, "sh", NULL, NULL, spawn_argv, environ);
+	assert(status == 0);
+	waitpid(child, &status, 0);
+	printf("posix_spawnp: 0, exit status: %d\n", WEXITSTATUS(status));
+
+	// CHECK-NEXT: posix_spawnp missing: No such file or directory
+	status = posix_spawnp(&child, "no-such-command", NULL, NULL,
+		spawn_argv, environ);
+	printf("posix_spawnp missing: %s\n", strerror(status));
+
+	return 0;
+}
+
+static void
+run(const char *file, const char *message)
+{
+	char command[64];
+	char *argv[] = { "sh", "-c", command, NULL };
+	pid_t child;
+	int status;
+
+	snprintf(command, sizeof(command), "echo %s", message);
+	fflush(stdout);
+
+	child = fork();
+	assert(child != -1);
+
+	if (child == 0) {
+		execvp(file, argv);
+		printf("%s: %s\n", file, strerror(errno));
+		fflush(stdout);
+		_exit(127);
+	}
+
+	waitpid(child, &status, 0);
+	printf("exit status: %d\n", WEXITSTATUS(status));
+}
+
+static void
+run_script(const char *file)
+{
+	char *argv[] = { (char*) file, "arg", NULL };
+	pid_t child;
+	int status;
+
+	fflush(stdout);
+
+	child = fork();
+	assert(child != -1);
+
+	if (child == 0) {
+		execvp(file, argv);
+		printf("%s: %s\n", file, strerror(errno));
+		fflush(stdout);
+		_exit(127);
+	}
+
+	waitpid(child, &status, 0);
+	printf("exit status: %d\n", WEXITSTATUS(status));
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map,
+	unsigned int access);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *map;
+	int foo, ro, rw;
+
+	map = po_map_create(4);
+
+	// CHECK: foo: [[FOO:[0-9]+]]
+	foo = openat(AT_FDCWD, TEST_DIR("/foo"), O_DIRECTORY);
+	printf("foo: %d\n", foo);
+	assert(foo != -1);
+	po_add(map, "/foo", foo);
+
+	// The same directory, registered more specifically for reading
+	// and for writing:
+	// CHECK: ro: [[RO:[0-9]+]], rw: [[RW:[0-9]+]]
+	ro = openat(AT_FDCWD, TEST_DIR("/foo/bar"), O_DIRECTORY);
+	rw = openat(AT_FDCWD, TEST_DIR("/foo/bar"), O_DIRECTORY);
+	printf("ro: %d, rw: %d\n", ro, rw);
+	po_add_access(map, "/foo/bar", ro, PO_ACCESS_READ);
+	po_add_access(map, "/foo/bar", rw, PO_ACCESS_READ | PO_ACCESS_WRITE);
+
+	// CHECK: /foo/bar/hi.txt (0x1) -> [[RO]]:hi.txt
+	find("/foo/bar/hi.txt", map, PO_ACCESS_READ);
+
+	// CHECK: /foo/bar/hi.txt (0x2) -> [[RW]]:hi.txt
+	find("/foo/bar/hi.txt", map, PO_ACCESS_WRITE);
+
+	// Neither specific entry can be used to execute files, but the
+	// less-specific (unrestricted) one can:
+	// CHECK: /foo/bar/hi.txt (0x4) -> [[FOO]]:bar/hi.txt
+	find("/foo/bar/hi.txt", map, PO_ACCESS_EXEC);
+
+	// CHECK: /foo/bar/hi.txt (0x0) -> [[RO]]:hi.txt
+	find("/foo/bar/hi.txt", map, 0);
+
+	po_map_release(map);
+
+	return 0;
+}
+
+static void
+find(const char *absolute, struct po_map *map, unsigned int access)
+{
+	struct po_relpath rel = po_find_access(map, absolute, access);
+	printf("%s (0x%x) -> %d:%s\n", absolute, access, rel.dirfd,
+		rel.relative_path);
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static void	handler(int);
+
+static struct po_map *map;
+static struct po_relpath found;
+static int result = -1;
+
+
+int main(int argc, char *argv[])
+{
+	struct po_relpath rel;
+	pid_t child;
+	int foo, status;
+
+	map = po_map_create(4);
+	foo = po_preopen(map, TEST_DIR("/foo"), O_DIRECTORY);
+	assert(foo != -1);
+
+	// CHECK: before freezing: EINVAL
+	printf("before freezing: %s\n",
+		po_find_r(map, TEST_DIR("/foo/bar/hi.txt"), 0, &rel) == EINVAL
+		? "EINVAL" : "?");
+
+	// CHECK: freeze: 0
+	printf("freeze: %d\n", po_map_freeze(map));
+
+	// CHECK: add to frozen map: failed
+	printf("add to frozen map: %s\n",
+		po_add(map, "/wibble", dup(foo)) == NULL ? "failed" : "added");
+
+	// CHECK: miss: ENOENT
+	printf("miss: %s\n", po_find_r(map, "/nonexistent", 0, &rel) == ENOENT
+		? "ENOENT" : "?");
+
+	// Look up a path from within a signal handler.
+	signal(SIGUSR1, handler);
+	raise(SIGUSR1);
+
+	// CHECK: in handler: 0, foo, 'bar/hi.txt'
+	printf("in handler: %d, %s, '%s'\n", result,
+		found.dirfd == foo ? "foo" : "other", found.relative_path);
+
+	// ... and between vfork(2) and _exit(2).
+	child = vfork();
+	if (child == 0) {
+		if (po_find_r(map, TEST_DIR("/foo/bar/hi.txt"), PO_ACCESS_READ,
+		    &rel) != 0) {
+			_exit(1);
+		}
+		_exit(openat(rel.dirfd, rel.relative_path, O_RDONLY) < 0);
+	}
+
+	assert(child > 0);
+	waitpid(child, &status, 0);
+
+	// CHECK: vfork child: 0
+	printf("vfork child: %d\n", WEXITSTATUS(status));
+
+	return 0;
+}
+
+static void
+handler(int sig)
+{
+	int saved = errno;
+
+	result = po_find_r(map, TEST_DIR("/foo/bar/hi.txt"), PO_ACCESS_READ,
+		&found);
+
+	errno = saved;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+void po_set_libc_map(struct po_map *);
+
+static void	open_file(const char *path);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_io_policy policy = {
+		.flags = O_CLOEXEC,
+		.advice = POSIX_FADV_SEQUENTIAL,
+		.readahead = 1024 * 1024,
+	};
+	struct po_map *map = po_map_create(4);
+
+	assert(po_preopen(map, TEST_DIR("/foo"), O_DIRECTORY) != -1);
+	assert(po_preopen(map, TEST_DIR("/baz"), O_DIRECTORY) != -1);
+
+	// CHECK: set policy: 0
+	printf("set policy: %d\n",
+		po_set_io_policy(map, TEST_DIR("/foo"), &policy));
+
+	// CHECK: unknown entry: -1
+	printf("unknown entry: %d\n",
+		po_set_io_policy(map, "/nonexistent", &policy));
+
+	// Policies can't change what is opened.
+	// CHECK: O_CREAT policy: -1
+	struct po_io_policy creat = { .flags = O_CREAT };
+	printf("O_CREAT policy: %d\n",
+		po_set_io_policy(map, TEST_DIR("/foo"), &creat));
+
+	po_set_libc_map(map);
+
+	// Files beneath the entry get its flags...
+	// CHECK: {{.*}}/foo/bar/hi.txt: cloexec 1
+	open_file(TEST_DIR("/foo/bar/hi.txt"));
+
+	// ... but files beneath other entries don't.
+	// CHECK: {{.*}}/baz/wibble/bye.txt: cloexec 0
+	open_file(TEST_DIR("/baz/wibble/bye.txt"));
+
+	// Removing the policy:
+	// CHECK: {{.*}}/foo/bar/hi.txt: cloexec 0
+	assert(po_set_io_policy(map, TEST_DIR("/foo"), NULL) == 0);
+	open_file(TEST_DIR("/foo/bar/hi.txt"));
+
+	return 0;
+}
+
+static void
+open_file(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	assert(fd != -1);
+
+	printf("%s: cloexec %d\n", path,
+		(fcntl(fd, F_GETFD) & FD_CLOEXEC) ? 1 : 0);
+
+	close(fd);
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static bool	print_entry(const char *name, int fd, cap_rights_t);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_map *map;
+	struct po_relpath rel;
+	int first;
+
+	map = po_map_create(4);
+	assert(po_preopen(map, TEST_DIR("/baz"), O_DIRECTORY) != -1);
+
+	// CHECK: lazy: 0
+	printf("lazy: %d\n",
+		po_preopen_lazy(map, TEST_DIR("/foo"), O_DIRECTORY));
+
+	// CHECK: before lookup:
+	// CHECK-DAG: {{.*}}/Inputs/baz: opened
+	// CHECK-DAG: {{.*}}/Inputs/foo: not opened
+	printf("before lookup:\n");
+	po_map_foreach(map, print_entry);
+
+	// Looking up other entries shouldn't open the lazy one.
+	rel = po_find(map, TEST_DIR("/baz/wibble"), NULL);
+	assert(rel.dirfd != -1);
+
+	// CHECK: other lookup:
+	// CHECK: {{.*}}/Inputs/foo: not opened
+	printf("other lookup:\n");
+	po_map_foreach(map, print_entry);
+
+	rel = po_find(map, TEST_DIR("/foo/bar/hi.txt"), NULL);
+	first = rel.dirfd;
+
+	// CHECK: first lookup: 'bar/hi.txt', readable
+	printf("first lookup: '%s', %s\n", rel.relative_path,
+		faccessat(rel.dirfd, rel.relative_path, R_OK, 0) == 0
+		? "readable" : "not readable");
+
+	// CHECK: {{.*}}/Inputs/foo: opened
+	po_map_foreach(map, print_entry);
+
+	// CHECK: second lookup: same descriptor
+	rel = po_find(map, TEST_DIR("/foo/bar"), NULL);
+	printf("second lookup: %s\n",
+		rel.dirfd == first ? "same descriptor" : "new descriptor");
+
+	// CHECK: closed: 1
+	printf("closed: %zu\n", po_map_close_idle(map, 0));
+
+	// CHECK: {{.*}}/Inputs/foo: not opened
+	po_map_foreach(map, print_entry);
+
+	// CHECK: after closing: 'bar/hi.txt', readable
+	rel = po_find(map, TEST_DIR("/foo/bar/hi.txt"), NULL);
+	printf("after closing: '%s', %s\n", rel.relative_path,
+		faccessat(rel.dirfd, rel.relative_path, R_OK, 0) == 0
+		? "readable" : "not readable");
+
+	// CHECK: recently used: 0
+	printf("recently used: %zu\n", po_map_close_idle(map, 3600));
+
+	po_map_release(map);
+
+	return 0;
+}
+
+static bool
+print_entry(const char *name, int fd, cap_rights_t rights)
+{
+	if (strstr(name, "/Inputs/") != NULL) {
+		printf("%s: %s\n", name, fd == -1 ? "not opened" : "opened");
+	}
+
+	return (true);
+}
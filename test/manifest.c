@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+int main(int argc, char *argv[])
+{
+	struct po_manifest_entry manifest[] = {
+		{ .path = TEST_DIR("/foo"), .flags = O_DIRECTORY },
+		{ .path = TEST_DIR("/nonexistent"), .flags = O_DIRECTORY },
+		{ .path = TEST_DIR("/baz/wibble"), .flags = O_DIRECTORY },
+		{ .path = TEST_DIR("/foo/bar/hi.txt"), .flags = O_DIRECTORY },
+	};
+	const size_t n = sizeof(manifest) / sizeof(manifest[0]);
+	struct po_map *map;
+	struct po_relpath rel;
+	size_t i;
+	int result;
+
+	map = po_map_create(1);
+
+	// CHECK: po_preopen_manifest: 2 failures
+	printf("po_preopen_manifest: %d failures\n",
+		po_preopen_manifest(map, manifest, n, 4));
+
+	// CHECK: {{.*}}/Inputs/foo: ok
+	// CHECK: {{.*}}/Inputs/nonexistent: No such file or directory
+	// CHECK: {{.*}}/Inputs/baz/wibble: ok
+	// CHECK: {{.*}}/Inputs/foo/bar/hi.txt: Not a directory
+	for (i = 0; i < n; i++) {
+		printf("%s: %s\n", manifest[i].path,
+			manifest[i].fd == -1 ? strerror(manifest[i].error)
+				: "ok");
+	}
+
+	// CHECK: iterated over 2 entries
+	printf("iterated over %zu entries\n",
+		po_map_foreach(map, po_print_entry));
+
+	// CHECK: found hi.txt: yes
+	rel = po_find(map, TEST_DIR("/foo/bar/hi.txt"), NULL);
+	printf("found hi.txt: %s\n", rel.dirfd == manifest[0].fd ? "yes" : "no");
+
+	// Entries that can't be added report why.
+	// CHECK: frozen: -1, Operation not permitted
+	assert(po_map_freeze(map) == 0);
+	manifest[1].path = TEST_DIR("/baz");
+	result = po_preopen_manifest(map, manifest + 1, 1, 1);
+	printf("frozen: %d, %s\n", result, strerror(manifest[1].error));
+
+	po_map_release(map);
+
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *base, *overlay;
+	int foo, foobar, wibble;
+
+	base = po_map_create(4);
+
+	// CHECK: foo: [[FOO:[0-9]+]]
+	foo = openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY | O_DIRECTORY);
+	printf("foo: %d\n", foo);
+	assert(foo != -1);
+	po_add(base, "/foo", foo);
+
+	// CHECK: wibble: [[WIBBLE:[0-9]+]]
+	wibble = openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	printf("wibble: %d\n", wibble);
+	assert(wibble != -1);
+	po_add(base, "/wibble", wibble);
+
+	overlay = po_map_overlay(base, 1);
+	assert(overlay != NULL);
+
+	// CHECK: foobar: [[FOOBAR:[0-9]+]]
+	foobar = openat(AT_FDCWD, TEST_DIR("/foo/bar"), O_DIRECTORY);
+	printf("foobar: %d\n", foobar);
+	assert(foobar != -1);
+	po_add(overlay, "/foo/bar", foobar);
+
+	// Overlay entries shadow the base on a tie:
+	po_add(overlay, "/wibble", foo);
+
+	// CHECK: /foo/bar/hi.txt -> [[FOOBAR]]:hi.txt
+	find("/foo/bar/hi.txt", overlay);
+
+	// CHECK: /foo/baz -> [[FOO]]:baz
+	find("/foo/baz", overlay);
+
+	// CHECK: /wibble/bye.txt -> [[FOO]]:bye.txt
+	find("/wibble/bye.txt", overlay);
+
+	// The base map doesn't see the overlay's entries:
+	// CHECK: /foo/bar/hi.txt -> [[FOO]]:bar/hi.txt
+	find("/foo/bar/hi.txt", base);
+
+	// CHECK: /wibble/bye.txt -> [[WIBBLE]]:bye.txt
+	find("/wibble/bye.txt", base);
+
+	// CHECK: iterated over 4 entries
+	printf("iterated over %zu entries\n",
+		po_map_foreach(overlay, po_print_entry));
+
+	// The overlay holds a reference to its base.
+	po_map_release(base);
+
+	// CHECK: /foo/baz -> [[FOO]]:baz
+	find("/foo/baz", overlay);
+
+	po_map_release(overlay);
+
+	return 0;
+}
+
+static void
+find(const char *absolute, struct po_map *map)
+{
+	struct po_relpath rel = po_find(map, absolute, NULL);
+	printf("%s -> %d:%s\n", absolute, rel.dirfd, rel.relative_path);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void	add(struct po_map *, const char *name);
+static void	find(struct po_map *, const char *path);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *attached, *map, *unpacked;
+	int shmfd;
+
+	map = po_map_create(8);
+
+	// CHECK: /srv/tenants: [[TENANTS:[0-9]+]]
+	add(map, "/srv/tenants");
+	// CHECK: /srv/tenants/0001/data: [[DATA1:[0-9]+]]
+	add(map, "/srv/tenants/0001/data");
+	// CHECK: /srv/tenants/0001/logs: [[LOGS1:[0-9]+]]
+	add(map, "/srv/tenants/0001/logs");
+	// CHECK: /srv/tenants/0002/data: [[DATA2:[0-9]+]]
+	add(map, "/srv/tenants/0002/data");
+	// CHECK: /srv/tenants/0002/data/cache: [[CACHE2:[0-9]+]]
+	add(map, "/srv/tenants/0002/data/cache");
+	// CHECK: /srv/other: [[OTHER:[0-9]+]]
+	add(map, "/srv/other");
+
+	// CHECK: unknown flags: -1
+	printf("unknown flags: %d\n", po_pack_flags(map, 0x80));
+
+	shmfd = po_pack_flags(map, PO_PACK_FRONT_CODED);
+	assert(shmfd != -1);
+
+	attached = po_attach(shmfd, -1, SIZE_MAX);
+	assert(attached != NULL);
+
+	// CHECK: /srv/tenants/0001/data/x -> [[DATA1]]:x
+	find(attached, "/srv/tenants/0001/data/x");
+	// CHECK: /srv/tenants/0001/logs -> [[LOGS1]]:.
+	find(attached, "/srv/tenants/0001/logs");
+	// CHECK: /srv/tenants/0001/database -> [[TENANTS]]:0001/database
+	find(attached, "/srv/tenants/0001/database");
+	// CHECK: /srv/tenants/0002/data/cache/y -> [[CACHE2]]:y
+	find(attached, "/srv/tenants/0002/data/cache/y");
+	// CHECK: /srv/tenants/0002/data/z -> [[DATA2]]:z
+	find(attached, "/srv/tenants/0002/data/z");
+	// CHECK: /srv/other/w -> [[OTHER]]:w
+	find(attached, "/srv/other/w");
+	// CHECK: /srv/nothing -> -1
+	find(attached, "/srv/nothing");
+
+	// Updates continue to front-code new entries.
+	// CHECK: /srv/tenants/0003/data: [[DATA3:[0-9]+]]
+	add(map, "/srv/tenants/0003/data");
+	assert(po_pack_update(map, shmfd) == 0);
+
+	// Maps attached after the update see the new entry.
+	// CHECK: /srv/tenants/0003/data/v -> [[DATA3]]:v
+	po_map_release(attached);
+	attached = po_attach(shmfd, -1, SIZE_MAX);
+	assert(attached != NULL);
+	find(attached, "/srv/tenants/0003/data/v");
+
+	// CHECK: unpacked:
+	// CHECK-NEXT: name: '/srv/tenants', fd: [[TENANTS]]
+	// CHECK-NEXT: name: '/srv/tenants/0001/data', fd: [[DATA1]]
+	// CHECK-NEXT: name: '/srv/tenants/0001/logs', fd: [[LOGS1]]
+	// CHECK-NEXT: name: '/srv/tenants/0002/data', fd: [[DATA2]]
+	// CHECK-NEXT: name: '/srv/tenants/0002/data/cache', fd: [[CACHE2]]
+	// CHECK-NEXT: name: '/srv/other', fd: [[OTHER]]
+	// CHECK-NEXT: name: '/srv/tenants/0003/data', fd: [[DATA3]]
+	unpacked = po_unpack(shmfd);
+	assert(unpacked != NULL);
+	printf("unpacked:\n");
+	po_map_foreach(unpacked, po_print_entry);
+
+	// CHECK: attached:
+	// CHECK-NEXT: name: '/srv/tenants', fd: [[TENANTS]]
+	// CHECK: name: '/srv/tenants/0003/data', fd: [[DATA3]]
+	printf("attached:\n");
+	po_map_foreach(attached, po_print_entry);
+
+	po_map_release(attached);
+	po_map_release(unpacked);
+	po_map_release(map);
+
+	return 0;
+}
+
+static void
+add(struct po_map *map, const char *name)
+{
+	int fd;
+
+	fd = openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY | O_DIRECTORY);
+	assert(fd != -1);
+	assert(po_add(map, name, fd) != NULL);
+
+	printf("%s: %d\n", name, fd);
+}
+
+static void
+find(struct po_map *map, const char *path)
+{
+	struct po_relpath rel = po_find_access(map, path, 0);
+
+	if (rel.dirfd == -1) {
+		printf("%s -> -1\n", path);
+		return;
+	}
+
+	printf("%s -> %d:%s\n", path, rel.dirfd, rel.relative_path);
+}
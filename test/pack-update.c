@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -I %p/../lib -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "internal.h"
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+int main(int argc, char *argv[])
+{
+	struct po_map *before, *after, *map;
+	struct po_packed_map *packed;
+	int foo, shmfd, wibble;
+
+	map = po_map_create(4);
+
+	// CHECK: foo: [[FOO:[0-9]+]]
+	foo = openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY);
+	printf("foo: %d\n", foo);
+	assert(foo != -1);
+	po_add(map, "foo", foo);
+
+	// CHECK: packed map into SHM [[SHMFD:[0-9]+]]
+	shmfd = po_pack(map);
+	printf("packed map into SHM %d\n", shmfd);
+	assert(shmfd != -1);
+
+	before = po_unpack(shmfd);
+	assert(before != NULL);
+
+	// CHECK: wibble: [[WIBBLE:[0-9]+]]
+	wibble = po_preopen(map, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	printf("wibble: %d\n", wibble);
+	assert(wibble != -1);
+
+	// CHECK: po_pack_update: 0
+	printf("po_pack_update: %d\n", po_pack_update(map, shmfd));
+
+	// An update with no new entries is a no-op:
+	// CHECK: po_pack_update: 0
+	printf("po_pack_update: %d\n", po_pack_update(map, shmfd));
+
+	// CHECK: contents after update:
+	// CHECK-NEXT: name: 'foo', fd: [[FOO]]
+	// CHECK-NEXT: name: '{{.*}}/Inputs/baz/wibble', fd: [[WIBBLE]]
+	after = po_unpack(shmfd);
+	assert(after != NULL);
+	printf("contents after update:\n");
+	po_map_foreach(after, po_print_entry);
+
+	// Maps unpacked before the update are unaffected:
+	// CHECK: contents before update:
+	// CHECK-NEXT: name: 'foo', fd: [[FOO]]
+	// CHECK-NOT: wibble
+	printf("contents before update:\n");
+	po_map_foreach(before, po_print_entry);
+
+	// A map that claims more entries than it holds isn't partially unpacked:
+	// CHECK: truncated: rejected
+	packed = mmap(NULL, sizeof(*packed), PROT_READ | PROT_WRITE,
+		MAP_SHARED, shmfd, 0);
+	assert(packed != MAP_FAILED);
+	atomic_fetch_add(&packed->count, 1);
+	printf("truncated: %s\n",
+		(po_unpack(shmfd) == NULL) ? "rejected" : "accepted");
+	munmap(packed, sizeof(*packed));
+
+	po_map_release(before);
+	po_map_release(after);
+	po_map_release(map);
+
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t %t.map > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map);
+static int resolve(const char *name);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *loaded, *map;
+	int fd;
+
+	if (argc < 2) {
+		errx(-1, "Usage: %s <map file>", argv[0]);
+	}
+
+	map = po_map_create(4);
+	po_add(map, "/foo", openat(AT_FDCWD, TEST_DIR("/foo"), O_DIRECTORY));
+	po_add(map, "/wibble",
+		openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY));
+	po_add(map, "/unresolved", openat(AT_FDCWD, TEST_DIR(""), O_DIRECTORY));
+
+	fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		err(-1, "failed to create '%s'", argv[1]);
+	}
+
+	// Saving again replaces the first copy rather than appending to it.
+	// CHECK: po_map_save: 0
+	// CHECK: po_map_save: 0
+	// CHECK: saved once: 1
+	printf("po_map_save: %d\n", po_map_save(map, fd));
+	off_t size = lseek(fd, 0, SEEK_END);
+	printf("po_map_save: %d\n", po_map_save(map, fd));
+	printf("saved once: %d\n", lseek(fd, 0, SEEK_END) == size);
+	po_map_release(map);
+
+	// CHECK: resolving '/foo'
+	// CHECK: resolving '/wibble'
+	// CHECK: resolving '/unresolved'
+	loaded = po_map_load(fd, resolve);
+	assert(loaded != NULL);
+	close(fd);
+
+	// CHECK: /foo/bar/hi.txt -> {{[0-9]+}}:bar/hi.txt
+	find("/foo/bar/hi.txt", loaded);
+
+	// CHECK: /wibble/bye.txt -> {{[0-9]+}}:bye.txt
+	find("/wibble/bye.txt", loaded);
+
+	// CHECK: /unresolved/foo -> -1:
+	find("/unresolved/foo", loaded);
+
+	po_map_release(loaded);
+
+	return 0;
+}
+
+static int
+resolve(const char *name)
+{
+	printf("resolving '%s'\n", name);
+
+	if (strcmp(name, "/foo") == 0) {
+		return openat(AT_FDCWD, TEST_DIR("/foo"), O_DIRECTORY);
+	}
+
+	if (strcmp(name, "/wibble") == 0) {
+		return openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	}
+
+	return (-1);
+}
+
+static void
+find(const char *absolute, struct po_map *map)
+{
+	struct po_relpath rel = po_find(map, absolute, NULL);
+	printf("%s -> %d:%s\n", absolute, rel.dirfd, rel.relative_path);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static int	child(const char *private);
+static void	spawn(const char *argv0, struct po_map *);
+
+static int private_fd;
+
+
+int main(int argc, char *argv[])
+{
+	posix_spawn_file_actions_t actions;
+	int second, third;
+
+	if (argc > 1) {
+		return (child(argv[1]));
+	}
+
+	struct po_map *map = po_map_create(4);
+	int foo = openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY | O_CLOEXEC);
+	po_add(map, TEST_DIR("/foo"), foo);
+
+	// The child should inherit the map's descriptors even though they are
+	// close-on-exec, but not other close-on-exec descriptors.
+	private_fd = openat(AT_FDCWD, TEST_DIR("/baz"), O_RDONLY | O_CLOEXEC);
+
+	// CHECK: child: foo/bar/hi.txt: found
+	// CHECK: child: baz: not inherited
+	spawn(argv[0], map);
+
+	// Each child tries to overwrite its segment, which mustn't affect the
+	// segments that its siblings inherit.
+	// CHECK: child: foo/bar/hi.txt: found
+	// CHECK: child: baz: not inherited
+	spawn(argv[0], map);
+
+	// An overlay's child gets the entries of its base too.
+	// CHECK: child: foo/bar/hi.txt: found
+	// CHECK: child: baz: not inherited
+	struct po_map *overlay = po_map_overlay(map, 1);
+	spawn(argv[0], overlay);
+	po_map_release(overlay);
+
+	posix_spawn_file_actions_init(&actions);
+	second = po_spawn_file_actions(map, &actions);
+	posix_spawn_file_actions_destroy(&actions);
+
+	// Adding an entry means packing the map again.
+	po_add(map, TEST_DIR("/baz/wibble"),
+		openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_RDONLY));
+
+	posix_spawn_file_actions_init(&actions);
+	third = po_spawn_file_actions(map, &actions);
+	posix_spawn_file_actions_destroy(&actions);
+
+	// CHECK: changed: repacked
+	printf("changed: %s\n", third != -1 && third != second
+		? "repacked" : "same segment");
+
+	return 0;
+}
+
+static void
+spawn(const char *argv0, struct po_map *map)
+{
+	char fdstr[16];
+	char *argv[] = { (char*) argv0, fdstr, NULL };
+	pid_t pid;
+	int status;
+
+	snprintf(fdstr, sizeof(fdstr), "%d", private_fd);
+
+	fflush(stdout);
+	assert(po_spawn(&pid, argv0, map, NULL, argv, NULL) == 0);
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int
+child(const char *private)
+{
+	struct po_relpath rel;
+	struct po_map *map;
+	struct stat sb;
+	char *env;
+	void *p;
+	int fd;
+
+	env = getenv("SHARED_MEMORYFD");
+	assert(env != NULL);
+
+	map = po_unpack(atoi(env));
+	assert(map != NULL);
+
+	rel = po_find(map, TEST_DIR("/foo/bar/hi.txt"), NULL);
+	printf("child: foo/bar/hi.txt: %s\n",
+		rel.dirfd != -1 && faccessat(rel.dirfd, rel.relative_path,
+		R_OK, 0) == 0 ? "found" : "missing");
+
+	printf("child: baz: %s\n", fcntl(atoi(private), F_GETFD) == -1
+		? "not inherited" : "inherited");
+
+	// Try to change the map that later children will inherit.
+	fd = atoi(env);
+	assert(fstat(fd, &sb) == 0);
+	p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p != MAP_FAILED) {
+		memset(p, 0, sb.st_size);
+		munmap(p, sb.st_size);
+	}
+	(void) ftruncate(fd, 0);
+
+	return (0);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+void	po_set_libc_map(struct po_map *);
+
+static void	check(const char *what);
+
+static char path[64];
+
+
+int main(int argc, char *argv[])
+{
+	struct po_map *map;
+	char dir[] = "/tmp/po-stat-cache.XXXXXX";
+	int dirfd, fd;
+
+	assert(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/file", dir);
+
+	map = po_map_create(4);
+	dirfd = po_preopen(map, dir, O_DIRECTORY);
+	assert(dirfd != -1);
+	po_set_libc_map(map);
+
+	// CHECK: enable: 0
+	printf("enable: %d\n", po_stat_cache(60000));
+
+	// CHECK: missing: stat: [[ENOENT:.*]], access: [[ENOENT]]
+	check("missing");
+
+	// Changes made through the wrappers are seen immediately.
+	fd = open(path, O_CREAT | O_WRONLY, 0600);
+	assert(fd != -1);
+	assert(write(fd, "hello", 5) == 5);
+	close(fd);
+
+	// CHECK: created: stat: 5 bytes, access: ok
+	check("created");
+
+	// CHECK: repeated: stat: 5 bytes, access: ok
+	check("repeated");
+
+	assert(unlink(path) == 0);
+
+	// CHECK: unlinked: stat: [[ENOENT]], access: [[ENOENT]]
+	check("unlinked");
+
+	// Changes made behind the wrappers' backs are seen once the cached
+	// results are discarded: by the TTL, by a watcher or (so that this
+	// doesn't depend on timing) by calling po_stat_cache again.
+	// CHECK: cached: stat: [[ENOENT]], access: [[ENOENT]]
+	check("cached");
+
+	fd = openat(dirfd, "file", O_CREAT | O_WRONLY, 0600);
+	assert(fd != -1);
+	close(fd);
+
+	// CHECK: discard: 0
+	printf("discard: %d\n", po_stat_cache(60000));
+
+	// CHECK: discarded: stat: 0 bytes, access: ok
+	check("discarded");
+
+	// CHECK: disable: 0
+	printf("disable: %d\n", po_stat_cache(0));
+
+	unlinkat(dirfd, "file", 0);
+
+	// CHECK: disabled: stat: [[ENOENT]], access: [[ENOENT]]
+	check("disabled");
+
+	rmdir(dir);
+
+	return 0;
+}
+
+static void
+check(const char *what)
+{
+	struct stat sb;
+	int error;
+
+	printf("%s: stat: ", what);
+	if (stat(path, &sb) == 0) {
+		printf("%jd bytes", (intmax_t) sb.st_size);
+	} else {
+		printf("%s", strerror(errno));
+	}
+
+	error = (access(path, R_OK) == 0) ? 0 : errno;
+	printf(", access: %s\n", error == 0 ? "ok" : strerror(error));
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -I %p/../lib -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static uint64_t	sum_lookups(const struct po_stats_segment *,
+	enum po_trace_call, uint64_t *hits);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_stats_segment *seg;
+	struct po_map *map;
+	struct stat sb;
+	char fdstr[16];
+	uint64_t hits, lookups, total;
+	pid_t child;
+	int fd, foo;
+
+	fd = po_stats_create(NULL);
+	assert(fd >= 0);
+
+	seg = mmap(0, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	assert(seg != MAP_FAILED);
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv("PO_STATS_FD", fdstr, 1);
+
+	map = po_map_create(4);
+	foo = po_preopen(map, TEST_DIR("/foo"), O_DIRECTORY);
+	assert(foo != -1);
+	po_set_libc_map(map);
+
+	// Count lookups in this process and in a child, which uses another
+	// stripe of the segment.
+	child = fork();
+	assert(child != -1);
+
+	fd = open(TEST_DIR("/foo/bar/hi.txt"), O_RDONLY);
+	assert(fd >= 0);
+	close(fd);
+	stat(TEST_DIR("/foo/bar"), &sb);
+	stat("/nonexistent/file", &sb);
+
+	if (child == 0) {
+		_exit(0);
+	}
+	waitpid(child, NULL, 0);
+
+	// CHECK: processes: 2
+	printf("processes: %" PRIu32 "\n", atomic_load(&seg->processes));
+
+	// CHECK: open: 2 lookups, 2 hits
+	lookups = sum_lookups(seg, PO_TRACE_OPEN, &hits);
+	printf("open: %" PRIu64 " lookups, %" PRIu64 " hits\n", lookups, hits);
+
+	// CHECK: stat: 4 lookups, 2 hits
+	lookups = sum_lookups(seg, PO_TRACE_STAT, &hits);
+	printf("stat: %" PRIu64 " lookups, %" PRIu64 " hits\n", lookups, hits);
+
+	// CHECK: {{.*}}/Inputs/foo: 4 hits
+	for (unsigned int e = 0; e < PO_STATS_ENTRIES; e++) {
+		if (atomic_load(&seg->entries[e].hash) == 0) {
+			continue;
+		}
+
+		total = 0;
+		for (unsigned int s = 0; s < PO_STATS_STRIPES; s++) {
+			total += atomic_load(&seg->entries[e].hits[s].value);
+		}
+
+		printf("%s: %" PRIu64 " hits\n", seg->entries[e].name, total);
+	}
+
+	return 0;
+}
+
+static uint64_t
+sum_lookups(const struct po_stats_segment *seg, enum po_trace_call call,
+	uint64_t *hits)
+{
+	uint64_t lookups = 0;
+
+	*hits = 0;
+	for (unsigned int s = 0; s < PO_STATS_STRIPES; s++) {
+		lookups += atomic_load(&seg->calls[s][call].lookups);
+		*hits += atomic_load(&seg->calls[s][call].hits);
+	}
+
+	return (lookups);
+}
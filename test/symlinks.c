@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+void	po_set_libc_map(struct po_map *);
+
+static void	make_file(int dirfd, const char *path, const char *contents);
+static void	show(const char *path);
+
+
+int main(int argc, char *argv[])
+{
+	char app[] = "/tmp/po-symlinks-app.XXXXXX";
+	char data[] = "/tmp/po-symlinks-data.XXXXXX";
+	struct po_map *map;
+	struct stat sb;
+	int appfd, datafd;
+
+	assert(mkdtemp(app) != NULL);
+	assert(mkdtemp(data) != NULL);
+
+	appfd = open(app, O_DIRECTORY);
+	datafd = open(data, O_DIRECTORY);
+	assert(appfd != -1 && datafd != -1);
+
+	// A deployment-style tree: current -> releases/1, plus an absolute
+	// link to another pre-opened directory.
+	assert(mkdirat(appfd, "releases", 0700) == 0);
+	assert(mkdirat(appfd, "releases/1", 0700) == 0);
+	assert(mkdirat(appfd, "releases/2", 0700) == 0);
+	make_file(appfd, "releases/1/version", "1");
+	make_file(appfd, "releases/2/version", "2");
+	assert(symlinkat("releases/1", appfd, "current") == 0);
+	assert(symlinkat("current", appfd, "latest") == 0);
+	assert(symlinkat("/data/shared", appfd, "shared") == 0);
+	assert(mkdirat(datafd, "shared", 0700) == 0);
+	make_file(datafd, "shared/config", "shared");
+
+	map = po_map_create(4);
+	po_add(map, "/app", appfd);
+	po_add(map, "/data", datafd);
+	po_set_libc_map(map);
+
+	// CHECK: /app/current/version: 1
+	show("/app/current/version");
+
+	// Without user-space resolution, the absolute target escapes:
+	// CHECK: /app/shared/config: {{.*}}
+	// CHECK-NOT: /app/shared/config: shared
+	show("/app/shared/config");
+
+	assert(po_stat_cache(60000) == 0);
+	po_resolve_symlinks(true);
+
+	// CHECK: /app/shared/config: shared
+	show("/app/shared/config");
+
+	// CHECK: /app/current/version: 1
+	show("/app/current/version");
+
+	// CHECK: /app/releases/../shared/config: shared
+	show("/app/releases/../shared/config");
+
+	// ".." after a link is relative to where the link (eventually) leads:
+	// CHECK: /app/latest/../2/version: 2
+	show("/app/latest/../2/version");
+
+	// lstat doesn't follow the last link...
+	// CHECK: lstat: link 1
+	assert(lstat("/app/current", &sb) == 0);
+	printf("lstat: link %d\n", S_ISLNK(sb.st_mode));
+
+	// ... but stat does.
+	// CHECK: stat: dir 1
+	assert(stat("/app/shared", &sb) == 0);
+	printf("stat: dir %d\n", S_ISDIR(sb.st_mode));
+
+	// Replacing the link through the wrappers discards its cached target.
+	assert(symlinkat("releases/2", appfd, "current.new") == 0);
+	assert(rename("/app/current.new", "/app/current") == 0);
+
+	// CHECK: /app/current/version: 2
+	show("/app/current/version");
+
+	unlinkat(appfd, "current", 0);
+	unlinkat(appfd, "latest", 0);
+	unlinkat(appfd, "shared", 0);
+	unlinkat(appfd, "releases/1/version", 0);
+	unlinkat(appfd, "releases/2/version", 0);
+	unlinkat(appfd, "releases/1", AT_REMOVEDIR);
+	unlinkat(appfd, "releases/2", AT_REMOVEDIR);
+	unlinkat(appfd, "releases", AT_REMOVEDIR);
+	unlinkat(datafd, "shared/config", 0);
+	unlinkat(datafd, "shared", AT_REMOVEDIR);
+	rmdir(app);
+	rmdir(data);
+
+	return 0;
+}
+
+static void
+make_file(int dirfd, const char *path, const char *contents)
+{
+	int fd;
+
+	fd = openat(dirfd, path, O_CREAT | O_WRONLY, 0600);
+	assert(fd != -1);
+	assert(write(fd, contents, strlen(contents)) == (ssize_t) strlen(contents));
+	close(fd);
+}
+
+static void
+show(const char *path)
+{
+	char buffer[16];
+	ssize_t len;
+	int fd;
+
+	printf("%s: ", path);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		printf("%s\n", strerror(errno));
+		return;
+	}
+
+	len = read(fd, buffer, sizeof(buffer) - 1);
+	buffer[len < 0 ? 0 : len] = '\0';
+	printf("%s\n", buffer);
+	close(fd);
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -lpthread -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static void	try_open(const char *who, const char *path);
+static void*	tenant_thread(void *);
+
+static struct po_map *global;
+static struct po_map *tenant;
+
+
+int main(int argc, char *argv[])
+{
+	pthread_t thread;
+
+	// Neither /global nor /tenant exist, so they can only be opened via
+	// the maps that name them.
+	global = po_map_create(4);
+	po_add(global, "/global", openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY));
+	po_set_libc_map(global);
+
+	tenant = po_map_create(4);
+	po_add(tenant, "/tenant", openat(AT_FDCWD, TEST_DIR("/foo"), O_RDONLY));
+
+	// CHECK: main: /global/bar/hi.txt: ok
+	// CHECK: main: /tenant/bar/hi.txt: failed
+	try_open("main", "/global/bar/hi.txt");
+	try_open("main", "/tenant/bar/hi.txt");
+
+	pthread_create(&thread, NULL, tenant_thread, NULL);
+	pthread_join(thread, NULL);
+
+	// The thread's maps never affected this thread (these are checked
+	// after the thread's own output, at the end of tenant_thread).
+	try_open("main again", "/global/bar/hi.txt");
+	try_open("main again", "/tenant/bar/hi.txt");
+
+	return 0;
+}
+
+static void*
+tenant_thread(void *arg)
+{
+	// CHECK: tenant: /global/bar/hi.txt: failed
+	// CHECK: tenant: /tenant/bar/hi.txt: ok
+	assert(po_push_thread_map(tenant) == 0);
+	try_open("tenant", "/global/bar/hi.txt");
+	try_open("tenant", "/tenant/bar/hi.txt");
+
+	// CHECK: overlay: /global/bar/hi.txt: ok
+	// CHECK: overlay: /tenant/bar/hi.txt: failed
+	struct po_map *overlay = po_map_overlay(global, 4);
+	assert(po_push_thread_map(overlay) == 0);
+	po_map_release(overlay);
+	try_open("overlay", "/global/bar/hi.txt");
+	try_open("overlay", "/tenant/bar/hi.txt");
+
+	// CHECK: popped: /global/bar/hi.txt: failed
+	// CHECK: popped: /tenant/bar/hi.txt: ok
+	assert(po_pop_thread_map() == 0);
+	try_open("popped", "/global/bar/hi.txt");
+	try_open("popped", "/tenant/bar/hi.txt");
+
+	// CHECK: empty: /global/bar/hi.txt: ok
+	// CHECK: extra pop: -1
+	assert(po_pop_thread_map() == 0);
+	try_open("empty", "/global/bar/hi.txt");
+	printf("extra pop: %d\n", po_pop_thread_map());
+
+	// Back in main, after the join:
+	// CHECK: main again: /global/bar/hi.txt: ok
+	// CHECK: main again: /tenant/bar/hi.txt: failed
+
+	return (NULL);
+}
+
+static void
+try_open(const char *who, const char *path)
+{
+	int fd = open(path, O_RDONLY);
+
+	printf("%s: %s: %s\n", who, path, fd >= 0 ? "ok" : "failed");
+
+	if (fd >= 0) {
+		close(fd);
+	}
+}
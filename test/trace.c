@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -I %p/../lib -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -lpthread -o %t
+ * RUN: %p/run-with-preload %lib %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+static void*	lookup_thread(void *);
+
+
+int main(int argc, char *argv[])
+{
+	struct po_trace_segment *seg;
+	struct po_trace_ring *ring;
+	struct po_trace_record *r;
+	struct stat sb;
+	char fdstr[16];
+	size_t size;
+	int fd, foo;
+
+	// Set up a trace segment that records every other lookup.
+	size = po_trace_size(2, 8);
+	fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+	assert(fd >= 0);
+	assert(ftruncate(fd, size) == 0);
+
+	seg = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(seg != MAP_FAILED);
+
+	seg->magic = PO_TRACE_MAGIC;
+	seg->version = PO_TRACE_VERSION;
+	seg->period = 2;
+	seg->nrings = 2;
+	seg->slots = 8;
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv("PO_TRACE_FD", fdstr, 1);
+
+	struct po_map *map = po_map_create(4);
+	foo = po_preopen(map, TEST_DIR("/foo"), O_DIRECTORY);
+	assert(foo != -1);
+	po_set_libc_map(map);
+
+	fd = open(TEST_DIR("/foo/bar/hi.txt"), O_RDONLY);
+	assert(fd >= 0);
+	close(fd);
+	stat(TEST_DIR("/foo/bar"), &sb);
+	stat("/nonexistent/file", &sb);
+	access(TEST_DIR("/foo/bar/hi.txt"), R_OK);
+
+	// CHECK: claimed: 1
+	printf("claimed: %u\n", atomic_load(&seg->claimed));
+
+	ring = po_trace_ring_at(seg, 0);
+
+	// CHECK: records: 2
+	printf("records: %u\n", (unsigned int) atomic_load(&ring->head));
+
+	// CHECK: pid: ok
+	printf("pid: %s\n", ring->pid == getpid() ? "ok" : "wrong");
+
+	// CHECK: [0] call: open
+	// CHECK: [0] entry: foo
+	// CHECK: [0] matched: foo/
+	r = ring->records + 0;
+	printf("[0] call: %s\n", r->call == PO_TRACE_OPEN ? "open" : "other");
+	printf("[0] entry: %s\n", r->entry == foo ? "foo" : "other");
+	printf("[0] matched: %s\n",
+		r->matchlen == strlen(TEST_DIR("/foo/")) ? "foo/" : "other");
+
+	// CHECK: [1] call: stat
+	// CHECK: [1] entry: -1
+	// CHECK: [1] matched: 0
+	// CHECK: [1] later: yes
+	r = ring->records + 1;
+	printf("[1] call: %s\n", r->call == PO_TRACE_STAT ? "stat" : "other");
+	printf("[1] entry: %d\n", r->entry);
+	printf("[1] matched: %u\n", r->matchlen);
+	printf("[1] later: %s\n",
+		r->timestamp >= ring->records[0].timestamp ? "yes" : "no");
+
+	// Threads release their rings when they exit, so more threads than
+	// rings can record as long as they don't all run at once.
+	for (int i = 0; i < 3; i++) {
+		pthread_t thread;
+
+		assert(pthread_create(&thread, NULL, lookup_thread, NULL) == 0);
+		assert(pthread_join(thread, NULL) == 0);
+	}
+
+	// CHECK: unclaimed: 0
+	// CHECK: second ring: 3 records
+	printf("unclaimed: %u\n", (unsigned int) atomic_load(&seg->unclaimed));
+	printf("second ring: %u records\n",
+		(unsigned int) atomic_load(&po_trace_ring_at(seg, 1)->head));
+
+	return 0;
+}
+
+static void*
+lookup_thread(void *arg)
+{
+	struct stat sb;
+
+	// A new thread records its first lookup.
+	stat(TEST_DIR("/foo/bar"), &sb);
+
+	return (NULL);
+}
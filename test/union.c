@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * RUN: %cc -c %cflags -D TEST_DATA_DIR="\"%p/Inputs\"" %s -o %t.o
+ * RUN: %cc %t.o %ldflags -o %t
+ * RUN: %t > %t.out
+ * RUN: %filecheck %s -input-file %t.out
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libpreopen.h"
+
+#define TEST_DIR(name) \
+	TEST_DATA_DIR name
+
+
+static void find(const char *absolute, struct po_map *map);
+
+int main(int argc, char *argv[])
+{
+	struct po_map *map;
+	int layers[2];
+
+	map = po_map_create(4);
+
+	// CHECK: upper: [[UPPER:[0-9]+]]
+	layers[0] = openat(AT_FDCWD, TEST_DIR("/foo/bar"), O_DIRECTORY);
+	printf("upper: %d\n", layers[0]);
+	assert(layers[0] != -1);
+
+	// CHECK: lower: [[LOWER:[0-9]+]]
+	layers[1] = openat(AT_FDCWD, TEST_DIR("/baz/wibble"), O_DIRECTORY);
+	printf("lower: %d\n", layers[1]);
+	assert(layers[1] != -1);
+
+	assert(po_add_union(map, "/lib", layers, 2) == map);
+
+	// CHECK: /lib/hi.txt -> [[UPPER]]:hi.txt
+	find("/lib/hi.txt", map);
+
+	// A miss in the first directory falls through to the next:
+	// CHECK: /lib/bye.txt -> [[LOWER]]:bye.txt
+	find("/lib/bye.txt", map);
+
+	// ... and the second lookup comes from the cache.
+	// CHECK: /lib/bye.txt -> [[LOWER]]:bye.txt
+	find("/lib/bye.txt", map);
+
+	// Paths that don't exist anywhere (e.g., new files) belong to the first:
+	// CHECK: /lib/new.txt -> [[UPPER]]:new.txt
+	find("/lib/new.txt", map);
+
+	// CHECK: /lib -> [[UPPER]]:.
+	find("/lib", map);
+
+	// Plain lookups only see the first directory.
+	// CHECK: po_find: [[UPPER]]:bye.txt
+	struct po_relpath rel = po_find_access(map, "/lib/bye.txt", 0);
+	printf("po_find: %d:%s\n", rel.dirfd, rel.relative_path);
+
+	// CHECK: iterated over 2 entries
+	printf("iterated over %zu entries\n",
+		po_map_foreach(map, po_print_entry));
+
+	// Packed maps can't represent unions.
+	// CHECK: po_pack: -1
+	printf("po_pack: %d\n", po_pack(map));
+
+	po_map_release(map);
+
+	return 0;
+}
+
+static void
+find(const char *absolute, struct po_map *map)
+{
+	struct po_relpath rel = po_find_existing(map, absolute, 0);
+	printf("%s -> %d:%s\n", absolute, rel.dirfd, rel.relative_path);
+}
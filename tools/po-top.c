@@ -0,0 +1,301 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/**
+ * @file   po-top.c
+ * @brief  Display live lookup statistics for a tree of processes.
+ *
+ * po-top either runs a command with a new statistics segment (passed to it
+ * via `PO_STATS_FD`) or attaches to a named segment created by a supervisor
+ * with `po_stats_create`. Every interval, it shows the rate of lookups made
+ * by all of the processes sharing the segment, the proportion that found a
+ * pre-opened directory, the busiest wrappers and the hottest directories.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+/**
+ * A snapshot of a statistics segment's counters (summed over stripes).
+ */
+struct snapshot {
+	uint64_t lookups[PO_TRACE_CALLS];
+	uint64_t hits[PO_TRACE_CALLS];
+	uint64_t entries[PO_STATS_ENTRIES];
+};
+
+static const char *call_names[PO_TRACE_CALLS] = {
+	[PO_TRACE_OPEN] = "open",
+	[PO_TRACE_ACCESS] = "access",
+	[PO_TRACE_CHDIR] = "chdir",
+	[PO_TRACE_CONNECT] = "connect",
+	[PO_TRACE_EACCESS] = "eaccess",
+	[PO_TRACE_LSTAT] = "lstat",
+	[PO_TRACE_RENAME] = "rename",
+	[PO_TRACE_STAT] = "stat",
+	[PO_TRACE_UNLINK] = "unlink",
+	[PO_TRACE_DLOPEN] = "dlopen",
+	[PO_TRACE_OPENDIR] = "opendir",
+	[PO_TRACE_SCANDIR] = "scandir",
+	[PO_TRACE_NFTW] = "nftw",
+	[PO_TRACE_EXEC] = "exec",
+};
+
+static void	usage(const char *argv0);
+static void	take_snapshot(const struct po_stats_segment *, struct snapshot *);
+static void	display(FILE *, const struct po_stats_segment *,
+	const struct snapshot *before, const struct snapshot *after,
+	double seconds, unsigned long top);
+
+
+int
+main(int argc, char *argv[])
+{
+	struct po_stats_segment *seg;
+	struct snapshot before, after;
+	struct timespec interval;
+	const char *name = NULL;
+	char fdstr[16];
+	unsigned long ms = 1000, top = 10;
+	pid_t child = -1;
+	int ch, fd, status = 0;
+	bool running;
+
+	while ((ch = getopt(argc, argv, "a:i:n:")) != -1) {
+		switch (ch) {
+		case 'a':
+			name = optarg;
+			break;
+
+		case 'i':
+			ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			top = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (ms == 0 || (name == NULL) == (optind == argc)) {
+		usage(argv[0]);
+	}
+
+	if (name != NULL) {
+		fd = shm_open(name, O_RDONLY, 0);
+		if (fd == -1) {
+			perror(name);
+			return (1);
+		}
+	} else {
+		fd = po_stats_create(NULL);
+		if (fd == -1) {
+			fprintf(stderr, "po-top: %s\n", po_last_error());
+			return (1);
+		}
+	}
+
+	seg = mmap(0, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		perror("failed to map statistics segment");
+		return (1);
+	}
+
+	if (seg->magic != PO_STATS_MAGIC || seg->version != PO_STATS_VERSION) {
+		fprintf(stderr, "po-top: not a statistics segment\n");
+		return (1);
+	}
+
+	if (name == NULL) {
+		// The command (and its children) need to inherit the segment.
+		if (fcntl(fd, F_SETFD, 0) != 0) {
+			perror("fcntl");
+			return (1);
+		}
+
+		snprintf(fdstr, sizeof(fdstr), "%d", fd);
+		setenv("PO_STATS_FD", fdstr, 1);
+
+		child = fork();
+		if (child < 0) {
+			perror("fork");
+			return (1);
+		}
+
+		if (child == 0) {
+			execvp(argv[optind], argv + optind);
+			perror(argv[optind]);
+			_exit(127);
+		}
+
+		close(fd);
+	}
+
+	interval.tv_sec = ms / 1000;
+	interval.tv_nsec = (ms % 1000) * 1000000;
+
+	take_snapshot(seg, &before);
+
+	do {
+		nanosleep(&interval, NULL);
+
+		running = (child == -1 || waitpid(child, &status, WNOHANG) == 0);
+
+		take_snapshot(seg, &after);
+		display(stdout, seg, &before, &after, ms / 1000.0, top);
+		before = after;
+	} while (running);
+
+	if (WIFSIGNALED(status)) {
+		return (128 + WTERMSIG(status));
+	}
+
+	return (WEXITSTATUS(status));
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage:  %s [-i interval-ms] [-n top]"
+		" (-a shm-name | [--] command [args...])\n", argv0);
+	exit(1);
+}
+
+static void
+take_snapshot(const struct po_stats_segment *seg, struct snapshot *snap)
+{
+	const struct po_stats_call *call;
+
+	memset(snap, 0, sizeof(*snap));
+
+	for (unsigned int s = 0; s < PO_STATS_STRIPES; s++) {
+		for (unsigned int c = 0; c < PO_TRACE_CALLS; c++) {
+			call = &seg->calls[s][c];
+			snap->lookups[c] += atomic_load_explicit(&call->lookups,
+				memory_order_relaxed);
+			snap->hits[c] += atomic_load_explicit(&call->hits,
+				memory_order_relaxed);
+		}
+
+		for (unsigned int e = 0; e < PO_STATS_ENTRIES; e++) {
+			snap->entries[e] += atomic_load_explicit(
+				&seg->entries[e].hits[s].value,
+				memory_order_relaxed);
+		}
+	}
+}
+
+static void
+display(FILE *out, const struct po_stats_segment *seg,
+	const struct snapshot *before, const struct snapshot *after,
+	double seconds, unsigned long top)
+{
+	uint64_t delta[PO_STATS_ENTRIES], lookups = 0, hits = 0, total;
+	unsigned int best;
+	bool shown[PO_STATS_ENTRIES] = { false };
+
+	for (unsigned int c = 0; c < PO_TRACE_CALLS; c++) {
+		lookups += after->lookups[c] - before->lookups[c];
+		hits += after->hits[c] - before->hits[c];
+	}
+
+	if (isatty(fileno(out))) {
+		fprintf(out, "\033[H\033[2J");
+	}
+
+	fprintf(out, "processes: %" PRIu32 "  lookups/s: %.0f  hit ratio: %.1f%%"
+		"  unclaimed hits: %" PRIu64 "\n\n",
+		atomic_load_explicit(&seg->processes, memory_order_relaxed),
+		lookups / seconds, lookups ? 100.0 * hits / lookups : 0.0,
+		atomic_load_explicit(&seg->unclaimed, memory_order_relaxed));
+
+	fprintf(out, "%-10s %12s %12s %8s\n", "wrapper", "lookups/s", "total",
+		"hits");
+	for (unsigned int c = 0; c < PO_TRACE_CALLS; c++) {
+		if (after->lookups[c] == 0) {
+			continue;
+		}
+
+		total = after->lookups[c];
+		fprintf(out, "%-10s %12.0f %12" PRIu64 " %7.1f%%\n",
+			call_names[c] ? call_names[c] : "?",
+			(after->lookups[c] - before->lookups[c]) / seconds,
+			total, 100.0 * after->hits[c] / total);
+	}
+
+	for (unsigned int e = 0; e < PO_STATS_ENTRIES; e++) {
+		delta[e] = after->entries[e] - before->entries[e];
+	}
+
+	fprintf(out, "\n%12s %12s  %s\n", "hits/s", "total", "directory");
+	for (unsigned long n = 0; n < top; n++) {
+		best = PO_STATS_ENTRIES;
+		for (unsigned int e = 0; e < PO_STATS_ENTRIES; e++) {
+			if (shown[e] || after->entries[e] == 0) {
+				continue;
+			}
+
+			if (best == PO_STATS_ENTRIES || delta[e] > delta[best]
+			    || (delta[e] == delta[best]
+			    && after->entries[e] > after->entries[best])) {
+				best = e;
+			}
+		}
+
+		if (best == PO_STATS_ENTRIES) {
+			break;
+		}
+
+		shown[best] = true;
+		fprintf(out, "%12.0f %12" PRIu64 "  %.*s\n", delta[best] / seconds,
+			after->entries[best], PO_STATS_NAMELEN,
+			seg->entries[best].name);
+	}
+
+	fprintf(out, "\n");
+	fflush(out);
+}
@@ -0,0 +1,247 @@
+/*-
+ * Copyright (c) 2018 Jonathan Anderson
+ * All rights reserved.
+ *
+ * This software was developed at Memorial University under the
+ * NSERC Discovery program (RGPIN-2015-06048).
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/**
+ * @file   po-trace.c
+ * @brief  Run a command with sampled lookup tracing and drain the trace.
+ *
+ * po-trace creates a trace segment, passes it to a command via `PO_TRACE_FD`
+ * and periodically drains the records that libpreopen's libc wrappers write
+ * into it. Each record is printed on its own line:
+ *
+ *     timestamp pid ring call hash entry matchlen
+ *
+ * where `hash` is a hash of the looked-up path, `entry` is the descriptor
+ * of the directory that it was resolved against (-1 for a miss) and
+ * `matchlen` is the length of the path prefix that the entry matched.
+ */
+
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "internal.h"
+
+static const char *call_names[PO_TRACE_CALLS] = {
+	[PO_TRACE_OPEN] = "open",
+	[PO_TRACE_ACCESS] = "access",
+	[PO_TRACE_CHDIR] = "chdir",
+	[PO_TRACE_CONNECT] = "connect",
+	[PO_TRACE_EACCESS] = "eaccess",
+	[PO_TRACE_LSTAT] = "lstat",
+	[PO_TRACE_RENAME] = "rename",
+	[PO_TRACE_STAT] = "stat",
+	[PO_TRACE_UNLINK] = "unlink",
+	[PO_TRACE_DLOPEN] = "dlopen",
+	[PO_TRACE_OPENDIR] = "opendir",
+	[PO_TRACE_SCANDIR] = "scandir",
+	[PO_TRACE_NFTW] = "nftw",
+	[PO_TRACE_EXEC] = "exec",
+};
+
+static void	usage(const char *argv0);
+static size_t	drain(struct po_trace_segment *, FILE *);
+
+
+int
+main(int argc, char *argv[])
+{
+	struct po_trace_segment *seg;
+	struct po_trace_ring *ring;
+	struct timespec interval;
+	FILE *out = stdout;
+	char fdstr[16];
+	size_t size, records = 0;
+	uint64_t dropped = 0;
+	unsigned long period = 100, nrings = 64, slots = 4096, ms = 100;
+	pid_t child;
+	int ch, fd, status;
+
+	while ((ch = getopt(argc, argv, "i:n:o:r:s:")) != -1) {
+		switch (ch) {
+		case 'i':
+			ms = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'n':
+			period = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) {
+				perror(optarg);
+				return (1);
+			}
+			break;
+
+		case 'r':
+			nrings = strtoul(optarg, NULL, 10);
+			break;
+
+		case 's':
+			slots = strtoul(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind == argc || period == 0 || period > UINT32_MAX
+	    || nrings == 0 || nrings > UINT16_MAX || slots == 0
+	    || slots > (1 << 24) || (slots & (slots - 1)) != 0) {
+		usage(argv[0]);
+	}
+
+	size = po_trace_size(nrings, slots);
+
+	fd = shm_open(SHM_ANON, O_CREAT | O_RDWR, 0600);
+	if (fd < 0 || ftruncate(fd, size) != 0) {
+		perror("failed to create trace segment");
+		return (1);
+	}
+
+	seg = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (seg == MAP_FAILED) {
+		perror("failed to map trace segment");
+		return (1);
+	}
+
+	seg->magic = PO_TRACE_MAGIC;
+	seg->version = PO_TRACE_VERSION;
+	seg->period = period;
+	seg->nrings = nrings;
+	seg->slots = slots;
+
+	// The traced command needs to inherit the segment.
+	if (fcntl(fd, F_SETFD, 0) != 0) {
+		perror("fcntl");
+		return (1);
+	}
+
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	setenv("PO_TRACE_FD", fdstr, 1);
+
+	child = fork();
+	if (child < 0) {
+		perror("fork");
+		return (1);
+	}
+
+	if (child == 0) {
+		execvp(argv[optind], argv + optind);
+		perror(argv[optind]);
+		_exit(127);
+	}
+
+	close(fd);
+
+	interval.tv_sec = ms / 1000;
+	interval.tv_nsec = (ms % 1000) * 1000000;
+
+	fprintf(out, "# timestamp pid ring call hash entry matchlen\n");
+
+	while (waitpid(child, &status, WNOHANG) == 0) {
+		records += drain(seg, out);
+		nanosleep(&interval, NULL);
+	}
+
+	records += drain(seg, out);
+
+	for (uint32_t i = 0; i < MIN(seg->claimed, seg->nrings); i++) {
+		ring = po_trace_ring_at(seg, i);
+		dropped += atomic_load(&ring->dropped);
+	}
+
+	fprintf(stderr, "po-trace: %zu records, %" PRIu64 " dropped (ring full),"
+		" %" PRIu64 " dropped (no ring)\n", records, dropped,
+		atomic_load(&seg->unclaimed));
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	if (WIFSIGNALED(status)) {
+		return (128 + WTERMSIG(status));
+	}
+
+	return (WEXITSTATUS(status));
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "Usage:  %s [-n period] [-r rings] [-s slots]"
+		" [-i interval-ms] [-o output] [--] command [args...]\n", argv0);
+	exit(1);
+}
+
+static size_t
+drain(struct po_trace_segment *seg, FILE *out)
+{
+	struct po_trace_record *r;
+	struct po_trace_ring *ring;
+	uint64_t head, tail;
+	uint32_t nrings;
+	size_t n = 0;
+
+	nrings = atomic_load_explicit(&seg->claimed, memory_order_relaxed);
+	nrings = MIN(nrings, seg->nrings);
+
+	for (uint32_t i = 0; i < nrings; i++) {
+		ring = po_trace_ring_at(seg, i);
+
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		for (; tail < head; tail++, n++) {
+			r = ring->records + (tail & (seg->slots - 1));
+
+			fprintf(out, "%" PRIu64 " %d %u %s %08" PRIx32
+				" %" PRId32 " %u\n", r->timestamp, ring->pid, i,
+				r->call < PO_TRACE_CALLS ? call_names[r->call]
+				: "?", r->hash, r->entry, r->matchlen);
+		}
+
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	return (n);
+}